@@ -0,0 +1,369 @@
+#pragma once
+
+#include "volk/volk.h"
+#include <vulkan/vk_enum_string_helper.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <stdexcept>
+
+// Sub-allocates buffer and image memory out of large VkDeviceMemory blocks, pooled per memory type,
+// instead of calling vkAllocateMemory once per resource.
+
+enum AllocationStrategy {
+    // General purpose. Best fit over a free list per block, neighbouring free ranges are merged on free.
+    FreeListStrategy,
+    // Bump allocation for short lived memory such as staging buffers. A block is rewound once all of its allocations are freed.
+    LinearStrategy
+};
+
+struct GpuAllocation {
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    // Points at offset inside the persistently mapped block, or nullptr if the memory is not host visible.
+    void* mapped;
+    int pool_index;
+    int block_index;
+
+    GpuAllocation() : memory(VK_NULL_HANDLE), offset(0), size(0), mapped(nullptr), pool_index(-1), block_index(-1) {
+
+    }
+};
+
+struct GpuAllocatorStats {
+    int block_count;
+    int allocation_count;
+    VkDeviceSize reserved_bytes;
+    VkDeviceSize used_bytes;
+    VkDeviceSize largest_free_range;
+    // 0 when all free memory is one contiguous range, approaching 1 as free memory is split into small ranges.
+    double fragmentation;
+
+    GpuAllocatorStats() : block_count(0), allocation_count(0), reserved_bytes(0), used_bytes(0), largest_free_range(0), fragmentation(0) {
+
+    }
+};
+
+struct MemoryBlock {
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    void* mapped;
+    // A dedicated block holds a single allocation that was too large to share a block, and is released with it.
+    bool dedicated;
+
+    // Free list strategy: offset -> size of every free range, sorted by offset.
+    std::map<VkDeviceSize, VkDeviceSize> free_ranges;
+
+    // Linear strategy: the next free offset.
+    VkDeviceSize linear_offset;
+
+    int allocation_count;
+    VkDeviceSize used_bytes;
+
+    MemoryBlock(VkDeviceMemory _memory, VkDeviceSize _size, void* _mapped, bool _dedicated) : memory(_memory), size(_size), mapped(_mapped), dedicated(_dedicated),
+                                                                                              free_ranges({{0, _size}}), linear_offset(0), allocation_count(0), used_bytes(0) {
+
+    }
+};
+
+struct MemoryPool {
+    uint32_t memory_type;
+    AllocationStrategy strategy;
+    bool host_visible;
+    std::vector<MemoryBlock> blocks;
+
+    MemoryPool(uint32_t _memory_type, AllocationStrategy _strategy, bool _host_visible) : memory_type(_memory_type), strategy(_strategy), host_visible(_host_visible) {
+
+    }
+};
+
+VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+struct GpuAllocator {
+    VkDevice device;
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    VkDeviceSize buffer_image_granularity;
+    VkDeviceSize block_size;
+    uint32_t max_memory_allocation_count;
+    uint32_t memory_allocation_count;
+    std::vector<MemoryPool> pools;
+
+    GpuAllocator() : device(VK_NULL_HANDLE), memory_properties({}), buffer_image_granularity(1), block_size(0), max_memory_allocation_count(0), memory_allocation_count(0) {
+
+    }
+
+    GpuAllocator(VkPhysicalDevice physical_device, VkDevice _device, VkDeviceSize preferred_block_size = 64 * 1024 * 1024) : device(_device), memory_allocation_count(0) {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physical_device, &properties);
+        vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties);
+
+        buffer_image_granularity = properties.limits.bufferImageGranularity;
+        max_memory_allocation_count = properties.limits.maxMemoryAllocationCount;
+
+        // Don't let a single block take up a large part of a small heap.
+        block_size = preferred_block_size;
+        for (uint32_t i = 0; i < memory_properties.memoryHeapCount; ++i) {
+            block_size = std::min(block_size, std::max<VkDeviceSize>(memory_properties.memoryHeaps[i].size / 8, 1024 * 1024));
+        }
+    }
+
+    // Images with optimal tiling are placed on bufferImageGranularity boundaries and padded to a multiple of it.
+    // Buffers never share a granularity page with such an image as a result, whichever strategy placed them.
+    GpuAllocation allocate(VkMemoryRequirements requirements, int required_memory_properties, AllocationStrategy strategy = FreeListStrategy, bool optimal_image = false) {
+        uint32_t memory_type = find_memory_type(requirements.memoryTypeBits, required_memory_properties);
+        int pool_index = get_pool(memory_type, strategy);
+        MemoryPool& pool = pools[pool_index];
+
+        VkDeviceSize alignment = requirements.alignment;
+        VkDeviceSize size = requirements.size;
+        if (optimal_image) {
+            alignment = std::max(alignment, buffer_image_granularity);
+            size = align_up(size, buffer_image_granularity);
+        }
+
+        // Resources larger than half a block get their own memory so they don't waste the rest of one.
+        if (size > block_size / 2) {
+            int block_index = create_block(pool, size, true);
+            return place(pool_index, block_index, 0, size);
+        }
+
+        for (int i = 0; i < pool.blocks.size(); ++i) {
+            VkDeviceSize offset;
+            if (pool.blocks[i].memory != VK_NULL_HANDLE && !pool.blocks[i].dedicated && find_space(pool, pool.blocks[i], size, alignment, &offset)) {
+                return place(pool_index, i, offset, size);
+            }
+        }
+
+        int block_index = create_block(pool, block_size, false);
+        VkDeviceSize offset;
+        find_space(pool, pool.blocks[block_index], size, alignment, &offset);
+        return place(pool_index, block_index, offset, size);
+    }
+
+    void free(const GpuAllocation& allocation) {
+        if (allocation.pool_index == -1) {
+            return;
+        }
+
+        MemoryPool& pool = pools[allocation.pool_index];
+        MemoryBlock& block = pool.blocks[allocation.block_index];
+
+        block.allocation_count -= 1;
+        block.used_bytes -= allocation.size;
+
+        if (pool.strategy == FreeListStrategy) {
+            // Return the range and merge it with the free ranges on either side.
+            auto inserted = block.free_ranges.emplace(allocation.offset, allocation.size).first;
+            auto next = std::next(inserted);
+            if (next != block.free_ranges.end() && inserted->first + inserted->second == next->first) {
+                inserted->second += next->second;
+                block.free_ranges.erase(next);
+            }
+            if (inserted != block.free_ranges.begin()) {
+                auto previous = std::prev(inserted);
+                if (previous->first + previous->second == inserted->first) {
+                    previous->second += inserted->second;
+                    block.free_ranges.erase(inserted);
+                }
+            }
+        } else if (block.allocation_count == 0) {
+            block.linear_offset = 0;
+        }
+
+        // Release empty blocks, but keep the first one of each pool around to avoid allocating memory again right away.
+        if (block.allocation_count == 0 && (block.dedicated || allocation.block_index != first_live_block(pool))) {
+            destroy_block(block);
+        }
+    }
+
+    GpuAllocatorStats get_stats() {
+        GpuAllocatorStats stats;
+        VkDeviceSize free_bytes = 0;
+
+        for (MemoryPool& pool : pools) {
+            for (MemoryBlock& block : pool.blocks) {
+                if (block.memory == VK_NULL_HANDLE) {
+                    continue;
+                }
+
+                stats.block_count += 1;
+                stats.allocation_count += block.allocation_count;
+                stats.reserved_bytes += block.size;
+                stats.used_bytes += block.used_bytes;
+
+                if (pool.strategy == FreeListStrategy) {
+                    for (auto [offset, size] : block.free_ranges) {
+                        free_bytes += size;
+                        stats.largest_free_range = std::max(stats.largest_free_range, size);
+                    }
+                } else {
+                    free_bytes += block.size - block.linear_offset;
+                    stats.largest_free_range = std::max(stats.largest_free_range, block.size - block.linear_offset);
+                }
+            }
+        }
+
+        stats.fragmentation = free_bytes == 0 ? 0.0 : 1.0 - static_cast<double>(stats.largest_free_range) / free_bytes;
+        return stats;
+    }
+
+    void vk_destroy() {
+        for (MemoryPool& pool : pools) {
+            for (MemoryBlock& block : pool.blocks) {
+                destroy_block(block);
+            }
+        }
+        pools.clear();
+    }
+
+    private:
+
+    uint32_t find_memory_type(uint32_t type_filter, int required_memory_properties) {
+        for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++) {
+            if ((type_filter & (1 << i)) && (memory_properties.memoryTypes[i].propertyFlags & required_memory_properties) == required_memory_properties) {
+                return i;
+            }
+        }
+
+        throw std::runtime_error("Could not find memory type that matched requirements.");
+    }
+
+    int get_pool(uint32_t memory_type, AllocationStrategy strategy) {
+        for (int i = 0; i < pools.size(); ++i) {
+            if (pools[i].memory_type == memory_type && pools[i].strategy == strategy) {
+                return i;
+            }
+        }
+
+        bool host_visible = memory_properties.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+        pools.push_back(MemoryPool(memory_type, strategy, host_visible));
+        return pools.size() - 1;
+    }
+
+    int first_live_block(MemoryPool& pool) {
+        for (int i = 0; i < pool.blocks.size(); ++i) {
+            if (pool.blocks[i].memory != VK_NULL_HANDLE && !pool.blocks[i].dedicated) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    int create_block(MemoryPool& pool, VkDeviceSize size, bool dedicated) {
+        if (memory_allocation_count >= max_memory_allocation_count) {
+            throw std::runtime_error("Reached maxMemoryAllocationCount (" + std::to_string(max_memory_allocation_count) + ") device memory allocations.");
+        }
+
+        VkMemoryAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocInfo.allocationSize = size;
+        allocInfo.memoryTypeIndex = pool.memory_type;
+
+        VkDeviceMemory memory;
+        if (VkResult result = vkAllocateMemory(device, &allocInfo, nullptr, &memory); result != VK_SUCCESS) {
+            throw std::runtime_error("Could not allocate a memory block: " + std::string(string_VkResult(result)));
+        }
+        memory_allocation_count += 1;
+
+        // Host visible blocks stay mapped for their whole lifetime, so allocations never need to map or unmap.
+        void* mapped = nullptr;
+        if (pool.host_visible) {
+            if (VkResult result = vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, &mapped); result != VK_SUCCESS) {
+                throw std::runtime_error("Could not map a memory block: " + std::string(string_VkResult(result)));
+            }
+        }
+
+        // Reuse the slot of a released block so that block indices held by live allocations stay valid.
+        for (int i = 0; i < pool.blocks.size(); ++i) {
+            if (pool.blocks[i].memory == VK_NULL_HANDLE) {
+                pool.blocks[i] = MemoryBlock(memory, size, mapped, dedicated);
+                return i;
+            }
+        }
+
+        pool.blocks.push_back(MemoryBlock(memory, size, mapped, dedicated));
+        return pool.blocks.size() - 1;
+    }
+
+    void destroy_block(MemoryBlock& block) {
+        if (block.memory == VK_NULL_HANDLE) {
+            return;
+        }
+
+        if (block.mapped != nullptr) {
+            vkUnmapMemory(device, block.memory);
+        }
+        vkFreeMemory(device, block.memory, nullptr);
+        memory_allocation_count -= 1;
+
+        block.memory = VK_NULL_HANDLE;
+        block.mapped = nullptr;
+        block.free_ranges.clear();
+    }
+
+    bool find_space(MemoryPool& pool, MemoryBlock& block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize* offset) {
+        if (pool.strategy == LinearStrategy) {
+            VkDeviceSize aligned_offset = align_up(block.linear_offset, alignment);
+            if (aligned_offset + size > block.size) {
+                return false;
+            }
+            block.linear_offset = aligned_offset + size;
+            *offset = aligned_offset;
+            return true;
+        }
+
+        // Best fit: the smallest free range that can hold the aligned allocation.
+        auto best = block.free_ranges.end();
+        for (auto range = block.free_ranges.begin(); range != block.free_ranges.end(); ++range) {
+            VkDeviceSize aligned_offset = align_up(range->first, alignment);
+            if (aligned_offset + size <= range->first + range->second && (best == block.free_ranges.end() || range->second < best->second)) {
+                best = range;
+            }
+        }
+
+        if (best == block.free_ranges.end()) {
+            return false;
+        }
+
+        // Split the range, giving back the alignment padding in front and the remainder behind.
+        VkDeviceSize range_offset = best->first;
+        VkDeviceSize range_end = best->first + best->second;
+        VkDeviceSize aligned_offset = align_up(range_offset, alignment);
+        block.free_ranges.erase(best);
+
+        if (aligned_offset > range_offset) {
+            block.free_ranges[range_offset] = aligned_offset - range_offset;
+        }
+        if (aligned_offset + size < range_end) {
+            block.free_ranges[aligned_offset + size] = range_end - (aligned_offset + size);
+        }
+
+        *offset = aligned_offset;
+        return true;
+    }
+
+    GpuAllocation place(int pool_index, int block_index, VkDeviceSize offset, VkDeviceSize size) {
+        MemoryBlock& block = pools[pool_index].blocks[block_index];
+
+        // A dedicated block is never searched, so take its whole range here.
+        if (block.dedicated) {
+            block.free_ranges.clear();
+            block.linear_offset = size;
+        }
+
+        block.allocation_count += 1;
+        block.used_bytes += size;
+
+        GpuAllocation allocation;
+        allocation.memory = block.memory;
+        allocation.offset = offset;
+        allocation.size = size;
+        allocation.mapped = block.mapped != nullptr ? static_cast<char*>(block.mapped) + offset : nullptr;
+        allocation.pool_index = pool_index;
+        allocation.block_index = block_index;
+        return allocation;
+    }
+};
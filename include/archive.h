@@ -0,0 +1,366 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <fstream>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <trace.h>
+
+// Asset archives. All assets are packed into one file that is memory-mapped once, so loading an asset is a lookup and a
+// pointer into the mapping instead of an open, read and copy per file.
+//
+// Layout: an ArchiveHeader, the payloads, each starting at a multiple of ARCHIVE_ALIGNMENT, then the table of contents at
+// toc_offset. The table holds one ArchiveEntry per asset, each followed by the asset's name.
+
+const char ARCHIVE_MAGIC[4] = {'V', 'P', 'A', 'K'};
+const uint32_t ARCHIVE_VERSION = 1;
+// Keeps payloads aligned for any reader that casts them, e.g. SPIR-V words or uint16_t tiles.
+const uint64_t ARCHIVE_ALIGNMENT = 16;
+
+enum ArchiveCompression {
+    StoredCompression,
+    LZCompression
+};
+
+struct ArchiveHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t entry_count;
+    uint32_t alignment;
+    uint64_t toc_offset;
+    uint64_t toc_size;
+};
+
+struct ArchiveEntry {
+    uint64_t offset;
+    // Size of the asset, and of its payload in the archive. They differ for compressed assets.
+    uint64_t size;
+    uint64_t stored_size;
+    // FNV-1a of the uncompressed asset.
+    uint64_t checksum;
+    uint32_t compression;
+    uint32_t name_length;
+};
+
+// Read-only memory mapping of a whole file.
+struct MappedFile {
+    const char* data;
+    size_t size;
+
+    MappedFile(const MappedFile&) = delete;
+
+    MappedFile(std::string path) {
+        int file = open(path.c_str(), O_RDONLY);
+        if (file == -1) {
+            throw std::runtime_error("Could not open " + path);
+        }
+
+        struct stat file_stat;
+        if (fstat(file, &file_stat) == -1 || file_stat.st_size == 0) {
+            close(file);
+            throw std::runtime_error("Could not map empty or unreadable file " + path);
+        }
+        size = file_stat.st_size;
+
+        void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+        // The mapping stays valid after the descriptor is closed.
+        close(file);
+        if (mapping == MAP_FAILED) {
+            throw std::runtime_error("Could not map " + path);
+        }
+        data = static_cast<const char*>(mapping);
+    }
+
+    ~MappedFile() {
+        munmap(const_cast<char*>(data), size);
+    }
+};
+
+uint64_t fnv1a_64(const char* data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ (unsigned char) data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// A small LZ77 compressor in the style of the LZ4 block format. Every sequence is a token byte holding the literal count in its
+// high and the match length minus 4 in its low nibble (15 means more length bytes follow, each adding up to 255), the literals,
+// and a 16 bit little endian match offset. The last sequence has literals only. Decompression is a tight copy loop, which
+// matters more here than ratio since assets are decompressed at load time.
+
+const int LZ_MIN_MATCH = 4;
+const int LZ_HASH_BITS = 14;
+// Each extra length byte of a match is worth at most 255 output bytes, which bounds how far an input can expand.
+const uint64_t LZ_MAX_RATIO = 255;
+
+void lz_write_length(std::vector<char>& output, size_t length) {
+    while (length >= 255) {
+        output.push_back((char) 255);
+        length -= 255;
+    }
+    output.push_back((char) length);
+}
+
+std::vector<char> lz_compress(const char* input, size_t size) {
+    std::vector<char> output = {};
+    output.reserve(size / 2 + 16);
+    std::vector<int64_t> table(1 << LZ_HASH_BITS, -1);
+
+    auto hash = [&](size_t position) {
+        uint32_t value;
+        memcpy(&value, input + position, sizeof(value));
+        return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+    };
+
+    auto write_sequence = [&](size_t literal_start, size_t literal_count, size_t offset, size_t match_length) {
+        size_t match_code = match_length >= LZ_MIN_MATCH ? match_length - LZ_MIN_MATCH : 0;
+        output.push_back((char) ((std::min<size_t>(literal_count, 15) << 4) | std::min<size_t>(match_code, 15)));
+        if (literal_count >= 15) {
+            lz_write_length(output, literal_count - 15);
+        }
+        output.insert(output.end(), input + literal_start, input + literal_start + literal_count);
+        if (match_length >= LZ_MIN_MATCH) {
+            output.push_back((char) (offset & 0xff));
+            output.push_back((char) (offset >> 8));
+            if (match_code >= 15) {
+                lz_write_length(output, match_code - 15);
+            }
+        }
+    };
+
+    size_t literal_start = 0;
+    size_t position = 0;
+    while (size >= LZ_MIN_MATCH && position + LZ_MIN_MATCH <= size) {
+        uint32_t slot = hash(position);
+        int64_t candidate = table[slot];
+        table[slot] = position;
+
+        if (candidate < 0 || position - candidate > 0xffff || memcmp(input + candidate, input + position, LZ_MIN_MATCH) != 0) {
+            position += 1;
+            continue;
+        }
+
+        size_t match_length = LZ_MIN_MATCH;
+        while (position + match_length < size && input[candidate + match_length] == input[position + match_length]) {
+            match_length += 1;
+        }
+
+        write_sequence(literal_start, position - literal_start, position - candidate, match_length);
+        position += match_length;
+        literal_start = position;
+    }
+
+    write_sequence(literal_start, size - literal_start, 0, 0);
+    return output;
+}
+
+// Throws on any input that would read or write out of bounds, so a corrupt archive cannot crash the loader.
+std::vector<char> lz_decompress(const char* input, size_t input_size, size_t output_size) {
+    std::vector<char> output(output_size);
+    size_t in = 0;
+    size_t out = 0;
+
+    auto read_length = [&](size_t length) {
+        if (length == 15) {
+            unsigned char extra;
+            do {
+                if (in >= input_size) {
+                    throw std::runtime_error("Compressed asset is truncated");
+                }
+                extra = input[in++];
+                length += extra;
+            } while (extra == 255);
+        }
+        return length;
+    };
+
+    while (in < input_size) {
+        unsigned char token = input[in++];
+
+        size_t literal_count = read_length(token >> 4);
+        if (literal_count > input_size - in || literal_count > output_size - out) {
+            throw std::runtime_error("Compressed asset has literals out of bounds");
+        }
+        memcpy(output.data() + out, input + in, literal_count);
+        in += literal_count;
+        out += literal_count;
+
+        if (in == input_size) {
+            break;
+        }
+
+        if (input_size - in < 2) {
+            throw std::runtime_error("Compressed asset is truncated");
+        }
+        size_t offset = (unsigned char) input[in] | ((size_t) (unsigned char) input[in + 1] << 8);
+        in += 2;
+        size_t match_length = read_length(token & 15) + LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || match_length > output_size - out) {
+            throw std::runtime_error("Compressed asset has a match out of bounds");
+        }
+
+        // Byte by byte, since matches may overlap their own output.
+        for (size_t i = 0; i < match_length; ++i, ++out) {
+            output[out] = output[out - offset];
+        }
+    }
+
+    if (out != output_size) {
+        throw std::runtime_error("Compressed asset decompressed to the wrong size");
+    }
+    return output;
+}
+
+// Writes assets, given as (name, contents), as an archive. With compress, assets are stored compressed when that saves at
+// least an eighth of their size; everything else is stored as is and can be read straight from the mapping.
+void write_asset_archive(std::string path, const std::vector<std::pair<std::string, std::vector<char>>>& assets, bool compress) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not write archive " + path);
+    }
+
+    ArchiveHeader header{};
+    memcpy(header.magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+    header.version = ARCHIVE_VERSION;
+    header.entry_count = assets.size();
+    header.alignment = ARCHIVE_ALIGNMENT;
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    uint64_t position = sizeof(header);
+    std::vector<char> toc = {};
+    const char padding[ARCHIVE_ALIGNMENT] = {};
+
+    for (const auto& [name, contents] : assets) {
+        uint64_t aligned = (position + ARCHIVE_ALIGNMENT - 1) / ARCHIVE_ALIGNMENT * ARCHIVE_ALIGNMENT;
+        file.write(padding, aligned - position);
+        position = aligned;
+
+        ArchiveEntry entry{};
+        entry.offset = position;
+        entry.size = contents.size();
+        entry.checksum = fnv1a_64(contents.data(), contents.size());
+        entry.compression = StoredCompression;
+        entry.name_length = name.size();
+
+        std::vector<char> compressed = {};
+        if (compress) {
+            compressed = lz_compress(contents.data(), contents.size());
+        }
+        if (compress && compressed.size() < contents.size() - contents.size() / 8) {
+            entry.compression = LZCompression;
+            entry.stored_size = compressed.size();
+            file.write(compressed.data(), compressed.size());
+        } else {
+            entry.stored_size = contents.size();
+            file.write(contents.data(), contents.size());
+        }
+        position += entry.stored_size;
+
+        toc.insert(toc.end(), reinterpret_cast<const char*>(&entry), reinterpret_cast<const char*>(&entry) + sizeof(entry));
+        toc.insert(toc.end(), name.begin(), name.end());
+    }
+
+    file.write(toc.data(), toc.size());
+    header.toc_offset = position;
+    header.toc_size = toc.size();
+    file.seekp(0);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+// An asset's bytes. Points into the archive's mapping for stored assets, so it lives as long as the archive.
+struct AssetView {
+    const char* data;
+    size_t size;
+};
+
+struct AssetArchive {
+    std::unique_ptr<MappedFile> file;
+    std::unordered_map<std::string, ArchiveEntry> entries;
+    std::unordered_map<std::string, bool> verified;
+    // Decompressed assets, kept so that views of them stay valid.
+    std::unordered_map<std::string, std::vector<char>> decompressed;
+
+    AssetArchive(const AssetArchive&) = delete;
+
+    // Reads the table of contents. Payloads are only touched when their asset is first requested.
+    AssetArchive(std::string path) : file(std::make_unique<MappedFile>(path)) {
+        TRACE_ZONE("open_asset_archive");
+        if (file->size < sizeof(ArchiveHeader)) {
+            throw std::runtime_error("Archive " + path + " is too small for its header");
+        }
+
+        ArchiveHeader header;
+        memcpy(&header, file->data, sizeof(header));
+        if (memcmp(header.magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0 || header.version != ARCHIVE_VERSION) {
+            throw std::runtime_error(path + " is not a version " + std::to_string(ARCHIVE_VERSION) + " asset archive");
+        }
+        if (header.toc_offset > file->size || header.toc_size > file->size - header.toc_offset) {
+            throw std::runtime_error("Archive " + path + " is truncated");
+        }
+
+        const char* toc = file->data + header.toc_offset;
+        uint64_t position = 0;
+        for (uint32_t i = 0; i < header.entry_count; ++i) {
+            ArchiveEntry entry;
+            if (header.toc_size - position < sizeof(entry)) {
+                throw std::runtime_error("Archive " + path + " has a truncated table of contents");
+            }
+            memcpy(&entry, toc + position, sizeof(entry));
+            position += sizeof(entry);
+
+            if (header.toc_size - position < entry.name_length || entry.offset > header.toc_offset || entry.stored_size > header.toc_offset - entry.offset) {
+                throw std::runtime_error("Archive " + path + " has an entry out of bounds");
+            }
+            // Stored assets are read straight from the mapping, and compressed ones are decompressed into a buffer of their size.
+            if ((entry.compression == StoredCompression && entry.size != entry.stored_size)
+                    || (entry.compression == LZCompression && entry.size / LZ_MAX_RATIO > entry.stored_size)) {
+                throw std::runtime_error("Archive " + path + " has an entry with an impossible size");
+            }
+            std::string name(toc + position, entry.name_length);
+            position += entry.name_length;
+
+            entries[name] = entry;
+        }
+    }
+
+    bool contains(const std::string& name) {
+        return entries.count(name) != 0;
+    }
+
+    // Checks the asset against its checksum the first time it is requested.
+    AssetView get(const std::string& name) {
+        auto it = entries.find(name);
+        if (it == entries.end()) {
+            throw std::runtime_error("Asset " + name + " is not in the archive");
+        }
+        const ArchiveEntry& entry = it->second;
+
+        AssetView view = {file->data + entry.offset, (size_t) entry.size};
+        if (entry.compression == LZCompression) {
+            auto cached = decompressed.find(name);
+            if (cached == decompressed.end()) {
+                cached = decompressed.emplace(name, lz_decompress(file->data + entry.offset, entry.stored_size, entry.size)).first;
+            }
+            view.data = cached->second.data();
+        } else if (entry.compression != StoredCompression) {
+            throw std::runtime_error("Asset " + name + " uses unknown compression " + std::to_string(entry.compression));
+        }
+
+        if (!verified[name]) {
+            if (fnv1a_64(view.data, view.size) != entry.checksum) {
+                throw std::runtime_error("Asset " + name + " does not match its checksum");
+            }
+            verified[name] = true;
+        }
+        return view;
+    }
+};
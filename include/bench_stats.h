@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+// Timing statistics shared by the benchmark programs.
+
+struct BenchSummary {
+    double mean;
+    double p50;
+    double p95;
+    double p99;
+};
+
+BenchSummary summarize(std::vector<double> samples) {
+    std::sort(samples.begin(), samples.end());
+
+    // Nearest-rank percentile.
+    auto percentile = [&samples](double p) {
+        std::size_t rank = static_cast<std::size_t>(std::ceil(p / 100.0 * samples.size()));
+        return samples[std::clamp<std::size_t>(rank, 1, samples.size()) - 1];
+    };
+
+    double total = 0;
+    for (double sample : samples) {
+        total += sample;
+    }
+
+    return {total / samples.size(), percentile(50), percentile(95), percentile(99)};
+}
+
+std::string to_json(const BenchSummary& summary) {
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "{\"mean\":%.4f,\"p50\":%.4f,\"p95\":%.4f,\"p99\":%.4f}", summary.mean, summary.p50, summary.p95, summary.p99);
+    return std::string(buffer);
+}
+
+double elapsed_ms(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
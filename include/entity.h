@@ -0,0 +1,123 @@
+#pragma once
+
+#include <init.h>
+#include <type_traits>
+
+// Entity storage. Components live in parallel arrays indexed by a dense entity index, so a system that only touches positions
+// and velocities walks two contiguous arrays. The position array has the layout of an object buffer and is copied into one as is.
+
+typedef uint32_t EntityId;
+
+struct EntityStore {
+    // Components, indexed [0, size()). Removing an entity moves the last one into its index, so indices are not stable; use
+    // EntityId to refer to an entity across frames.
+    std::vector<ObjectData> positions;
+    std::vector<glm::vec2> velocities;
+    std::vector<uint32_t> sprite_ids;
+
+    std::vector<EntityId> entity_ids;
+    // -1 for ids that are not in use.
+    std::vector<int> entity_indices;
+    std::vector<EntityId> free_ids;
+
+    EntityStore() {
+
+    }
+
+    EntityId create(glm::vec2 pos, glm::vec2 velocity = glm::vec2(0, 0), uint32_t sprite_id = 0) {
+        EntityId id;
+        if (!free_ids.empty()) {
+            id = free_ids.back();
+            free_ids.pop_back();
+        } else {
+            id = entity_indices.size();
+            entity_indices.push_back(-1);
+        }
+
+        entity_indices[id] = positions.size();
+        entity_ids.push_back(id);
+        positions.push_back(ObjectData(pos));
+        velocities.push_back(velocity);
+        sprite_ids.push_back(sprite_id);
+        return id;
+    }
+
+    void destroy(EntityId id) {
+        int index = get_index(id);
+        int last = positions.size() - 1;
+
+        positions[index] = positions[last];
+        velocities[index] = velocities[last];
+        sprite_ids[index] = sprite_ids[last];
+        entity_ids[index] = entity_ids[last];
+        entity_indices[entity_ids[index]] = index;
+
+        positions.pop_back();
+        velocities.pop_back();
+        sprite_ids.pop_back();
+        entity_ids.pop_back();
+
+        entity_indices[id] = -1;
+        free_ids.push_back(id);
+    }
+
+    bool is_alive(EntityId id) {
+        return id < entity_indices.size() && entity_indices[id] != -1;
+    }
+
+    int get_index(EntityId id) {
+        if (!is_alive(id)) {
+            throw std::runtime_error("Unknown entity " + std::to_string(id));
+        }
+        return entity_indices[id];
+    }
+
+    int size() {
+        return positions.size();
+    }
+
+    // Runs system(position, velocity, sprite_id) over every entity in index order.
+    template<class System>
+    void for_each(System system) {
+        int count = positions.size();
+        ObjectData* position_data = positions.data();
+        glm::vec2* velocity_data = velocities.data();
+        uint32_t* sprite_data = sprite_ids.data();
+        for (int i = 0; i < count; ++i) {
+            system(position_data[i].pos, velocity_data[i], sprite_data[i]);
+        }
+    }
+
+    // Moves every entity by its velocity times dt.
+    void integrate(float dt) {
+        int count = positions.size();
+        ObjectData* position_data = positions.data();
+        const glm::vec2* velocity_data = velocities.data();
+        for (int i = 0; i < count; ++i) {
+            position_data[i].pos += velocity_data[i] * dt;
+        }
+    }
+
+    // Writes the positions of all entities as instances, in index order. ObjectData is a straight copy, other instance types
+    // (e.g. PackedObjectData) are converted on the way.
+    template<class Instance>
+    void write_instances(Instance* instances) {
+        if constexpr (std::is_same_v<Instance, ObjectData>) {
+            memcpy(instances, positions.data(), sizeof(ObjectData) * positions.size());
+        } else {
+            for (int i = 0; i < positions.size(); ++i) {
+                instances[i] = Instance(positions[i]);
+            }
+        }
+    }
+
+    // Fills the frame's region of a dynamic object buffer with every entity. Instance i of the buffer is the entity at index i.
+    template<class Instance>
+    void write_instances(VertexBufferBacked<Instance>& object_buffer, int frame) {
+        if (!object_buffer.is_dynamic()) {
+            throw std::runtime_error("Entities can only be written to dynamic object buffers.");
+        }
+        object_buffer.set_length(positions.size());
+        write_instances(object_buffer.frame_data(frame));
+    }
+};
@@ -0,0 +1,333 @@
+#pragma once
+
+#include <init.h>
+
+// Recording and submission of a frame, shared by the game and the benchmark harness.
+
+// Records draws into a command buffer that is inside the render pass. Secondary command buffers inherit no state, so the
+// viewport, scissor and camera are set here rather than once per render pass. Pipelines and buffers are only rebound when they change.
+void record_draw_commands(std::shared_ptr<VkContext> context, VkCommandBuffer command_buffer, int frame, const DrawCommand* draws, int draw_count) {
+    VkViewport viewport{};
+    viewport.x = 0.0f;
+    viewport.y = 0.0f;
+    viewport.width = static_cast<float>(context->swapchain_extent.width);
+    viewport.height = static_cast<float>(context->swapchain_extent.height);
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+    vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+
+    VkRect2D scissor{};
+    scissor.offset = {0, 0};
+    scissor.extent = context->swapchain_extent;
+    vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+
+    // Every pipeline of shader_2d shares one layout, so the camera stays pushed across pipeline changes.
+    CameraPushConstants camera = context->get_camera_push_constants();
+    vkCmdPushConstants(command_buffer, context->pipelines.pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(CameraPushConstants), &camera);
+
+    int bound_pipeline_id = -1;
+    int bound_vbuffer_id = -1;
+    int bound_obuffer_id = -1;
+    int bound_texture_id = -1;
+    VertexLayout layout = FullVertexLayout;
+    const IndexBufferBacked* bound_index_buffer = nullptr;
+    for (int i = 0; i < draw_count; ++i) {
+        const DrawCommand& draw = draws[i];
+
+        // Buffer ids are only meaningful together with the layout of the pipeline, so a new pipeline rebinds everything.
+        if (draw.pipeline_id != bound_pipeline_id) {
+            vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, context->get_pipeline(draw.pipeline_id));
+            layout = context->get_pipeline_layout(draw.pipeline_id);
+            bound_pipeline_id = draw.pipeline_id;
+            bound_vbuffer_id = -1;
+            bound_obuffer_id = -1;
+        }
+
+        if (draw.texture_id != bound_texture_id) {
+            VkDescriptorSet descriptor_set = context->texture_atlas.get_descriptor_set(draw.texture_id);
+            vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, context->get_vk_pipeline_layout(draw.pipeline_id), 0, 1, &descriptor_set, 0, nullptr);
+            bound_texture_id = draw.texture_id;
+        }
+
+        if (draw.culled_draw_id != -1) {
+            // Culled draws read their instances from the compacted visible buffer and their counts from the indirect command.
+            CulledDraw& culled_draw = context->culled_draws[draw.culled_draw_id];
+            VkBuffer vertexBuffers[] = {context->get_vertex_buffer(layout, draw.vbuffer_id), culled_draw.visible_buffer};
+            VkDeviceSize offsets[] = {0, culled_draw.visible_offset(frame)};
+            vkCmdBindVertexBuffers(command_buffer, 0, 2, vertexBuffers, offsets);
+
+            if (draw.vbuffer_id != bound_vbuffer_id) {
+                bound_index_buffer = context->get_index_buffer(layout, draw.vbuffer_id);
+                if (bound_index_buffer != nullptr) {
+                    vkCmdBindIndexBuffer(command_buffer, bound_index_buffer->buffer, 0, bound_index_buffer->index_type);
+                }
+            }
+            bound_vbuffer_id = draw.vbuffer_id;
+            bound_obuffer_id = -1;
+
+            if (bound_index_buffer != nullptr) {
+                vkCmdDrawIndexedIndirect(command_buffer, culled_draw.command_buffer, culled_draw.command_offset(frame), 1, 0);
+            } else {
+                vkCmdDrawIndirect(command_buffer, culled_draw.command_buffer, culled_draw.command_offset(frame), 1, 0);
+            }
+            continue;
+        }
+
+        if (draw.vbuffer_id != bound_vbuffer_id || draw.obuffer_id != bound_obuffer_id) {
+            VkBuffer vertexBuffers[] = {context->get_vertex_buffer(layout, draw.vbuffer_id), context->get_object_buffer(layout, draw.obuffer_id)};
+            VkDeviceSize offsets[] = {0, context->get_object_buffer_offset(layout, draw.obuffer_id, frame)};
+            vkCmdBindVertexBuffers(command_buffer, 0, 2, vertexBuffers, offsets);
+
+            if (draw.vbuffer_id != bound_vbuffer_id) {
+                bound_index_buffer = context->get_index_buffer(layout, draw.vbuffer_id);
+                if (bound_index_buffer != nullptr) {
+                    vkCmdBindIndexBuffer(command_buffer, bound_index_buffer->buffer, 0, bound_index_buffer->index_type);
+                }
+            }
+
+            bound_vbuffer_id = draw.vbuffer_id;
+            bound_obuffer_id = draw.obuffer_id;
+        }
+
+        if (bound_index_buffer != nullptr) {
+            vkCmdDrawIndexed(command_buffer, bound_index_buffer->length, draw.instance_count, 0, 0, draw.first_instance);
+        } else {
+            vkCmdDraw(command_buffer, context->get_vertex_count(layout, draw.vbuffer_id), draw.instance_count, 0, draw.first_instance);
+        }
+    }
+}
+
+// Records the culling pass of every culled draw in draws, outside of the render pass. Each indirect command is reset to zero
+// instances, then the compute shader counts the visible instances into it.
+void record_culling_commands(std::shared_ptr<VkContext> context, VkCommandBuffer command_buffer, int frame, const std::vector<DrawCommand>& draws) {
+    std::vector<const DrawCommand*> culled = {};
+    for (const DrawCommand& draw : draws) {
+        if (draw.culled_draw_id != -1) {
+            culled.push_back(&draw);
+        }
+    }
+    if (culled.empty()) {
+        return;
+    }
+
+    int profiler_scope = context->gpu_profiler.begin_scope(command_buffer, frame, context->get_graphics_queue_index(), "culling");
+
+    for (const DrawCommand* draw : culled) {
+        CulledDraw& culled_draw = context->culled_draws[draw->culled_draw_id];
+        const IndexBufferBacked* index_buffer = context->get_index_buffer(FullVertexLayout, draw->vbuffer_id);
+        if (index_buffer != nullptr) {
+            VkDrawIndexedIndirectCommand indirect_command = {(uint32_t) index_buffer->length, 0, 0, 0, 0};
+            vkCmdUpdateBuffer(command_buffer, culled_draw.command_buffer, culled_draw.command_offset(frame), sizeof(indirect_command), &indirect_command);
+        } else {
+            VkDrawIndirectCommand indirect_command = {(uint32_t) context->get_vertex_count(FullVertexLayout, draw->vbuffer_id), 0, 0, 0};
+            vkCmdUpdateBuffer(command_buffer, culled_draw.command_buffer, culled_draw.command_offset(frame), sizeof(indirect_command), &indirect_command);
+        }
+    }
+
+    VkMemoryBarrier reset_barrier{};
+    reset_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    reset_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    reset_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &reset_barrier, 0, nullptr, 0, nullptr);
+
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, context->culling_pipeline.pipeline);
+    for (const DrawCommand* draw : culled) {
+        CulledDraw& culled_draw = context->culled_draws[draw->culled_draw_id];
+        vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, context->culling_pipeline.pipeline_layout, 0, 1, &culled_draw.descriptor_set, 0, nullptr);
+
+        CullPushConstants push_constants{};
+        push_constants.mesh_bounds = context->vertex_buffer_bounds[draw->vbuffer_id];
+        push_constants.view = context->cull_view;
+        push_constants.input_offset = (context->get_object_buffer_offset(FullVertexLayout, draw->obuffer_id, frame) / sizeof(ObjectData)) + draw->first_instance;
+        push_constants.instance_count = draw->instance_count;
+        push_constants.output_offset = culled_draw.visible_offset(frame) / sizeof(ObjectData);
+        push_constants.command_offset = culled_draw.command_offset(frame) / sizeof(uint32_t);
+        vkCmdPushConstants(command_buffer, context->culling_pipeline.pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullPushConstants), &push_constants);
+
+        vkCmdDispatch(command_buffer, (draw->instance_count + 63) / 64, 1, 1);
+    }
+
+    VkMemoryBarrier cull_barrier{};
+    cull_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    cull_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    cull_barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 
+                            0, 1, &cull_barrier, 0, nullptr, 0, nullptr);
+
+    context->gpu_profiler.end_scope(command_buffer, frame, profiler_scope);
+}
+
+// Records the frame into a primary command buffer. Long draw lists are split into contiguous chunks that the recording
+// scheduler's threads record into secondary command buffers in parallel, executed in chunk order to keep the draw order intact.
+// Secondary command buffers only live for one frame, so command buffers that are kept and resubmitted are always recorded inline.
+void record_command_buffer(std::shared_ptr<VkContext> context, VkCommandBuffer command_buffer, int image_index, int frame, const std::vector<DrawCommand>& draws, 
+                            bool allow_secondaries = true) {
+    TRACE_ZONE("record_command_buffer");
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = 0; // Optional
+    beginInfo.pInheritanceInfo = nullptr; // Optional
+
+    if (vkBeginCommandBuffer(command_buffer, &beginInfo) != VK_SUCCESS) {
+        throw std::runtime_error("failed to begin recording command buffer!");
+    }
+    context->gpu_profiler.begin_recording(command_buffer);
+
+    VkRenderPassBeginInfo renderPassInfo{};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    renderPassInfo.renderPass = context->pipelines.render_pass;
+    renderPassInfo.framebuffer = context->swapchain_framebuffers[image_index];
+
+    renderPassInfo.renderArea.offset = {0, 0};
+    renderPassInfo.renderArea.extent = context->swapchain_extent;
+
+    VkClearValue clearColor = {{{1.0f, 0.0f, 0.0f, 1.0f}}};
+    renderPassInfo.clearValueCount = 1;
+    renderPassInfo.pClearValues = &clearColor;
+
+    record_culling_commands(context, command_buffer, frame, draws);
+
+    int chunk_count = allow_secondaries ? context->recording_scheduler->get_chunk_count(draws.size()) : 1;
+
+    int profiler_scope = context->gpu_profiler.begin_scope(command_buffer, frame, context->get_graphics_queue_index(), "render_pass");
+
+    if (chunk_count == 1) {
+        vkCmdBeginRenderPass(command_buffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+        record_draw_commands(context, command_buffer, frame, draws.data(), draws.size());
+    } else {
+        vkCmdBeginRenderPass(command_buffer, &renderPassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+        context->recording_scheduler->reset(frame);
+        context->recording_scheduler->run(chunk_count, [&](int chunk) {
+            TRACE_ZONE("record_secondary");
+            int first = draws.size() * chunk / chunk_count;
+            int last = draws.size() * (chunk + 1) / chunk_count;
+
+            VkCommandBuffer secondary = context->recording_scheduler->begin_secondary(chunk, frame, renderPassInfo.renderPass, renderPassInfo.framebuffer);
+            record_draw_commands(context, secondary, frame, draws.data() + first, last - first);
+            if (VkResult result = vkEndCommandBuffer(secondary); result != VK_SUCCESS) {
+                throw std::runtime_error("Could not record secondary command buffer: " + std::string(string_VkResult(result)));
+            }
+        });
+
+        std::vector<VkCommandBuffer> secondaries = context->recording_scheduler->get_secondary_buffers(chunk_count, frame);
+        vkCmdExecuteCommands(command_buffer, secondaries.size(), secondaries.data());
+    }
+
+    vkCmdEndRenderPass(command_buffer);
+    context->gpu_profiler.end_scope(command_buffer, frame, profiler_scope);
+
+    if (VkResult result = vkEndCommandBuffer(command_buffer); result != VK_SUCCESS) {
+        throw std::runtime_error("Could not record command buffer: " + std::string(string_VkResult(result)));
+    }
+}
+
+bool framebuffer_resized_flag = false;
+// Slot of the upcoming frame's resources, i.e. frame_scheduler.get_slot(frame_scheduler.get_next_frame()).
+int current_frame = 0;
+
+// Waits until the GPU is done with the resources of the upcoming frame. Dynamic buffers may be written for current_frame afterwards.
+void wait_for_frame(std::shared_ptr<VkContext> context) {
+    auto wait_start = std::chrono::steady_clock::now();
+    context->frame_scheduler.wait_for_slot();
+    context->frame_pacer.add_blocked_time(wait_start, std::chrono::steady_clock::now());
+    context->frame_pacer.on_frames_retired(context->frame_scheduler.completed_frame);
+}
+
+// Call right before sampling input for the upcoming frame, after wait_for_frame. Sleeps for the frame pacer's delay, if it is
+// enabled, and starts the frame's latency measurement.
+void pace_frame(std::shared_ptr<VkContext> context) {
+    context->frame_pacer.pace();
+}
+
+// Renders and presents the draws submitted with VkContext::submit_draw since the last frame.
+void draw_frame(std::shared_ptr<VkContext> context) {
+    TRACE_ZONE("draw_frame");
+    auto wait_start = std::chrono::steady_clock::now();
+    context->frame_scheduler.wait_for_slot();
+    context->frame_pacer.on_frames_retired(context->frame_scheduler.completed_frame);
+
+    // Get the next image;
+    uint32_t image_index;
+    VkResult result = context->acquire_next_image(current_frame, &image_index);
+    context->frame_pacer.add_blocked_time(wait_start, std::chrono::steady_clock::now());
+
+    if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+        // The frame is skipped, so its draws are dropped as well.
+        context->draw_list.clear();
+        context->rebuild_swapchain();
+        return;
+    } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+        throw std::runtime_error("Could not aquire swapchain image: " + std::string(string_VkResult(result)));
+    }
+
+    // Recycle staging memory of uploads that have finished, and destroy resources the finished frames were still using. The
+    // slot's last frame has retired, so its timestamps can be read without waiting.
+    context->upload_manager.poll();
+    context->process_deferred_deletions();
+    context->gpu_profiler.collect(current_frame);
+
+    // Atlas pages that got sprites since the last frame are uploaded with this frame's uploads.
+    context->texture_atlas.upload_pages(context->upload_manager);
+
+    // Merge the submitted draws into as few draw calls as possible.
+    std::vector<DrawCommand> draws = batch_draw_commands(context->draw_list);
+    context->draw_list.clear();
+
+    // Record command buffer, or reuse the cached one if nothing has changed since it was recorded.
+    VkCommandBuffer command_buffer = context->command_buffers[current_frame];
+
+    if (context->cache_command_buffers) {
+        if (draws != context->cached_draws) {
+            context->cached_draws = draws;
+            context->invalidate_command_buffers();
+        }
+
+        bool needs_recording;
+        command_buffer = context->get_cached_command_buffer(image_index, current_frame, &needs_recording);
+        if (needs_recording) {
+            vkResetCommandBuffer(command_buffer, 0);
+            record_command_buffer(context, command_buffer, image_index, current_frame, draws, false);
+        }
+    } else {
+        vkResetCommandBuffer(command_buffer, 0);
+        record_command_buffer(context, command_buffer, image_index, current_frame, draws);
+    }
+
+    // Submit the uploads queued since the last frame ahead of the frame that may use them.
+    context->upload_manager.flush(&context->gpu_profiler);
+
+    // If the previous frame is still rendering, this one will queue behind it and the pacer can start frames later.
+    // Asking also refreshes the last retired frame, which closes the latency samples of the frames up to it.
+    uint64_t previous_frame = context->frame_scheduler.submitted_frame;
+    bool previous_frame_busy = !context->frame_scheduler.is_frame_retired(previous_frame);
+    context->frame_pacer.on_frames_retired(context->frame_scheduler.completed_frame);
+    context->frame_pacer.on_submit(previous_frame_busy, context->frame_scheduler.get_next_frame());
+
+    // Submit graphics queue, which retires the frame once it has rendered. Offscreen images are not acquired or presented, so
+    // there are no binary semaphores to wait on or signal.
+    VkSubmitInfo info {};
+    info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    info.commandBufferCount = 1;
+    info.pCommandBuffers = &command_buffer;
+    info.waitSemaphoreCount = context->headless ? 0 : 1;
+    info.pWaitSemaphores = &context->image_available_semaphores[current_frame];
+    VkPipelineStageFlags stages_to_wait_on_semaphores = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+    info.pWaitDstStageMask = &stages_to_wait_on_semaphores;
+    info.signalSemaphoreCount = context->headless ? 0 : 1;
+    info.pSignalSemaphores = &context->image_done_rendering_semaphores[current_frame];
+    context->gpu_profiler.on_submit(command_buffer, current_frame);
+    context->frame_scheduler.submit_frame(context->get_graphics_queue(), info);
+
+    // Submit presentation queue.
+    result = context->present_image(current_frame, image_index);
+
+    if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || framebuffer_resized_flag) {
+        context->rebuild_swapchain();
+        framebuffer_resized_flag = false;
+    } else if (result != VK_SUCCESS) {
+        throw std::runtime_error("Could not present swapchain image: " + std::string(string_VkResult(result)));
+    }
+
+    current_frame = context->frame_scheduler.get_slot(context->frame_scheduler.get_next_frame());
+}
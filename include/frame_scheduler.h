@@ -0,0 +1,242 @@
+#pragma once
+
+#include "volk/volk.h"
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <vulkan/vk_enum_string_helper.h>
+#include <trace.h>
+
+// Frame scheduling. Frames are numbered 1, 2, 3, ... in submission order, and a frame retires once all of its GPU work has
+// finished. With VK_KHR_timeline_semaphore one semaphore carries the number of the last retired frame, so any submission, on
+// any queue, can wait for a frame or signal one, and the CPU can check a frame without a fence. Without it, every frame slot
+// has a fence instead, and waits on the GPU side become waits on the CPU before submitting.
+//
+// Up to frames_in_flight frames may be in flight at once. Frame N uses the per-frame resources of slot get_slot(N).
+
+// VK_KHR_timeline_semaphore needs VK_KHR_get_physical_device_properties2 on the instance, which is enabled whenever it exists.
+bool instance_supports_extension(const char* name) {
+    uint32_t count = 0;
+    vkEnumerateInstanceExtensionProperties(nullptr, &count, nullptr);
+    std::vector<VkExtensionProperties> extensions(count);
+    vkEnumerateInstanceExtensionProperties(nullptr, &count, extensions.data());
+    for (const VkExtensionProperties& extension : extensions) {
+        if (std::string(extension.extensionName) == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool device_supports_extension(VkPhysicalDevice physical_device, const char* name) {
+    uint32_t count = 0;
+    vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &count, nullptr);
+    std::vector<VkExtensionProperties> extensions(count);
+    vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &count, extensions.data());
+    for (const VkExtensionProperties& extension : extensions) {
+        if (std::string(extension.extensionName) == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool supports_timeline_semaphores(VkPhysicalDevice physical_device) {
+    return instance_supports_extension(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME)
+            && device_supports_extension(physical_device, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+}
+
+struct FrameScheduler {
+    VkDevice device;
+    bool timeline;
+    int frames_in_flight;
+
+    // Timeline semaphore whose value is the last retired frame.
+    VkSemaphore semaphore;
+    // Without timeline semaphores, one fence per slot, and the frame it was last submitted with.
+    std::vector<VkFence> fences;
+    std::vector<uint64_t> fence_frames;
+
+    uint64_t submitted_frame;
+    // Last frame known to have retired. Only refreshed when asked, so it may lag behind the GPU.
+    uint64_t completed_frame;
+
+    FrameScheduler() : device(VK_NULL_HANDLE), timeline(false), frames_in_flight(0), semaphore(VK_NULL_HANDLE), submitted_frame(0), completed_frame(0) {
+
+    }
+
+    FrameScheduler(VkDevice device, bool timeline, int frames_in_flight) : device(device), timeline(timeline), frames_in_flight(frames_in_flight),
+        semaphore(VK_NULL_HANDLE), submitted_frame(0), completed_frame(0) {
+        if (frames_in_flight < 1) {
+            throw std::runtime_error("At least one frame must be allowed in flight.");
+        }
+
+        if (timeline) {
+            VkSemaphoreTypeCreateInfo type_info{};
+            type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+            type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+            type_info.initialValue = 0;
+
+            VkSemaphoreCreateInfo semaphore_info{};
+            semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+            semaphore_info.pNext = &type_info;
+            if (VkResult result = vkCreateSemaphore(device, &semaphore_info, nullptr, &semaphore); result != VK_SUCCESS) {
+                throw std::runtime_error("Could not create the frame timeline semaphore: " + std::string(string_VkResult(result)));
+            }
+        } else {
+            VkFenceCreateInfo fence_info{};
+            fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+            fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+            fences.resize(frames_in_flight);
+            fence_frames.resize(frames_in_flight, 0);
+            for (VkFence& fence : fences) {
+                if (VkResult result = vkCreateFence(device, &fence_info, nullptr, &fence); result != VK_SUCCESS) {
+                    throw std::runtime_error("Could not create a frame fence: " + std::string(string_VkResult(result)));
+                }
+            }
+        }
+    }
+
+    uint64_t get_next_frame() {
+        return submitted_frame + 1;
+    }
+
+    int get_slot(uint64_t frame) {
+        return (frame - 1) % frames_in_flight;
+    }
+
+    // Asks the device for the last retired frame, without blocking.
+    uint64_t get_completed_frame() {
+        if (timeline) {
+            uint64_t value;
+            if (VkResult result = vkGetSemaphoreCounterValueKHR(device, semaphore, &value); result != VK_SUCCESS) {
+                throw std::runtime_error("Could not read the frame timeline semaphore: " + std::string(string_VkResult(result)));
+            }
+            completed_frame = std::max(completed_frame, value);
+        } else {
+            // Frames retire in order, so the oldest frame still in flight bounds the completed ones.
+            for (uint64_t frame = completed_frame + 1; frame <= submitted_frame; ++frame) {
+                int slot = get_slot(frame);
+                if (fence_frames[slot] != frame || vkGetFenceStatus(device, fences[slot]) != VK_SUCCESS) {
+                    break;
+                }
+                completed_frame = frame;
+            }
+        }
+        return completed_frame;
+    }
+
+    bool is_frame_retired(uint64_t frame) {
+        return frame <= completed_frame || frame <= get_completed_frame();
+    }
+
+    void wait_for_frame(uint64_t frame) {
+        if (frame > submitted_frame) {
+            throw std::runtime_error("Waiting for frame " + std::to_string(frame) + ", which has not been submitted.");
+        }
+        if (frame <= completed_frame) {
+            return;
+        }
+
+        TRACE_ZONE("wait_for_frame");
+        if (timeline) {
+            VkSemaphoreWaitInfo wait_info{};
+            wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+            wait_info.semaphoreCount = 1;
+            wait_info.pSemaphores = &semaphore;
+            wait_info.pValues = &frame;
+            if (VkResult result = vkWaitSemaphoresKHR(device, &wait_info, UINT64_MAX); result != VK_SUCCESS) {
+                throw std::runtime_error("Could not wait for frame " + std::to_string(frame) + ": " + std::string(string_VkResult(result)));
+            }
+        } else {
+            // Earlier frames in the same slot are done too, and later ones cannot have been submitted without waiting for this one.
+            int slot = get_slot(frame);
+            vkWaitForFences(device, 1, &fences[slot], VK_TRUE, UINT64_MAX);
+        }
+        completed_frame = std::max(completed_frame, frame);
+    }
+
+    // Waits until the slot of the next frame is free, i.e. until frame next - frames_in_flight has retired.
+    void wait_for_slot() {
+        if (get_next_frame() > frames_in_flight) {
+            wait_for_frame(get_next_frame() - frames_in_flight);
+        }
+    }
+
+    // Submits info to queue, keeping its binary semaphores. If wait_frame is not 0, the work first waits at wait_stage until that
+    // frame has retired. If signal_frame is not 0, the work retires that frame when it finishes; only the last submission of a
+    // frame may signal it, and frames must be signaled in order.
+    VkResult submit(VkQueue queue, const VkSubmitInfo& info, uint64_t wait_frame = 0, VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                    uint64_t signal_frame = 0) {
+        TRACE_ZONE("queue_submit");
+        VkFence fence = VK_NULL_HANDLE;
+        if (!timeline) {
+            if (wait_frame != 0) {
+                wait_for_frame(wait_frame);
+            }
+            if (signal_frame != 0) {
+                int slot = get_slot(signal_frame);
+                vkResetFences(device, 1, &fences[slot]);
+                fence_frames[slot] = signal_frame;
+                fence = fences[slot];
+            }
+            return vkQueueSubmit(queue, 1, &info, fence);
+        }
+
+        // Binary semaphores take a value too, which is ignored.
+        std::vector<VkSemaphore> wait_semaphores(info.pWaitSemaphores, info.pWaitSemaphores + info.waitSemaphoreCount);
+        std::vector<VkPipelineStageFlags> wait_stages(info.pWaitDstStageMask, info.pWaitDstStageMask + info.waitSemaphoreCount);
+        std::vector<uint64_t> wait_values(info.waitSemaphoreCount, 0);
+        if (wait_frame != 0) {
+            wait_semaphores.push_back(semaphore);
+            wait_stages.push_back(wait_stage);
+            wait_values.push_back(wait_frame);
+        }
+
+        std::vector<VkSemaphore> signal_semaphores(info.pSignalSemaphores, info.pSignalSemaphores + info.signalSemaphoreCount);
+        std::vector<uint64_t> signal_values(info.signalSemaphoreCount, 0);
+        if (signal_frame != 0) {
+            signal_semaphores.push_back(semaphore);
+            signal_values.push_back(signal_frame);
+        }
+
+        VkTimelineSemaphoreSubmitInfo timeline_info{};
+        timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timeline_info.waitSemaphoreValueCount = wait_values.size();
+        timeline_info.pWaitSemaphoreValues = wait_values.data();
+        timeline_info.signalSemaphoreValueCount = signal_values.size();
+        timeline_info.pSignalSemaphoreValues = signal_values.data();
+
+        VkSubmitInfo timeline_submit = info;
+        timeline_submit.pNext = &timeline_info;
+        timeline_submit.waitSemaphoreCount = wait_semaphores.size();
+        timeline_submit.pWaitSemaphores = wait_semaphores.data();
+        timeline_submit.pWaitDstStageMask = wait_stages.data();
+        timeline_submit.signalSemaphoreCount = signal_semaphores.size();
+        timeline_submit.pSignalSemaphores = signal_semaphores.data();
+        return vkQueueSubmit(queue, 1, &timeline_submit, fence);
+    }
+
+    // Submits the last work of the next frame, which retires it, and returns its number.
+    uint64_t submit_frame(VkQueue queue, const VkSubmitInfo& info) {
+        uint64_t frame = get_next_frame();
+        if (VkResult result = submit(queue, info, 0, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame); result != VK_SUCCESS) {
+            throw std::runtime_error("Could not submit frame " + std::to_string(frame) + ": " + std::string(string_VkResult(result)));
+        }
+        submitted_frame = frame;
+        return frame;
+    }
+
+    // The device must be idle.
+    void vk_destroy() {
+        if (semaphore != VK_NULL_HANDLE) {
+            vkDestroySemaphore(device, semaphore, nullptr);
+            semaphore = VK_NULL_HANDLE;
+        }
+        for (VkFence fence : fences) {
+            vkDestroyFence(device, fence, nullptr);
+        }
+        fences.clear();
+    }
+};
@@ -0,0 +1,173 @@
+#pragma once
+
+#include "volk/volk.h"
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <deque>
+#include <stdexcept>
+#include <vulkan/vk_enum_string_helper.h>
+#include <trace.h>
+
+// GPU profiling with timestamp queries. A scope is a named pair of timestamps written around some GPU work, e.g. a render pass
+// or a batch of uploads. Every frame slot has its own query pool, and each scope name owns a fixed pair of queries in it, so
+// command buffers that are recorded once and resubmitted keep writing the same queries.
+//
+// Timestamps are read back once the frame that wrote them has retired, so reading never waits on the GPU. When tracing, each
+// reading is also added to the CPU trace as a counter named after its scope, next to the frame that read it.
+
+// The GPU time spent in one scope of a frame.
+struct GpuScopeTiming {
+    std::string name;
+    double ms;
+};
+
+struct GpuProfiler {
+    VkDevice device;
+    // Nanoseconds per timestamp tick.
+    float timestamp_period;
+    // Valid timestamp bits of each queue family. Families with none cannot be profiled.
+    std::vector<uint32_t> timestamp_valid_bits;
+    std::vector<VkQueueFlags> queue_flags;
+    uint32_t max_scopes;
+
+    std::vector<VkQueryPool> query_pools;
+    // A deque, so that the names stay put for the trace counters that point to them.
+    std::deque<std::string> scope_names;
+    std::unordered_map<std::string, int> scope_ids;
+    // Queue family each scope was last recorded for, whose valid bits its timestamps have.
+    std::vector<uint32_t> scope_queue_families;
+
+    // Scopes recorded into each command buffer, and scopes submitted into each frame slot since its results were last read.
+    std::unordered_map<VkCommandBuffer, std::vector<int>> recorded_scopes;
+    std::vector<std::vector<int>> submitted_scopes;
+
+    // Timings of the most recently read frame, in the order its scopes were submitted.
+    std::vector<GpuScopeTiming> results;
+
+    GpuProfiler() : device(VK_NULL_HANDLE), timestamp_period(0), max_scopes(0) {
+
+    }
+
+    GpuProfiler(VkPhysicalDevice physical_device, VkDevice device, int frames_in_flight, uint32_t max_scopes = 32) : device(device), max_scopes(max_scopes),
+        submitted_scopes(frames_in_flight) {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physical_device, &properties);
+        timestamp_period = properties.limits.timestampPeriod;
+
+        uint32_t family_count = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &family_count, nullptr);
+        std::vector<VkQueueFamilyProperties> families(family_count);
+        vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &family_count, families.data());
+        for (const VkQueueFamilyProperties& family : families) {
+            timestamp_valid_bits.push_back(family.timestampValidBits);
+            queue_flags.push_back(family.queueFlags);
+        }
+
+        VkQueryPoolCreateInfo pool_info{};
+        pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        pool_info.queryCount = max_scopes * 2;
+        query_pools.resize(frames_in_flight);
+        for (VkQueryPool& query_pool : query_pools) {
+            if (VkResult result = vkCreateQueryPool(device, &pool_info, nullptr, &query_pool); result != VK_SUCCESS) {
+                throw std::runtime_error("Could not create timestamp query pool: " + std::string(string_VkResult(result)));
+            }
+        }
+    }
+
+    // Scopes reset their queries in the command buffer they are recorded into, and vkCmdResetQueryPool needs a graphics or
+    // compute queue, so transfer only families cannot be profiled either.
+    bool supports_queue(uint32_t queue_family_index) {
+        return queue_family_index < timestamp_valid_bits.size() && timestamp_valid_bits[queue_family_index] != 0
+                && (queue_flags[queue_family_index] & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) != 0;
+    }
+
+    int get_scope_id(const std::string& name) {
+        if (auto it = scope_ids.find(name); it != scope_ids.end()) {
+            return it->second;
+        }
+        if (scope_names.size() >= max_scopes) {
+            throw std::runtime_error("Too many GPU profiler scopes, could not add " + name);
+        }
+        scope_ids[name] = scope_names.size();
+        scope_names.push_back(name);
+        scope_queue_families.push_back(0);
+        return scope_names.size() - 1;
+    }
+
+    // Call whenever command_buffer is (re)recorded, before any scope is written into it.
+    void begin_recording(VkCommandBuffer command_buffer) {
+        recorded_scopes[command_buffer].clear();
+    }
+
+    // Writes the start of a scope into command_buffer, which runs on queue_family_index as part of the frame in slot. Must be
+    // recorded outside of a render pass. Returns -1, and writes nothing, if the queue family cannot be profiled.
+    int begin_scope(VkCommandBuffer command_buffer, int slot, uint32_t queue_family_index, const std::string& name) {
+        if (!supports_queue(queue_family_index)) {
+            return -1;
+        }
+
+        int scope = get_scope_id(name);
+        scope_queue_families[scope] = queue_family_index;
+        vkCmdResetQueryPool(command_buffer, query_pools[slot], scope * 2, 2);
+        vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, query_pools[slot], scope * 2);
+        recorded_scopes[command_buffer].push_back(scope);
+        return scope;
+    }
+
+    void end_scope(VkCommandBuffer command_buffer, int slot, int scope) {
+        if (scope != -1) {
+            vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pools[slot], scope * 2 + 1);
+        }
+    }
+
+    // Call when command_buffer is submitted as part of the frame in slot.
+    void on_submit(VkCommandBuffer command_buffer, int slot) {
+        if (auto it = recorded_scopes.find(command_buffer); it != recorded_scopes.end()) {
+            submitted_scopes[slot].insert(submitted_scopes[slot].end(), it->second.begin(), it->second.end());
+        }
+    }
+
+    // Reads the timestamps of the frame last submitted in slot into results. The frame must have retired, and this must be
+    // called before anything new is submitted in slot. Does nothing if no scopes were submitted since the last read.
+    void collect(int slot) {
+        if (submitted_scopes[slot].empty()) {
+            return;
+        }
+
+        results.clear();
+        for (int scope : submitted_scopes[slot]) {
+            // Begin and end timestamps, each followed by its availability.
+            uint64_t values[4] = {};
+            VkResult result = vkGetQueryPoolResults(device, query_pools[slot], scope * 2, 2, sizeof(values), values, 2 * sizeof(uint64_t),
+                                                    VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+            if ((result != VK_SUCCESS && result != VK_NOT_READY) || values[1] == 0 || values[3] == 0) {
+                continue;
+            }
+            // Timestamps wrap around at their valid bits.
+            uint32_t valid_bits = timestamp_valid_bits[scope_queue_families[scope]];
+            uint64_t mask = valid_bits >= 64 ? ~0ull : (1ull << valid_bits) - 1;
+            results.push_back({scope_names[scope], ((values[2] - values[0]) & mask) * timestamp_period / 1e6});
+            TRACE_COUNTER(scope_names[scope].c_str(), results.back().ms);
+        }
+        submitted_scopes[slot].clear();
+    }
+
+    // Milliseconds the most recently read frame spent in the named scope, or -1 if it has no timing for it.
+    double get_result(const std::string& name) {
+        for (const GpuScopeTiming& timing : results) {
+            if (timing.name == name) {
+                return timing.ms;
+            }
+        }
+        return -1;
+    }
+
+    void vk_destroy() {
+        for (VkQueryPool query_pool : query_pools) {
+            vkDestroyQueryPool(device, query_pool, nullptr);
+        }
+        query_pools.clear();
+    }
+};
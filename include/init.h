@@ -14,6 +14,8 @@ it is simple and needed no modifications for my use case.
 
 */
 
+#pragma once
+
 #define VK_ENABLE_BETA_EXTENSIONS
 #include "volk/volk.h"
 #include <SDL2/SDL.h>
@@ -24,8 +26,21 @@ it is simple and needed no modifications for my use case.
 #include <set>
 #include <unordered_map>
 #include <fstream>
+#include <deque>
+#include <type_traits>
+#include <cstddef>
 #include <vulkan/vk_enum_string_helper.h>
 #include <glm/glm.hpp>
+#include <allocator.h>
+#include <pipeline_cache.h>
+#include <recording.h>
+#include <mesh.h>
+#include <spatial.h>
+#include <archive.h>
+#include <pacing.h>
+#include <frame_scheduler.h>
+#include <gpu_profiler.h>
+#include <trace.h>
 
 typedef std::unordered_map<std::string, std::function<bool(VkQueueFamilyProperties, VkPhysicalDevice, VkSurfaceKHR, int)>> QUEUE_REQUIREMENT_TYPE;
 
@@ -46,6 +61,33 @@ const QUEUE_REQUIREMENT_TYPE default_queue_requirements = {
     }
 };
 
+// Offscreen rendering has no surface to present to, so only a graphics queue is needed.
+const QUEUE_REQUIREMENT_TYPE headless_queue_requirements = { 
+    {
+        "graphics_queue", 
+        [](VkQueueFamilyProperties properties, VkPhysicalDevice physical_device, VkSurfaceKHR surface, int index) {
+            return properties.queueFlags & VK_QUEUE_GRAPHICS_BIT;
+        }
+    }
+};
+
+// Queues that are created when the device has a suitable family, and otherwise fall back to the graphics queue.
+// Both only accept families without the graphics bit, so that their work can overlap rendering instead of queueing behind it.
+const QUEUE_REQUIREMENT_TYPE optional_queue_requirements = { 
+    {
+        "transfer_queue", 
+        [](VkQueueFamilyProperties properties, VkPhysicalDevice physical_device, VkSurfaceKHR surface, int index) {
+            return (properties.queueFlags & VK_QUEUE_TRANSFER_BIT) && !(properties.queueFlags & VK_QUEUE_GRAPHICS_BIT);
+        }
+    }, 
+    {
+        "compute_queue", 
+        [](VkQueueFamilyProperties properties, VkPhysicalDevice physical_device, VkSurfaceKHR surface, int index) {
+            return (properties.queueFlags & VK_QUEUE_COMPUTE_BIT) && !(properties.queueFlags & VK_QUEUE_GRAPHICS_BIT);
+        }
+    }
+};
+
 enum OS {
     MacOS,
     Linux,
@@ -83,6 +125,7 @@ void load_vulkan() {
 }
 
 void sdl_init() {
+    TRACE_ZONE("sdl_init");
     if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS) != 0) {
         SDL_Quit();
         throw std::runtime_error("SDL2 Initialization failed: " + std::string(SDL_GetError()));
@@ -103,6 +146,7 @@ SDL_Window* get_sdl_window() {
 // Create Vulkan Types
 
 VkInstance get_vk_instance(SDL_Window* window) {
+    TRACE_ZONE("create_instance");
     VkApplicationInfo appInfo = {};
     appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
     appInfo.pApplicationName = "RPG";
@@ -115,15 +159,22 @@ VkInstance get_vk_instance(SDL_Window* window) {
     createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
     createInfo.pApplicationInfo = &appInfo;
 
+    // A headless context has no window and therefore needs no surface extensions.
     unsigned int count = 0;
-    SDL_Vulkan_GetInstanceExtensions(window, &count, NULL);
-    std::vector<const char*> instance_extensions = std::vector<const char*>(count);
-    SDL_Vulkan_GetInstanceExtensions(window, &count, instance_extensions.data());
+    std::vector<const char*> instance_extensions = {};
+    if (window != nullptr) {
+        SDL_Vulkan_GetInstanceExtensions(window, &count, NULL);
+        instance_extensions.resize(count);
+        SDL_Vulkan_GetInstanceExtensions(window, &count, instance_extensions.data());
+    }
 
     if (current_os == MacOS) {
         createInfo.flags |= VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHR;
         instance_extensions.push_back(VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME);
         instance_extensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+    } else if (instance_supports_extension(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME)) {
+        // Needed for timeline semaphores on Vulkan 1.0 devices.
+        instance_extensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
     }
 
     std::cout << "Loading required instance extensions..." << std::endl;
@@ -186,7 +237,62 @@ bool find_required_queue_indices(VkPhysicalDevice physical_device, VkSurfaceKHR
     return false;
 }
 
-VkPhysicalDevice choose_physical_device(std::vector<VkPhysicalDevice> devices, VkSurfaceKHR surface, QUEUE_REQUIREMENT_TYPE requirements) {
+// For each optional queue, pick the matching family with the fewest capabilities (e.g. a DMA-only family for transfers).
+// Queues with no matching family are left out of indices_map.
+void find_optional_queue_indices(VkPhysicalDevice physical_device, VkSurfaceKHR surface, 
+                                QUEUE_REQUIREMENT_TYPE requirements, std::unordered_map<int, std::vector<std::string>>& indices_map) {
+    unsigned int count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &count, NULL);
+    std::vector<VkQueueFamilyProperties> families(count);
+    vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &count, families.data());
+
+    auto capability_count = [](VkQueueFlags flags) {
+        return (flags & VK_QUEUE_GRAPHICS_BIT ? 1 : 0) + (flags & VK_QUEUE_COMPUTE_BIT ? 1 : 0) + (flags & VK_QUEUE_TRANSFER_BIT ? 1 : 0);
+    };
+
+    for (auto [queue_name, queue_requirements] : requirements) {
+        int best_index = -1;
+        for (uint32_t i = 0; i < count; ++i) {
+            if (queue_requirements(families[i], physical_device, surface, i) 
+                    && (best_index == -1 || capability_count(families[i].queueFlags) < capability_count(families[best_index].queueFlags))) {
+                best_index = i;
+            }
+        }
+
+        if (best_index != -1) {
+            indices_map[best_index].push_back(queue_name);
+        }
+    }
+}
+
+// Which present mode the swapchain uses, from lowest latency to least tearing and stutter. Modes a surface does not support fall
+// back along the list in get_present_mode_preferences, down to FIFO, which every surface supports.
+enum PresentPolicy {
+    // IMMEDIATE: frames are shown as soon as they are done, and may tear.
+    LowLatencyPresentPolicy,
+    // MAILBOX: no tearing, and a newer frame replaces one that is still waiting for the display.
+    MailboxPresentPolicy,
+    // FIFO_RELAXED: vsync, but a frame that misses its refresh is shown right away instead of a refresh later, and may tear.
+    RelaxedVsyncPresentPolicy,
+    // FIFO: vsync. Lowest power use, highest latency.
+    VsyncPresentPolicy
+};
+
+std::vector<VkPresentModeKHR> get_present_mode_preferences(PresentPolicy policy) {
+    switch (policy) {
+        case LowLatencyPresentPolicy:
+            return {VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR, VK_PRESENT_MODE_FIFO_KHR};
+        case MailboxPresentPolicy:
+            return {VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_FIFO_KHR};
+        case RelaxedVsyncPresentPolicy:
+            return {VK_PRESENT_MODE_FIFO_RELAXED_KHR, VK_PRESENT_MODE_FIFO_KHR};
+        default:
+            return {VK_PRESENT_MODE_FIFO_KHR};
+    }
+}
+
+VkPhysicalDevice choose_physical_device(std::vector<VkPhysicalDevice> devices, VkSurfaceKHR surface, QUEUE_REQUIREMENT_TYPE requirements, 
+                                        PresentPolicy present_policy = MailboxPresentPolicy) {
     std::vector<std::tuple<VkPhysicalDevice, int>> device_scores = {};
 
     for (VkPhysicalDevice device : devices) {
@@ -203,6 +309,13 @@ VkPhysicalDevice choose_physical_device(std::vector<VkPhysicalDevice> devices, V
             continue;
         }
 
+        // Without a surface (headless), any device with the required queues will do. This includes software
+        // implementations such as Mesa's lavapipe, which can be forced by pointing VK_ICD_FILENAMES at its ICD.
+        if (surface == VK_NULL_HANDLE) {
+            device_scores.push_back(std::tie(device, device_score));
+            continue;
+        }
+
         // Get surface capabilities.
         VkSurfaceCapabilitiesKHR caps;
         vkGetPhysicalDeviceSurfaceCapabilitiesKHR(device, surface, &caps);
@@ -237,8 +350,10 @@ VkPhysicalDevice choose_physical_device(std::vector<VkPhysicalDevice> devices, V
             }
         }
 
+        // Prefer devices that support the mode the present policy asks for.
+        VkPresentModeKHR preferred_present_mode = get_present_mode_preferences(present_policy)[0];
         for (const auto& availablePresentMode : presentModes) {
-            if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR) {
+            if (availablePresentMode == preferred_present_mode) {
                 device_score += 100;
             }
         }
@@ -257,7 +372,9 @@ VkPhysicalDevice choose_physical_device(std::vector<VkPhysicalDevice> devices, V
 }
 
 void get_vk_devices_and_queues(VkInstance instance, VkSurfaceKHR surface, VkPhysicalDevice& physical_device, VkDevice& logical_device, 
-                                std::unordered_map<std::string, VkQueueWrapper>& queue_map, QUEUE_REQUIREMENT_TYPE queue_requirement_map = default_queue_requirements) {
+                                std::unordered_map<std::string, VkQueueWrapper>& queue_map, QUEUE_REQUIREMENT_TYPE queue_requirement_map = default_queue_requirements,
+                                QUEUE_REQUIREMENT_TYPE optional_queue_requirement_map = optional_queue_requirements, PresentPolicy present_policy = MailboxPresentPolicy) {
+    TRACE_ZONE("create_device");
     // Get a list of all physical devices.
     uint32_t deviceCount = 0;
     vkEnumeratePhysicalDevices(instance, &deviceCount, nullptr);
@@ -268,12 +385,13 @@ void get_vk_devices_and_queues(VkInstance instance, VkSurfaceKHR surface, VkPhys
     vkEnumeratePhysicalDevices(instance, &deviceCount, devices.data());
 
     // Choose the most suitable physical device.
-    physical_device = choose_physical_device(devices, surface, queue_requirement_map);
+    physical_device = choose_physical_device(devices, surface, queue_requirement_map, present_policy);
 
     // Get the queue indices for each of the required queues.
     std::unordered_map<int, std::vector<std::string>> queue_index_map = {};
     find_required_queue_indices(physical_device, surface, queue_requirement_map, &queue_index_map);
-    
+    find_optional_queue_indices(physical_device, surface, optional_queue_requirement_map, queue_index_map);
+
     std::vector<VkDeviceQueueCreateInfo> queueCreateInfos = std::vector<VkDeviceQueueCreateInfo>();
     float priority = 1.0f;
 
@@ -290,11 +408,23 @@ void get_vk_devices_and_queues(VkInstance instance, VkSurfaceKHR surface, VkPhys
     VkPhysicalDeviceFeatures deviceFeatures{};
 
     // Determine the necessary device extensions.
-    std::vector<const char*> device_extensions = {"VK_KHR_swapchain"};
+    std::vector<const char*> device_extensions = {};
+    if (surface != VK_NULL_HANDLE) {
+        device_extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+    }
     if (current_os == MacOS) {
         device_extensions.push_back(VK_KHR_PORTABILITY_SUBSET_EXTENSION_NAME);
     }
 
+    // Timeline semaphores are used for frame scheduling where available. See frame_scheduler.h.
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline_semaphore_features{};
+    timeline_semaphore_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+    timeline_semaphore_features.timelineSemaphore = VK_TRUE;
+    bool timeline_semaphores = supports_timeline_semaphores(physical_device);
+    if (timeline_semaphores) {
+        device_extensions.push_back(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+    }
+
     std::cout << "Loading required device extensions..." << std::endl;
     for (unsigned int i = 0; i < device_extensions.size(); ++i) {
         std::cout << " - " << device_extensions[i] << std::endl;
@@ -305,6 +435,7 @@ void get_vk_devices_and_queues(VkInstance instance, VkSurfaceKHR surface, VkPhys
     createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
     createInfo.pQueueCreateInfos = queueCreateInfos.data();
     createInfo.queueCreateInfoCount = queueCreateInfos.size();
+    createInfo.pNext = timeline_semaphores ? &timeline_semaphore_features : nullptr;
     createInfo.pEnabledFeatures = &deviceFeatures;
     createInfo.enabledLayerCount = 0;
     createInfo.enabledExtensionCount = device_extensions.size();
@@ -323,6 +454,14 @@ void get_vk_devices_and_queues(VkInstance instance, VkSurfaceKHR surface, VkPhys
             queue_map[queue_name] = VkQueueWrapper(queue, index);
         }
     }
+
+    // Optional queues without a dedicated family share the graphics queue.
+    for (auto [queue_name, queue_requirements] : optional_queue_requirement_map) {
+        if (queue_map.find(queue_name) == queue_map.end()) {
+            std::cout << "No dedicated family for " << queue_name << ", falling back to the graphics queue." << std::endl;
+            queue_map[queue_name] = queue_map["graphics_queue"];
+        }
+    }
 }
 
 VkSurfaceFormatKHR chooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR>& availableFormats) {
@@ -335,10 +474,10 @@ VkSurfaceFormatKHR chooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR>
     return availableFormats[0];
 }
 
-VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& availablePresentModes) {
-    for (const auto& availablePresentMode : availablePresentModes) {
-        if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR) {
-            return availablePresentMode;
+VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& availablePresentModes, PresentPolicy policy = MailboxPresentPolicy) {
+    for (VkPresentModeKHR preferredPresentMode : get_present_mode_preferences(policy)) {
+        if (std::find(availablePresentModes.begin(), availablePresentModes.end(), preferredPresentMode) != availablePresentModes.end()) {
+            return preferredPresentMode;
         }
     }
 
@@ -366,7 +505,9 @@ VkExtent2D chooseSwapExtent(const VkSurfaceCapabilitiesKHR& capabilities, SDL_Wi
 
 void get_vk_swapchain_and_images(SDL_Window* window, VkSurfaceKHR surface, VkPhysicalDevice physical_device, VkDevice device, 
                                 VkQueueWrapper graphics_queue, VkQueueWrapper presentation_queue, VkSwapchainKHR& swapchain, std::vector<VkImage>& images, std::vector<VkImageView>& imageViews, 
-                                VkFormat& format, VkExtent2D& extent, int preferred_additional_image_count = 1) {
+                                VkFormat& format, VkExtent2D& extent, VkPresentModeKHR& present_mode, PresentPolicy present_policy = MailboxPresentPolicy, 
+                                int preferred_additional_image_count = 1, VkSwapchainKHR old_swapchain = VK_NULL_HANDLE) {
+    TRACE_ZONE("create_swapchain");
     // Get surface capabilities.
     VkSurfaceCapabilitiesKHR caps;
     vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physical_device, surface, &caps);
@@ -385,8 +526,9 @@ void get_vk_swapchain_and_images(SDL_Window* window, VkSurfaceKHR surface, VkPhy
     std::vector<VkPresentModeKHR> presentModes (presentModeCount);
     vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device, surface, &presentModeCount, presentModes.data());
 
+    // More images let the CPU run further ahead of the display, which smooths out uneven frames at the cost of latency.
     // Don't go over the maximum image count for the implementation.
-    uint32_t imageCount = caps.minImageCount + preferred_additional_image_count;
+    uint32_t imageCount = caps.minImageCount + std::max(preferred_additional_image_count, 0);
     while (caps.maxImageCount > 0 && imageCount > caps.maxImageCount) {
         --imageCount;
     }
@@ -394,7 +536,8 @@ void get_vk_swapchain_and_images(SDL_Window* window, VkSurfaceKHR surface, VkPhy
     extent = chooseSwapExtent(caps, window);
     VkSurfaceFormatKHR surfaceFormat = chooseSwapSurfaceFormat(formats);
     format = surfaceFormat.format;
-    VkPresentModeKHR presentMode = chooseSwapPresentMode(presentModes);
+    VkPresentModeKHR presentMode = chooseSwapPresentMode(presentModes, present_policy);
+    present_mode = presentMode;
 
     VkSwapchainCreateInfoKHR createInfo{};
     createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
@@ -423,7 +566,8 @@ void get_vk_swapchain_and_images(SDL_Window* window, VkSurfaceKHR surface, VkPhy
     createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
     createInfo.presentMode = presentMode;
     createInfo.clipped = VK_TRUE;
-    createInfo.oldSwapchain = VK_NULL_HANDLE;
+    // The old swapchain is retired by this call, even if it fails, but must still be destroyed by the caller.
+    createInfo.oldSwapchain = old_swapchain;
 
     if (VkResult result = vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapchain); result != VK_SUCCESS) {
         throw std::runtime_error("Couldn't create the swapchain: " + std::string(string_VkResult(result)));
@@ -457,6 +601,67 @@ void get_vk_swapchain_and_images(SDL_Window* window, VkSurfaceKHR surface, VkPhy
     }
 }
 
+// Creates images owned by the context to render into in place of swapchain images when running headless.
+void get_vk_offscreen_images(VkPhysicalDevice physical_device, GpuAllocator& allocator, VkDevice device, VkFormat format, VkExtent2D extent, int image_count, 
+                                std::vector<VkImage>& images, std::vector<GpuAllocation>& images_memory, std::vector<VkImageView>& imageViews) {
+    // Swapchain formats are checked by the surface, but nothing guarantees that an offscreen format can be rendered to.
+    VkFormatProperties format_properties;
+    vkGetPhysicalDeviceFormatProperties(physical_device, format, &format_properties);
+    if ((format_properties.optimalTilingFeatures & VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT) == 0) {
+        throw std::runtime_error("Offscreen format " + std::string(string_VkFormat(format)) + " cannot be used as a color attachment.");
+    }
+
+    images.resize(image_count);
+    images_memory.resize(image_count);
+    imageViews.resize(image_count);
+
+    VkImageCreateInfo imageCreateInfo{};
+    imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageCreateInfo.format = format;
+    imageCreateInfo.extent = {extent.width, extent.height, 1};
+    imageCreateInfo.mipLevels = 1;
+    imageCreateInfo.arrayLayers = 1;
+    imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    // TRANSFER_SRC allows the rendered frame to be read back for regression tests.
+    imageCreateInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    VkImageViewCreateInfo imageViewCreateInfo{};
+    imageViewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    imageViewCreateInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    imageViewCreateInfo.format = format;
+    imageViewCreateInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+    imageViewCreateInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+    imageViewCreateInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+    imageViewCreateInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+    imageViewCreateInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    imageViewCreateInfo.subresourceRange.baseMipLevel = 0;
+    imageViewCreateInfo.subresourceRange.levelCount = 1;
+    imageViewCreateInfo.subresourceRange.baseArrayLayer = 0;
+    imageViewCreateInfo.subresourceRange.layerCount = 1;
+
+    for (int i = 0; i < image_count; ++i) {
+        if (VkResult result = vkCreateImage(device, &imageCreateInfo, nullptr, &images[i]); result != VK_SUCCESS) {
+            throw std::runtime_error("Could not create an offscreen image: " + std::string(string_VkResult(result)));
+        }
+
+        VkMemoryRequirements memory_requirements;
+        vkGetImageMemoryRequirements(device, images[i], &memory_requirements);
+
+        images_memory[i] = allocator.allocate(memory_requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, FreeListStrategy, true);
+        vkBindImageMemory(device, images[i], images_memory[i].memory, images_memory[i].offset);
+
+        imageViewCreateInfo.image = images[i];
+
+        if (VkResult result = vkCreateImageView(device, &imageViewCreateInfo, nullptr, &imageViews[i]); result != VK_SUCCESS) {
+            throw std::runtime_error("Could not create an image view: " + std::string(string_VkResult(result)));
+        }
+    }
+}
+
 std::vector<char> readFile(const std::string& filename) {
     std::ifstream file(filename, std::ios::ate | std::ios::binary);
 
@@ -474,11 +679,12 @@ std::vector<char> readFile(const std::string& filename) {
     return buffer;
 }
 
-VkShaderModule createShaderModule(const std::vector<char>& code, VkDevice device) {
+// code must be aligned to 4 bytes, which both std::vector and asset archive payloads are.
+VkShaderModule createShaderModule(const char* code, size_t size, VkDevice device) {
     VkShaderModuleCreateInfo createInfo{};
     createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    createInfo.codeSize = code.size();
-    createInfo.pCode = reinterpret_cast<const uint32_t*>(code.data());
+    createInfo.codeSize = size;
+    createInfo.pCode = reinterpret_cast<const uint32_t*>(code);
 
     VkShaderModule shaderModule;
     if (VkResult result = vkCreateShaderModule(device, &createInfo, nullptr, &shaderModule); result != VK_SUCCESS) {
@@ -488,15 +694,30 @@ VkShaderModule createShaderModule(const std::vector<char>& code, VkDevice device
     return shaderModule;
 }
 
-VkPipelineLayout create_vk_pipeline_layout(VkDevice device) {
+VkShaderModule createShaderModule(const std::vector<char>& code, VkDevice device) {
+    return createShaderModule(code.data(), code.size(), device);
+}
+
+// Creates a shader module straight from the archive's mapping if the archive has the shader, and from the file otherwise.
+VkShaderModule load_shader_module(VkDevice device, AssetArchive* archive, const std::string& path) {
+    TRACE_ZONE("load_shader_module");
+    if (archive != nullptr && archive->contains(path)) {
+        AssetView code = archive->get(path);
+        return createShaderModule(code.data, code.size, device);
+    }
+    return createShaderModule(readFile(path), device);
+}
+
+VkPipelineLayout create_vk_pipeline_layout(VkDevice device, const std::vector<VkDescriptorSetLayout>& set_layouts = {}, 
+                                            const std::vector<VkPushConstantRange>& push_constant_ranges = {}) {
     VkPipelineLayout pipeline_layout;
 
     VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
     pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutInfo.setLayoutCount = 0; // Optional
-    pipelineLayoutInfo.pSetLayouts = nullptr; // Optional
-    pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
-    pipelineLayoutInfo.pPushConstantRanges = nullptr; // Optional
+    pipelineLayoutInfo.setLayoutCount = set_layouts.size();
+    pipelineLayoutInfo.pSetLayouts = set_layouts.data();
+    pipelineLayoutInfo.pushConstantRangeCount = push_constant_ranges.size();
+    pipelineLayoutInfo.pPushConstantRanges = push_constant_ranges.data();
 
     if (VkResult result = vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipeline_layout); result != VK_SUCCESS) {
         throw std::runtime_error("Could not create the pipeline layout!" + std::string(string_VkResult(result)));
@@ -505,7 +726,7 @@ VkPipelineLayout create_vk_pipeline_layout(VkDevice device) {
     return pipeline_layout;
 }
 
-VkRenderPass create_vk_render_pass(VkDevice device, VkFormat swapchain_image_format) {
+VkRenderPass create_vk_render_pass(VkDevice device, VkFormat swapchain_image_format, VkImageLayout final_layout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR) {
     VkAttachmentDescription colorAttachment{};
     colorAttachment.format = swapchain_image_format;
     colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
@@ -516,7 +737,7 @@ VkRenderPass create_vk_render_pass(VkDevice device, VkFormat swapchain_image_for
     colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
 
     colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    colorAttachment.finalLayout = final_layout;
 
     VkAttachmentReference colorAttachmentRef{};
     colorAttachmentRef.attachment = 0;
@@ -586,18 +807,22 @@ template <class VertexType, class ...VertexTypes> std::vector<VkVertexInputBindi
 // Usage note: pass all vertex types that need attribute / binding descriptors as template arguments to the function.
 // Make sure to implement VetexType::get_attribute_description and VertexType::get_binding_description first.
 template <class ...VertexTypes>
-VkPipeline create_vk_graphics_pipeline(VkDevice device, VkPipelineLayout pipeline_layout, VkRenderPass render_pass, VkShaderModule vertex_shader_module, VkShaderModule fragment_shader_module, VkExtent2D extent) {
+VkPipeline create_vk_graphics_pipeline(VkDevice device, VkPipelineLayout pipeline_layout, VkRenderPass render_pass, VkShaderModule vertex_shader_module, VkShaderModule fragment_shader_module, VkExtent2D extent, 
+                                        PipelineCache* pipeline_cache = nullptr, const VkSpecializationInfo* vertex_specialization_info = nullptr, 
+                                        const VkSpecializationInfo* fragment_specialization_info = nullptr, bool alpha_blend = true) {
     VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
     vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
     vertShaderStageInfo.module = vertex_shader_module;
     vertShaderStageInfo.pName = "main";
+    vertShaderStageInfo.pSpecializationInfo = vertex_specialization_info;
 
     VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
     fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
     fragShaderStageInfo.module = fragment_shader_module;
     fragShaderStageInfo.pName = "main";
+    fragShaderStageInfo.pSpecializationInfo = fragment_specialization_info;
 
     VkPipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo, fragShaderStageInfo};
 
@@ -675,13 +900,16 @@ VkPipeline create_vk_graphics_pipeline(VkDevice device, VkPipelineLayout pipelin
     colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO; // Optional
     colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD; // Optional
 
-    colorBlendAttachment.blendEnable = VK_TRUE;
-    colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
-    colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
-    colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
-    colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
-    colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
-    colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+    // Opaque pipelines leave blending off, which saves reading the framebuffer back on most hardware.
+    if (alpha_blend) {
+        colorBlendAttachment.blendEnable = VK_TRUE;
+        colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+        colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+        colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+        colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+        colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+        colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+    }
 
     VkPipelineColorBlendStateCreateInfo colorBlending{};
     colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
@@ -729,6 +957,9 @@ VkPipeline create_vk_graphics_pipeline(VkDevice device, VkPipelineLayout pipelin
 
     pipelineInfo.pVertexInputState = &pipeline_vertex_input_state_info;
 
+    if (pipeline_cache != nullptr) {
+        return pipeline_cache->create_graphics_pipeline(pipelineInfo);
+    }
 
     VkPipeline graphicsPipeline;
 
@@ -795,10 +1026,10 @@ std::vector<VkCommandBuffer> get_vk_command_buffers(VkDevice device, VkCommandPo
     return command_buffers;
 }
 
-std::tuple<VkBuffer, VkDeviceMemory> get_vk_buffer(VkPhysicalDevice physical_device, VkDevice logical_device, VkBufferUsageFlags buffer_usage_flags, VkSharingMode buffer_sharing_mode, 
-                                                        std::size_t buffer_size, uint32_t buffer_queue_index, int required_memory_properties) {
+std::tuple<VkBuffer, GpuAllocation> get_vk_buffer(GpuAllocator& allocator, VkDevice logical_device, VkBufferUsageFlags buffer_usage_flags, VkSharingMode buffer_sharing_mode, 
+                                                        std::size_t buffer_size, uint32_t buffer_queue_index, int required_memory_properties, 
+                                                        AllocationStrategy allocation_strategy = FreeListStrategy) {
     VkBuffer buffer;
-    VkDeviceMemory buffer_memory;
 
     VkBufferCreateInfo buffer_create_info {};
     buffer_create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
@@ -812,73 +1043,70 @@ std::tuple<VkBuffer, VkDeviceMemory> get_vk_buffer(VkPhysicalDevice physical_dev
         throw std::runtime_error("Could not create vertex buffer: " + std::string(string_VkResult(result)));
     }
 
-    // Find the best type of available memory for VkBuffer.
+    // Sub-allocate memory of the best available type for the VkBuffer.
     VkMemoryRequirements memory_requirements;
     vkGetBufferMemoryRequirements(logical_device, buffer, &memory_requirements);
 
-    uint32_t type_filter = memory_requirements.memoryTypeBits;
-
-    int chosen_memory_type = -1;
-
-    VkPhysicalDeviceMemoryProperties memory_properties;
-    vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties);
-
-    for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++) {
-        if ((type_filter & (1 << i)) && (memory_properties.memoryTypes[i].propertyFlags & required_memory_properties) == required_memory_properties) {
-            chosen_memory_type = i;
-            break;
-        }
-    }
-
-    if (chosen_memory_type == -1) {
-        throw std::runtime_error("Could not find memory type that matched requirements.");
-    }
-
-    VkMemoryAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memory_requirements.size;
-    allocInfo.memoryTypeIndex = chosen_memory_type;
-
-    if (VkResult result = vkAllocateMemory(logical_device, &allocInfo, nullptr, &buffer_memory); result != VK_SUCCESS) {
-        throw std::runtime_error("Could not allocate vertex buffer memory: " + std::string(string_VkResult(result)));
-    }
+    GpuAllocation buffer_memory = allocator.allocate(memory_requirements, required_memory_properties, allocation_strategy);
 
-    vkBindBufferMemory(logical_device, buffer, buffer_memory, 0);
+    vkBindBufferMemory(logical_device, buffer, buffer_memory.memory, buffer_memory.offset);
     return std::tie(buffer, buffer_memory);
 }
 
-void vk_cpy_host_to_gpu(VkDevice logical_device, const void* src, VkDeviceMemory memory, VkDeviceSize map_size, VkDeviceSize map_offset = 0, VkMemoryMapFlags map_flags = 0) {
-    void* host_memory_pointer;
-    vkMapMemory(logical_device, memory, map_offset, map_size, map_flags, &host_memory_pointer);
-    memcpy(host_memory_pointer, src, (size_t) map_size);
-    vkUnmapMemory(logical_device, memory);
+// Host visible allocations are persistently mapped, so this is a plain memcpy.
+void vk_cpy_host_to_gpu(const GpuAllocation& allocation, const void* src, VkDeviceSize size) {
+    memcpy(allocation.mapped, src, (size_t) size);
 }
 
-void vk_cpy_buffer(VkQueue queue, VkCommandPool command_pool, VkDevice logical_device, VkBuffer src, VkBuffer dst, VkDeviceSize size) {
-    // Get a command buffer
+// Copies a color image in TRANSFER_SRC_OPTIMAL layout into a host visible buffer and waits for the copy to finish.
+void vk_cpy_image_to_buffer(VkQueue queue, VkCommandPool command_pool, VkDevice logical_device, VkImage src, VkExtent2D extent, VkBuffer dst) {
     VkCommandBuffer command_buffer = get_vk_command_buffers(logical_device, command_pool, 1).front();
 
-    // Begin the command buffer
     VkCommandBufferBeginInfo beginInfo{};
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
     vkBeginCommandBuffer(command_buffer, &beginInfo);
 
-    // Execute the copy command
-    VkBufferCopy copyRegion{};
-    copyRegion.srcOffset = 0; // Optional
-    copyRegion.dstOffset = 0; // Optional
-    copyRegion.size = size;
-
-    vkCmdCopyBuffer(command_buffer, src, dst, 1, &copyRegion);
-
-    // End the command buffer
+    // Make the color attachment writes of earlier submissions visible to the copy.
+    VkImageMemoryBarrier image_barrier{};
+    image_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    image_barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    image_barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    image_barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    image_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    image_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    image_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    image_barrier.image = src;
+    image_barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &image_barrier);
+
+    VkBufferImageCopy region{};
+    region.bufferOffset = 0;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.imageOffset = {0, 0, 0};
+    region.imageExtent = {extent.width, extent.height, 1};
+
+    vkCmdCopyImageToBuffer(command_buffer, src, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, dst, 1, &region);
+
+    // Make the copied data visible to the host once the queue is idle.
+    VkBufferMemoryBarrier buffer_barrier{};
+    buffer_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    buffer_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    buffer_barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    buffer_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    buffer_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    buffer_barrier.buffer = dst;
+    buffer_barrier.offset = 0;
+    buffer_barrier.size = VK_WHOLE_SIZE;
+
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &buffer_barrier, 0, nullptr);
 
     vkEndCommandBuffer(command_buffer);
 
-    // Submit the command buffer to its queue
-
     VkSubmitInfo submitInfo{};
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
     submitInfo.commandBufferCount = 1;
@@ -887,28 +1115,500 @@ void vk_cpy_buffer(VkQueue queue, VkCommandPool command_pool, VkDevice logical_d
     vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
     vkQueueWaitIdle(queue);
 
-    // Once the copy is done, free the command buffer
-
     vkFreeCommandBuffers(logical_device, command_pool, 1, &command_buffer);
 }
 
+// Uploads are identified by the serial number of the batch they are submitted in. Batches retire in order.
+typedef uint64_t UploadHandle;
+
+// A host visible staging buffer that uploads are packed into back to back. Recycled once the batch that used it retires.
+struct StagingPage {
+    VkBuffer buffer;
+    GpuAllocation memory;
+    VkDeviceSize size;
+    VkDeviceSize used;
+};
+
+struct PendingBufferCopy {
+    VkBuffer src;
+    VkBuffer dst;
+    VkBufferCopy region;
+};
+
+struct PendingImageCopy {
+    VkBuffer src;
+    VkImage dst;
+    VkBufferImageCopy region;
+};
+
+struct UploadBatch {
+    UploadHandle handle;
+    VkCommandBuffer command_buffer;
+    // Only used when the upload queue is in a different family than the owner queue.
+    VkCommandBuffer acquire_command_buffer;
+    VkSemaphore semaphore;
+    // The frame whose retirement means the batch has finished.
+    uint64_t frame;
+    std::vector<StagingPage> staging_pages;
+};
+
+// Collects buffer uploads and submits all of them as one command buffer per flush, instead of one blocking submission per copy.
+// Staging memory and command buffers are recycled when a batch retires.
+//
+// Copies run on queue. If that is a dedicated transfer family, ownership of the destination buffers is released there and acquired
+// on owner_queue (the queue that reads them) by a second small submission that waits on the copies with a semaphore.
+//
+// Batches retire with frames of the scheduler instead of fences of their own. A batch ends with a submission to owner_queue (the
+// copies themselves if queue is in the same family, since every family has one queue), and the next frame is submitted to that
+// queue after it, so the signal that retires the frame also covers the batch.
+struct UploadManager {
+    VkDevice device;
+    GpuAllocator* allocator;
+    FrameScheduler* scheduler;
+    VkQueueWrapper queue;
+    VkQueueWrapper owner_queue;
+    VkCommandPool command_pool;
+    VkCommandPool acquire_command_pool;
+    VkDeviceSize staging_page_size;
+
+    UploadHandle open_handle;
+    std::vector<StagingPage> open_pages;
+    std::vector<PendingBufferCopy> pending_copies;
+    std::vector<PendingImageCopy> pending_image_copies;
+
+    std::deque<UploadBatch> in_flight_batches;
+    UploadHandle completed_handle;
+
+    std::vector<StagingPage> free_pages;
+    std::vector<VkCommandBuffer> free_command_buffers;
+    std::vector<VkCommandBuffer> free_acquire_command_buffers;
+    std::vector<VkSemaphore> free_semaphores;
+
+    // Destinations already released to the owner queue. Releasing one again would need its ownership back first, so with an
+    // ownership transfer every buffer and image can only be uploaded to in one batch.
+    std::set<VkBuffer> released_buffers;
+    std::set<VkImage> released_images;
+
+    UploadManager() : device(VK_NULL_HANDLE), allocator(nullptr), scheduler(nullptr), command_pool(VK_NULL_HANDLE), acquire_command_pool(VK_NULL_HANDLE), 
+        staging_page_size(0), open_handle(1), completed_handle(0) {
+
+    }
+
+    UploadManager(VkDevice _device, GpuAllocator* _allocator, FrameScheduler* _scheduler, VkQueueWrapper _queue, VkQueueWrapper _owner_queue, 
+                    VkDeviceSize _staging_page_size = 4 * 1024 * 1024) : 
+        device(_device), allocator(_allocator), scheduler(_scheduler), queue(_queue), owner_queue(_owner_queue), acquire_command_pool(VK_NULL_HANDLE), 
+        staging_page_size(_staging_page_size), open_handle(1), completed_handle(0) {
+        command_pool = get_vk_command_pool(device, queue.queue_index, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
+        if (transfers_ownership()) {
+            acquire_command_pool = get_vk_command_pool(device, owner_queue.queue_index, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
+        }
+    }
+
+    bool transfers_ownership() const {
+        return queue.queue_index != owner_queue.queue_index;
+    }
+
+    // Copies data into staging memory right away and queues the copy into dst for the next flush.
+    UploadHandle upload_buffer(VkBuffer dst, const void* data, VkDeviceSize size, VkDeviceSize dst_offset = 0) {
+        if (released_buffers.count(dst) != 0) {
+            throw std::runtime_error("Uploading to a buffer whose ownership has already been released to the owner queue.");
+        }
+
+        VkDeviceSize staging_offset;
+        StagingPage& page = get_staging_space(size, &staging_offset);
+        memcpy(static_cast<char*>(page.memory.mapped) + staging_offset, data, (size_t) size);
+
+        VkBufferCopy region{};
+        region.srcOffset = staging_offset;
+        region.dstOffset = dst_offset;
+        region.size = size;
+        pending_copies.push_back({page.buffer, dst, region});
+
+        return open_handle;
+    }
+
+    // Copies the pixels of a whole 2D color image into staging memory right away and queues the upload for the next flush.
+    // The image must not have been used yet. It is left in SHADER_READ_ONLY_OPTIMAL layout, owned by the owner queue.
+    UploadHandle upload_image(VkImage dst, const void* data, VkExtent2D extent, uint32_t texel_size) {
+        if (released_images.count(dst) != 0) {
+            throw std::runtime_error("Uploading to an image whose ownership has already been released to the owner queue.");
+        }
+
+        VkDeviceSize size = (VkDeviceSize) extent.width * extent.height * texel_size;
+        VkDeviceSize staging_offset;
+        StagingPage& page = get_staging_space(size, &staging_offset);
+        memcpy(static_cast<char*>(page.memory.mapped) + staging_offset, data, (size_t) size);
+
+        VkBufferImageCopy region{};
+        region.bufferOffset = staging_offset;
+        region.bufferRowLength = 0;
+        region.bufferImageHeight = 0;
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.mipLevel = 0;
+        region.imageSubresource.baseArrayLayer = 0;
+        region.imageSubresource.layerCount = 1;
+        region.imageOffset = {0, 0, 0};
+        region.imageExtent = {extent.width, extent.height, 1};
+        pending_image_copies.push_back({page.buffer, dst, region});
+
+        return open_handle;
+    }
+
+    // Submits every queued copy in a single command buffer. Called once per frame, before the frame's own submission, so that
+    // the barrier (or ownership acquire) that ends the batch on the owner queue orders the copies before any later use there.
+    // With a profiler, the copies are timed as the "uploads" scope of the next frame, unless they run on a transfer only queue.
+    void flush(GpuProfiler* profiler = nullptr) {
+        if (pending_copies.empty() && pending_image_copies.empty()) {
+            return;
+        }
+        TRACE_ZONE("upload_flush");
+
+        UploadBatch batch;
+        batch.handle = open_handle;
+        batch.command_buffer = get_command_buffer(command_pool, free_command_buffers);
+        batch.acquire_command_buffer = VK_NULL_HANDLE;
+        batch.semaphore = VK_NULL_HANDLE;
+        batch.frame = scheduler->get_next_frame();
+        batch.staging_pages = open_pages;
+
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+        vkBeginCommandBuffer(batch.command_buffer, &beginInfo);
+
+        int slot = scheduler->get_slot(batch.frame);
+        int profiler_scope = -1;
+        if (profiler != nullptr) {
+            profiler->begin_recording(batch.command_buffer);
+            profiler_scope = profiler->begin_scope(batch.command_buffer, slot, queue.queue_index, "uploads");
+        }
+
+        // Copies between the same pair of buffers are merged into one vkCmdCopyBuffer with several regions.
+        std::stable_sort(pending_copies.begin(), pending_copies.end(), [](const PendingBufferCopy& lhs, const PendingBufferCopy& rhs) {
+            return std::tie(lhs.src, lhs.dst) < std::tie(rhs.src, rhs.dst);
+        });
+
+        std::vector<VkBufferCopy> regions = {};
+        for (int i = 0; i < pending_copies.size(); ++i) {
+            regions.push_back(pending_copies[i].region);
+            if (i + 1 == pending_copies.size() || pending_copies[i + 1].src != pending_copies[i].src || pending_copies[i + 1].dst != pending_copies[i].dst) {
+                vkCmdCopyBuffer(batch.command_buffer, pending_copies[i].src, pending_copies[i].dst, regions.size(), regions.data());
+                regions.clear();
+            }
+        }
+
+        // Images go from undefined contents to TRANSFER_DST for their copies, then to SHADER_READ_ONLY below.
+        if (!pending_image_copies.empty()) {
+            std::vector<VkImageMemoryBarrier> transfer_barriers = get_image_barriers(VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 
+                                                                                        0, VK_ACCESS_TRANSFER_WRITE_BIT, VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED);
+            vkCmdPipelineBarrier(batch.command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 
+                                    0, nullptr, 0, nullptr, transfer_barriers.size(), transfer_barriers.data());
+
+            for (const PendingImageCopy& copy : pending_image_copies) {
+                vkCmdCopyBufferToImage(batch.command_buffer, copy.src, copy.dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy.region);
+            }
+        }
+
+        if (profiler != nullptr) {
+            profiler->end_scope(batch.command_buffer, slot, profiler_scope);
+            profiler->on_submit(batch.command_buffer, slot);
+        }
+
+        // Everything an uploaded buffer or image may be read by.
+        VkPipelineStageFlags consumer_stages = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT 
+                                                | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+        VkAccessFlags consumer_access = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+
+        if (!transfers_ownership()) {
+            VkMemoryBarrier barrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = consumer_access;
+
+            std::vector<VkImageMemoryBarrier> image_barriers = get_image_barriers(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 
+                                                                                    VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED);
+            vkCmdPipelineBarrier(batch.command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, consumer_stages, 0, 1, &barrier, 0, nullptr, 
+                                    image_barriers.size(), image_barriers.data());
+
+            end_command_buffer(batch.command_buffer);
+            submit(queue, batch.command_buffer, VK_NULL_HANDLE, 0, VK_NULL_HANDLE);
+        } else {
+            // Release the destination buffers and images on the transfer family...
+            std::vector<VkBufferMemoryBarrier> release_barriers = get_ownership_barriers(VK_ACCESS_TRANSFER_WRITE_BIT, 0);
+            std::vector<VkImageMemoryBarrier> image_release_barriers = get_image_barriers(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 
+                                                                                            VK_ACCESS_TRANSFER_WRITE_BIT, 0, queue.queue_index, owner_queue.queue_index);
+            vkCmdPipelineBarrier(batch.command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 
+                                    0, nullptr, release_barriers.size(), release_barriers.data(), image_release_barriers.size(), image_release_barriers.data());
+            end_command_buffer(batch.command_buffer);
+
+            batch.semaphore = get_semaphore();
+            submit(queue, batch.command_buffer, VK_NULL_HANDLE, 0, batch.semaphore);
+
+            // ...and acquire them on the owner family once the copies are done.
+            batch.acquire_command_buffer = get_command_buffer(acquire_command_pool, free_acquire_command_buffers);
+            vkBeginCommandBuffer(batch.acquire_command_buffer, &beginInfo);
+
+            std::vector<VkBufferMemoryBarrier> acquire_barriers = get_ownership_barriers(0, consumer_access);
+            std::vector<VkImageMemoryBarrier> image_acquire_barriers = get_image_barriers(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 
+                                                                                            0, VK_ACCESS_SHADER_READ_BIT, queue.queue_index, owner_queue.queue_index);
+            vkCmdPipelineBarrier(batch.acquire_command_buffer, consumer_stages, consumer_stages, 0, 
+                                    0, nullptr, acquire_barriers.size(), acquire_barriers.data(), image_acquire_barriers.size(), image_acquire_barriers.data());
+            end_command_buffer(batch.acquire_command_buffer);
+
+            submit(owner_queue, batch.acquire_command_buffer, batch.semaphore, consumer_stages, VK_NULL_HANDLE);
+
+            for (const PendingBufferCopy& copy : pending_copies) {
+                released_buffers.insert(copy.dst);
+            }
+            for (const PendingImageCopy& copy : pending_image_copies) {
+                released_images.insert(copy.dst);
+            }
+        }
+
+        in_flight_batches.push_back(batch);
+        open_pages.clear();
+        pending_copies.clear();
+        pending_image_copies.clear();
+        open_handle += 1;
+    }
+
+    // Retires every batch whose frame has retired, without blocking.
+    void poll() {
+        while (!in_flight_batches.empty() && scheduler->is_frame_retired(in_flight_batches.front().frame)) {
+            retire(in_flight_batches.front());
+            in_flight_batches.pop_front();
+        }
+    }
+
+    bool is_complete(UploadHandle handle) {
+        poll();
+        return handle <= completed_handle;
+    }
+
+    // Blocks until the batch containing handle has finished, flushing it first if it has not been submitted yet.
+    void wait(UploadHandle handle) {
+        if (handle == open_handle) {
+            flush();
+        }
+        while (!in_flight_batches.empty() && in_flight_batches.front().handle <= handle) {
+            if (in_flight_batches.front().frame <= scheduler->submitted_frame) {
+                scheduler->wait_for_frame(in_flight_batches.front().frame);
+            } else {
+                // Nothing will retire the frame until it is submitted, but every batch ends on the owner queue.
+                vkQueueWaitIdle(owner_queue.queue);
+            }
+            retire(in_flight_batches.front());
+            in_flight_batches.pop_front();
+        }
+    }
+
+    // Call before destroying a buffer that was uploaded to, since its handle may be reused for a new buffer.
+    void forget_buffer(VkBuffer buffer) {
+        released_buffers.erase(buffer);
+    }
+
+    // The device must be idle.
+    void vk_destroy() {
+        for (UploadBatch& batch : in_flight_batches) {
+            for (StagingPage& page : batch.staging_pages) {
+                destroy_page(page);
+            }
+            if (batch.semaphore != VK_NULL_HANDLE) {
+                vkDestroySemaphore(device, batch.semaphore, nullptr);
+            }
+        }
+        for (StagingPage& page : open_pages) {
+            destroy_page(page);
+        }
+        for (StagingPage& page : free_pages) {
+            destroy_page(page);
+        }
+        for (VkSemaphore semaphore : free_semaphores) {
+            vkDestroySemaphore(device, semaphore, nullptr);
+        }
+        in_flight_batches.clear();
+        open_pages.clear();
+        free_pages.clear();
+        free_semaphores.clear();
+        free_command_buffers.clear();
+        free_acquire_command_buffers.clear();
+        vkDestroyCommandPool(device, command_pool, nullptr);
+        if (acquire_command_pool != VK_NULL_HANDLE) {
+            vkDestroyCommandPool(device, acquire_command_pool, nullptr);
+        }
+    }
+
+    private:
+
+    StagingPage& get_staging_space(VkDeviceSize size, VkDeviceSize* offset) {
+        for (StagingPage& page : open_pages) {
+            VkDeviceSize aligned_offset = align_up(page.used, 16);
+            if (aligned_offset + size <= page.size) {
+                page.used = aligned_offset + size;
+                *offset = aligned_offset;
+                return page;
+            }
+        }
+
+        StagingPage page;
+        auto free_page = std::find_if(free_pages.begin(), free_pages.end(), [size](const StagingPage& page) { return page.size >= size; });
+        if (free_page != free_pages.end()) {
+            page = *free_page;
+            free_pages.erase(free_page);
+        } else {
+            page.size = std::max(size, staging_page_size);
+            page.used = 0;
+            // Standard pages are recycled for as long as the manager lives, so they would keep a linear block from ever rewinding.
+            // Only oversized pages, which are freed once their batch retires, are short lived enough for the linear strategy.
+            AllocationStrategy strategy = page.size > staging_page_size ? LinearStrategy : FreeListStrategy;
+            auto [buffer, memory] = get_vk_buffer(*allocator, device, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_SHARING_MODE_EXCLUSIVE, page.size, queue.queue_index, 
+                                                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, strategy);
+            page.buffer = buffer;
+            page.memory = memory;
+        }
+
+        page.used = size;
+        *offset = 0;
+        open_pages.push_back(page);
+        return open_pages.back();
+    }
+
+    // One queue family ownership barrier per destination buffer of the pending copies. The destination buffers have no owner
+    // yet, which upload_buffer makes sure of by refusing buffers it has released before.
+    std::vector<VkBufferMemoryBarrier> get_ownership_barriers(VkAccessFlags src_access, VkAccessFlags dst_access) {
+        std::set<VkBuffer> buffers = {};
+        for (const PendingBufferCopy& copy : pending_copies) {
+            buffers.insert(copy.dst);
+        }
+
+        std::vector<VkBufferMemoryBarrier> barriers = {};
+        for (VkBuffer buffer : buffers) {
+            VkBufferMemoryBarrier barrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+            barrier.srcAccessMask = src_access;
+            barrier.dstAccessMask = dst_access;
+            barrier.srcQueueFamilyIndex = queue.queue_index;
+            barrier.dstQueueFamilyIndex = owner_queue.queue_index;
+            barrier.buffer = buffer;
+            barrier.offset = 0;
+            barrier.size = VK_WHOLE_SIZE;
+            barriers.push_back(barrier);
+        }
+        return barriers;
+    }
+
+    // One barrier per destination image of the pending image copies, covering its only mip level and layer.
+    std::vector<VkImageMemoryBarrier> get_image_barriers(VkImageLayout old_layout, VkImageLayout new_layout, VkAccessFlags src_access, VkAccessFlags dst_access, 
+                                                            uint32_t src_queue_index, uint32_t dst_queue_index) {
+        std::vector<VkImageMemoryBarrier> barriers = {};
+        for (const PendingImageCopy& copy : pending_image_copies) {
+            VkImageMemoryBarrier barrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+            barrier.srcAccessMask = src_access;
+            barrier.dstAccessMask = dst_access;
+            barrier.oldLayout = old_layout;
+            barrier.newLayout = new_layout;
+            barrier.srcQueueFamilyIndex = src_queue_index;
+            barrier.dstQueueFamilyIndex = dst_queue_index;
+            barrier.image = copy.dst;
+            barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            barrier.subresourceRange.baseMipLevel = 0;
+            barrier.subresourceRange.levelCount = 1;
+            barrier.subresourceRange.baseArrayLayer = 0;
+            barrier.subresourceRange.layerCount = 1;
+            barriers.push_back(barrier);
+        }
+        return barriers;
+    }
+
+    void end_command_buffer(VkCommandBuffer command_buffer) {
+        if (VkResult result = vkEndCommandBuffer(command_buffer); result != VK_SUCCESS) {
+            throw std::runtime_error("Could not record upload command buffer: " + std::string(string_VkResult(result)));
+        }
+    }
+
+    void submit(VkQueueWrapper target_queue, VkCommandBuffer command_buffer, VkSemaphore wait_semaphore, VkPipelineStageFlags wait_stages, 
+                VkSemaphore signal_semaphore) {
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.waitSemaphoreCount = wait_semaphore != VK_NULL_HANDLE ? 1 : 0;
+        submitInfo.pWaitSemaphores = &wait_semaphore;
+        submitInfo.pWaitDstStageMask = &wait_stages;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &command_buffer;
+        submitInfo.signalSemaphoreCount = signal_semaphore != VK_NULL_HANDLE ? 1 : 0;
+        submitInfo.pSignalSemaphores = &signal_semaphore;
+
+        if (VkResult result = scheduler->submit(target_queue.queue, submitInfo); result != VK_SUCCESS) {
+            throw std::runtime_error("Could not submit upload batch: " + std::string(string_VkResult(result)));
+        }
+    }
+
+    VkCommandBuffer get_command_buffer(VkCommandPool pool, std::vector<VkCommandBuffer>& free_list) {
+        if (free_list.empty()) {
+            return get_vk_command_buffers(device, pool, 1).front();
+        }
+        VkCommandBuffer command_buffer = free_list.back();
+        free_list.pop_back();
+        return command_buffer;
+    }
+
+    VkSemaphore get_semaphore() {
+        if (free_semaphores.empty()) {
+            VkSemaphore semaphore;
+            VkSemaphoreCreateInfo semaphore_creation_info {};
+            semaphore_creation_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+            vkCreateSemaphore(device, &semaphore_creation_info, nullptr, &semaphore);
+            return semaphore;
+        }
+        VkSemaphore semaphore = free_semaphores.back();
+        free_semaphores.pop_back();
+        return semaphore;
+    }
+
+    void retire(UploadBatch& batch) {
+        // Keep standard sized pages for reuse, but give oversized ones back to the allocator.
+        for (StagingPage& page : batch.staging_pages) {
+            if (page.size > staging_page_size) {
+                destroy_page(page);
+            } else {
+                page.used = 0;
+                free_pages.push_back(page);
+            }
+        }
+
+        vkResetCommandBuffer(batch.command_buffer, 0);
+        free_command_buffers.push_back(batch.command_buffer);
+
+        // The acquire submission waited on the semaphore, so it is unsignaled again and can be reused.
+        if (batch.acquire_command_buffer != VK_NULL_HANDLE) {
+            vkResetCommandBuffer(batch.acquire_command_buffer, 0);
+            free_acquire_command_buffers.push_back(batch.acquire_command_buffer);
+            free_semaphores.push_back(batch.semaphore);
+        }
+
+        completed_handle = batch.handle;
+    }
+
+    void destroy_page(StagingPage& page) {
+        vkDestroyBuffer(device, page.buffer, nullptr);
+        allocator->free(page.memory);
+    }
+};
+
+// Creates a device local vertex buffer and queues the upload of its contents. The buffer may be drawn with as soon as the upload is flushed.
+// Also used for other read-only geometry, such as index buffers, by passing a different usage.
 template<class Vertex>
-std::tuple<VkBuffer, VkDeviceMemory> get_vk_vertex_buffer(VkPhysicalDevice physical_device, VkDevice logical_device, VkQueueWrapper transfer_queue, VkCommandPool transfer_command_pool, std::vector<Vertex> vertices) {
-    auto [vertex_staging_buffer, vertex_staging_buffer_memory] = get_vk_buffer(physical_device, logical_device, VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 
-                                                                    VK_SHARING_MODE_EXCLUSIVE, sizeof(Vertex) * vertices.size(), transfer_queue.queue_index, 
-                                                                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-    vk_cpy_host_to_gpu(logical_device, vertices.data(), vertex_staging_buffer_memory, sizeof(Vertex) * vertices.size());
-
-    auto [vertex_buffer, vertex_buffer_memory] = get_vk_buffer(physical_device, logical_device, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 
-                                                                    VK_SHARING_MODE_EXCLUSIVE, sizeof(Vertex) * vertices.size(), transfer_queue.queue_index, 
+std::tuple<VkBuffer, GpuAllocation, UploadHandle> get_vk_vertex_buffer(GpuAllocator& allocator, VkDevice logical_device, UploadManager& upload_manager, std::vector<Vertex> vertices, 
+                                                                        VkBufferUsageFlags usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT) {
+    auto [vertex_buffer, vertex_buffer_memory] = get_vk_buffer(allocator, logical_device, VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage, 
+                                                                    VK_SHARING_MODE_EXCLUSIVE, sizeof(Vertex) * vertices.size(), upload_manager.queue.queue_index, 
                                                                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
-    vk_cpy_buffer(transfer_queue.queue, transfer_command_pool, logical_device, vertex_staging_buffer, vertex_buffer, sizeof(Vertex) * vertices.size());
-
-    vkDestroyBuffer(logical_device, vertex_staging_buffer, nullptr);
-    vkFreeMemory(logical_device, vertex_staging_buffer_memory, nullptr);
+    UploadHandle upload = upload_manager.upload_buffer(vertex_buffer, vertices.data(), sizeof(Vertex) * vertices.size());
 
-    return std::tie(vertex_buffer, vertex_buffer_memory);
+    return std::tie(vertex_buffer, vertex_buffer_memory, upload);
 }
 
 // GPU Data Input Types
@@ -916,40 +1616,47 @@ std::tuple<VkBuffer, VkDeviceMemory> get_vk_vertex_buffer(VkPhysicalDevice physi
 struct Vertex {
     glm::vec2 pos;
     glm::vec3 color;
+    // Texture coordinates in the atlas page the mesh is drawn with. (0, 0) is a white texel on every page, so untextured
+    // vertices keep their plain color.
+    glm::vec2 uv;
+
+    Vertex() : pos(glm::vec2(0, 0)), color(glm::vec3(0, 0, 0)), uv(glm::vec2(0, 0)) {
+
+    }
 
-    Vertex() : pos(glm::vec2(0, 0)), color(glm::vec3(0, 0, 0)) {
+    Vertex(glm::vec2 _pos) : pos(_pos), color(glm::vec3(0, 0, 0)), uv(glm::vec2(0, 0)) {
 
     }
 
-    Vertex(glm::vec2 _pos) : pos(_pos), color(glm::vec3(0, 0, 0)) {
+    Vertex(glm::vec3 _color) : pos(glm::vec2(0, 0)), color(_color), uv(glm::vec2(0, 0)) {
 
     }
 
-    Vertex(glm::vec3 _color) : pos(glm::vec2(0, 0)), color(_color) {
+    Vertex(glm::vec2 _pos, glm::vec3 _color) : pos(_pos), color(_color), uv(glm::vec2(0, 0)) {
 
     }
 
-    Vertex(glm::vec2 _pos, glm::vec3 _color) : pos(_pos), color(_color) {
+    Vertex(float x, float y) : pos(glm::vec2(x, y)), color(glm::vec3(0, 0, 0)), uv(glm::vec2(0, 0)) {
 
     }
 
-    Vertex(float x, float y) : pos(glm::vec2(x, y)), color(glm::vec3(0, 0, 0)) {
+    Vertex(float r, float g, float b) : pos(glm::vec2(0, 0)), color(glm::vec3(r, g, b)), uv(glm::vec2(0, 0)) {
 
     }
 
-    Vertex(float r, float g, float b) : pos(glm::vec2(0, 0)), color(glm::vec3(r, g, b)) {
+    Vertex(float x, float y, float r, float g, float b) : pos(glm::vec2(x, y)), color(glm::vec3(r, g, b)), uv(glm::vec2(0, 0)) {
 
     }
 
-    Vertex(float x, float y, float r, float g, float b) : pos(glm::vec2(x, y)), color(glm::vec3(r, g, b)) {
+    Vertex(float x, float y, glm::vec3 _color) : pos(glm::vec2(x, y)), color(_color), uv(glm::vec2(0, 0)) {
 
     }
 
-    Vertex(float x, float y, glm::vec3 _color) : pos(glm::vec2(x, y)), color(_color) {
+    Vertex(glm::vec2 _pos, float r, float g, float b) : pos(_pos), color(glm::vec3(r, g, b)), uv(glm::vec2(0, 0)) {
 
     }
 
-    Vertex(glm::vec2 _pos, float r, float g, float b) : pos(_pos), color(glm::vec3(r, g, b)) {
+    Vertex(glm::vec2 _pos, glm::vec3 _color, glm::vec2 _uv) : pos(_pos), color(_color), uv(_uv) {
 
     }
 
@@ -966,7 +1673,13 @@ struct Vertex {
         desc1.location = 1;
         desc1.offset = offsetof(Vertex, color);
         desc1.format = VK_FORMAT_R32G32B32_SFLOAT;
-        return {desc0, desc1};
+
+        VkVertexInputAttributeDescription desc2 {};
+        desc2.binding = 0;
+        desc2.location = 3;
+        desc2.offset = offsetof(Vertex, uv);
+        desc2.format = VK_FORMAT_R32G32_SFLOAT;
+        return {desc0, desc1, desc2};
     }
 
     static VkVertexInputBindingDescription get_binding_description() {
@@ -1013,146 +1726,1081 @@ struct ObjectData {
     }
 };
 
-// Context Storage Structures
+// Packed layouts. Same attribute locations as Vertex and ObjectData, but with compact formats, for streaming many instances.
 
-template<class Vertex>
-struct VertexBufferBacked {
-    VkBuffer buffer;
-    VkDeviceMemory memory;
-    int length;
+// Which pair of vertex and instance types a pipeline reads.
+enum VertexLayout {
+    // Vertex and ObjectData.
+    FullVertexLayout,
+    // PackedVertex and PackedObjectData.
+    PackedVertexLayout
+};
 
-    VertexBufferBacked<Vertex>(VkPhysicalDevice physical_device, VkDevice logical_device, VkQueueWrapper transfer_queue, VkCommandPool transfer_command_pool, std::vector<Vertex> data) {
-        auto [buf, mem] = get_vk_vertex_buffer<Vertex>(physical_device, logical_device, transfer_queue, transfer_command_pool, data);
-        buffer = buf;
-        memory = mem;
-        length = data.size();
-    }
+// Game units from the bottom to the top of the screen at camera zoom 1, unless a pipeline variant sets another.
+const float GAME_UNIT_BOUND = 1000.0f;
 
-    void destroy(VkDevice device) {
-        vkDestroyBuffer(device, buffer, nullptr);
-        vkFreeMemory(device, memory, nullptr);
-    }
-};
+// Packed positions are 16 bit signed normalized fractions of this range, about 0.06 units of precision. It is twice
+// GAME_UNIT_BOUND, so objects can still be placed outside of the visible area.
+const float PACKED_POSITION_RANGE = 2 * GAME_UNIT_BOUND;
 
-struct GraphicsPipeline {
-    VkShaderModule vertex_shader_module;
-    VkShaderModule fragment_shader_module;
-    VkPipeline graphics_pipeline;
-    VkRenderPass render_pass;
-    VkPipelineLayout pipeline_layout;
+int16_t pack_position(float value) {
+    return (int16_t) std::lround(std::clamp(value / PACKED_POSITION_RANGE, -1.0f, 1.0f) * 32767.0f);
+}
 
-   void vk_destroy(VkDevice device) {
-        if (graphics_pipeline != VK_NULL_HANDLE) {
-            vkDestroyPipeline(device, graphics_pipeline, nullptr);
-        }
+// Colors are 0 - 255 in Vertex.
+uint8_t pack_color(float value) {
+    return (uint8_t) std::lround(std::clamp(value, 0.0f, 255.0f));
+}
 
-        if (pipeline_layout != VK_NULL_HANDLE) {
-            vkDestroyPipelineLayout(device, pipeline_layout, nullptr);
-        }
+// Texture coordinates are 16 bit unsigned normalized, exact to the texel for atlas pages up to 65536 texels wide.
+uint16_t pack_uv(float value) {
+    return (uint16_t) std::lround(std::clamp(value, 0.0f, 1.0f) * 65535.0f);
+}
 
-        if (render_pass != VK_NULL_HANDLE) {
-            vkDestroyRenderPass(device, render_pass, nullptr);
-        }
+// 12 bytes instead of the 28 of Vertex.
+struct PackedVertex {
+    int16_t pos[2];
+    uint8_t color[4];
+    uint16_t uv[2];
+
+    PackedVertex() : pos{0, 0}, color{0, 0, 0, 255}, uv{0, 0} {
 
-        if (vertex_shader_module != VK_NULL_HANDLE) {
-            vkDestroyShaderModule(device, vertex_shader_module, nullptr);
-        }
-        
-        if (fragment_shader_module != VK_NULL_HANDLE) {
-            vkDestroyShaderModule(device, fragment_shader_module, nullptr);
-        }
     }
 
-    GraphicsPipeline(const GraphicsPipeline&) = delete;
+    PackedVertex(const Vertex& vertex) : pos{pack_position(vertex.pos.x), pack_position(vertex.pos.y)}, 
+        color{pack_color(vertex.color.x), pack_color(vertex.color.y), pack_color(vertex.color.z), 255}, uv{pack_uv(vertex.uv.x), pack_uv(vertex.uv.y)} {
 
-    GraphicsPipeline() : vertex_shader_module(VK_NULL_HANDLE), fragment_shader_module(VK_NULL_HANDLE), graphics_pipeline(VK_NULL_HANDLE), render_pass(VK_NULL_HANDLE), 
-                            pipeline_layout(VK_NULL_HANDLE) {
     }
 
-    GraphicsPipeline(VkDevice device, std::string vertex_shader_loc, std::string fragment_shader_loc, VkExtent2D extent, VkFormat swapchain_format) : 
-        vertex_shader_module(createShaderModule(readFile(vertex_shader_loc), device)), fragment_shader_module(createShaderModule(readFile(fragment_shader_loc), device)) {
-        render_pass = create_vk_render_pass(device, swapchain_format);
-        pipeline_layout = create_vk_pipeline_layout(device);
-        graphics_pipeline = create_vk_graphics_pipeline<Vertex, ObjectData>(device, pipeline_layout, render_pass, vertex_shader_module, fragment_shader_module, extent);
-    } 
-};
+    static std::vector<VkVertexInputAttributeDescription> get_attribute_description() {
+        VkVertexInputAttributeDescription desc0 {};
+        desc0.binding = 0;
+        desc0.location = 0;
+        desc0.offset = offsetof(PackedVertex, pos);
+        desc0.format = VK_FORMAT_R16G16_SNORM;
 
-void create_synchronization_objects(VkDevice logical_device, std::vector<VkFence>* command_buffer_fences, std::vector<VkSemaphore>* image_available_semaphores, std::vector<VkSemaphore>* image_done_rendering_semaphores, int MAX_FRAMES_IN_FLIGHT) {
-    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-        VkFence command_buffer_fence;
-        VkFenceCreateInfo fence_creation_info {};
-        fence_creation_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-        fence_creation_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-        vkCreateFence(logical_device, &fence_creation_info, nullptr, &command_buffer_fence);
+        VkVertexInputAttributeDescription desc1 {};
+        desc1.binding = 0;
+        desc1.location = 1;
+        desc1.offset = offsetof(PackedVertex, color);
+        desc1.format = VK_FORMAT_R8G8B8A8_UNORM;
 
-        VkSemaphore image_available_semaphore;
-        VkSemaphore image_done_rendering_semaphore;
+        VkVertexInputAttributeDescription desc2 {};
+        desc2.binding = 0;
+        desc2.location = 3;
+        desc2.offset = offsetof(PackedVertex, uv);
+        desc2.format = VK_FORMAT_R16G16_UNORM;
+        return {desc0, desc1, desc2};
+    }
+
+    static VkVertexInputBindingDescription get_binding_description() {
+        VkVertexInputBindingDescription desc {};
+        desc.binding = 0;
+        desc.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+        desc.stride = sizeof(PackedVertex);
+        return desc;
+    }
+};
+
+// 4 bytes instead of the 8 of ObjectData.
+struct PackedObjectData {
+    int16_t pos[2];
+
+    PackedObjectData() : pos{0, 0} {
+
+    }
+
+    PackedObjectData(const ObjectData& object) : pos{pack_position(object.pos.x), pack_position(object.pos.y)} {
+
+    }
+
+    PackedObjectData(float x, float y) : pos{pack_position(x), pack_position(y)} {
+
+    }
+
+    static std::vector<VkVertexInputAttributeDescription> get_attribute_description() {
+        VkVertexInputAttributeDescription desc0 {};
+        desc0.binding = 1;
+        desc0.location = 2;
+        desc0.offset = offsetof(PackedObjectData, pos);
+        desc0.format = VK_FORMAT_R16G16_SNORM;
+
+        return {desc0};
+    }
+
+    static VkVertexInputBindingDescription get_binding_description() {
+        VkVertexInputBindingDescription desc {};
+        desc.binding = 1;
+        desc.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+        desc.stride = sizeof(PackedObjectData);
+        return desc;
+    }
+};
+
+// Context Storage Structures
+
+template<class Vertex>
+struct VertexBufferBacked {
+    VkBuffer buffer;
+    // The buffer's range inside a memory block shared with other buffers.
+    GpuAllocation memory;
+    int length;
+    // Upload of the initial contents. Poll it with UploadManager::is_complete before touching the buffer from the CPU side.
+    UploadHandle upload;
+
+    // Dynamic buffers are host visible rings with one region of capacity elements per frame in flight.
+    // The region for a frame is only read by the GPU while that frame is in flight, so it can be written directly once its fence has signaled.
+    int capacity;
+    VkDeviceSize frame_stride;
+
+    VertexBufferBacked<Vertex>(GpuAllocator& allocator, VkDevice logical_device, UploadManager& upload_manager, std::vector<Vertex> data, 
+                                VkBufferUsageFlags usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT) {
+        auto [buf, mem, handle] = get_vk_vertex_buffer<Vertex>(allocator, logical_device, upload_manager, data, usage);
+        buffer = buf;
+        memory = mem;
+        upload = handle;
+        length = data.size();
+        capacity = data.size();
+        frame_stride = 0;
+    }
+
+    VertexBufferBacked<Vertex>(GpuAllocator& allocator, VkDevice logical_device, VkQueueWrapper queue, int _capacity, int frame_count, 
+                                VkBufferUsageFlags usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT) {
+        auto [buf, mem] = get_vk_buffer(allocator, logical_device, usage, VK_SHARING_MODE_EXCLUSIVE, sizeof(Vertex) * _capacity * frame_count, 
+                                            queue.queue_index, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        buffer = buf;
+        memory = mem;
+        upload = 0;
+        length = 0;
+        capacity = _capacity;
+        frame_stride = sizeof(Vertex) * _capacity;
+    }
+
+    bool is_dynamic() {
+        return frame_stride != 0;
+    }
+
+    // Offset to bind the buffer at for the given frame. Always 0 for static buffers.
+    VkDeviceSize frame_offset(int frame) {
+        return frame_stride * frame;
+    }
+
+    // Persistently mapped region of a dynamic buffer for the given frame.
+    Vertex* frame_data(int frame) {
+        return reinterpret_cast<Vertex*>(static_cast<char*>(memory.mapped) + frame_offset(frame));
+    }
+
+    void set_length(int _length) {
+        if (_length > capacity) {
+            throw std::runtime_error("Dynamic buffer length " + std::to_string(_length) + " exceeds its capacity of " + std::to_string(capacity));
+        }
+        length = _length;
+    }
+
+    void destroy(VkDevice device, GpuAllocator& allocator) {
+        vkDestroyBuffer(device, buffer, nullptr);
+        allocator.free(memory);
+    }
+};
+
+struct IndexBufferBacked {
+    VkBuffer buffer;
+    GpuAllocation memory;
+    int length;
+    VkIndexType index_type;
+    UploadHandle upload;
+
+    // Indices are stored as 16 bit whenever every vertex is addressable with them, halving the index buffer.
+    IndexBufferBacked(GpuAllocator& allocator, VkDevice logical_device, UploadManager& upload_manager, const std::vector<uint32_t>& indices, uint32_t vertex_count) {
+        if (vertex_count < UINT16_MAX) {
+            std::vector<uint16_t> short_indices (indices.begin(), indices.end());
+            auto [buf, mem, handle] = get_vk_vertex_buffer<uint16_t>(allocator, logical_device, upload_manager, short_indices, VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+            buffer = buf;
+            memory = mem;
+            upload = handle;
+            index_type = VK_INDEX_TYPE_UINT16;
+        } else {
+            auto [buf, mem, handle] = get_vk_vertex_buffer<uint32_t>(allocator, logical_device, upload_manager, indices, VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+            buffer = buf;
+            memory = mem;
+            upload = handle;
+            index_type = VK_INDEX_TYPE_UINT32;
+        }
+        length = indices.size();
+    }
+
+    void destroy(VkDevice device, GpuAllocator& allocator) {
+        vkDestroyBuffer(device, buffer, nullptr);
+        allocator.free(memory);
+    }
+};
+
+// One instanced draw of a vertex buffer, with instances [first_instance, first_instance + instance_count) of an object buffer.
+// Layers are drawn in increasing order. Within a layer, draws may be reordered to share pipeline and buffer bindings.
+struct DrawCommand {
+    int layer;
+    int pipeline_id;
+    int vbuffer_id;
+    int obuffer_id;
+    int first_instance;
+    int instance_count;
+    // When not -1, the instances are culled on the GPU first and drawn indirectly (see CulledDraw).
+    int culled_draw_id;
+    // The texture atlas page the draw samples.
+    int texture_id;
+
+    bool operator==(const DrawCommand& other) const {
+        return std::tie(layer, pipeline_id, vbuffer_id, obuffer_id, first_instance, instance_count, culled_draw_id, texture_id) 
+            == std::tie(other.layer, other.pipeline_id, other.vbuffer_id, other.obuffer_id, other.first_instance, other.instance_count, other.culled_draw_id, other.texture_id);
+    }
+
+    bool operator!=(const DrawCommand& other) const {
+        return !(*this == other);
+    }
+};
+
+// Sorts draws by layer, pipeline and bound buffers, then merges draws of adjacent instance ranges of the same buffers into one.
+// The sort is stable, so draws with the same key keep their submission order.
+std::vector<DrawCommand> batch_draw_commands(std::vector<DrawCommand> draws) {
+    std::stable_sort(draws.begin(), draws.end(), [](const DrawCommand& lhs, const DrawCommand& rhs) {
+        return std::tie(lhs.layer, lhs.pipeline_id, lhs.texture_id, lhs.vbuffer_id, lhs.obuffer_id, lhs.culled_draw_id, lhs.first_instance) 
+             < std::tie(rhs.layer, rhs.pipeline_id, rhs.texture_id, rhs.vbuffer_id, rhs.obuffer_id, rhs.culled_draw_id, rhs.first_instance);
+    });
+
+    std::vector<DrawCommand> batches = {};
+    for (const DrawCommand& draw : draws) {
+        if (draw.instance_count == 0) {
+            continue;
+        }
+
+        if (!batches.empty()) {
+            DrawCommand& last = batches.back();
+            if (std::tie(last.layer, last.pipeline_id, last.texture_id, last.vbuffer_id, last.obuffer_id) == std::tie(draw.layer, draw.pipeline_id, draw.texture_id, draw.vbuffer_id, draw.obuffer_id) 
+                    && last.culled_draw_id == -1 && draw.culled_draw_id == -1 && last.first_instance + last.instance_count == draw.first_instance) {
+                last.instance_count += draw.instance_count;
+                continue;
+            }
+        }
+        batches.push_back(draw);
+    }
+    return batches;
+}
+
+// How the fragment shader colors a pixel (COLOR_MODE in shader_2d.frag).
+enum ColorMode {
+    // Vertex color times the atlas texel.
+    TexturedColorMode,
+    // Vertex color alone. Skips the texture fetch, for flat colored geometry such as tiles.
+    VertexColorMode
+};
+
+// Everything that is baked into a pipeline of shader_2d: the vertex and instance types, specialization constants and blend state.
+struct PipelineVariant {
+    VertexLayout layout;
+    ColorMode color_mode;
+    bool alpha_blend;
+    // Game units from the bottom to the top of the screen at camera zoom 1.
+    float world_bound;
+
+    PipelineVariant(VertexLayout layout, ColorMode color_mode = TexturedColorMode, bool alpha_blend = true, float world_bound = GAME_UNIT_BOUND) : 
+        layout(layout), color_mode(color_mode), alpha_blend(alpha_blend), world_bound(world_bound) {
+
+    }
+
+    bool operator==(const PipelineVariant& other) const {
+        return layout == other.layout && color_mode == other.color_mode && alpha_blend == other.alpha_blend && world_bound == other.world_bound;
+    }
+};
+
+// Camera of shader_2d.vert, pushed once per command buffer. Positions are mapped to clip space relative to center, so moving or
+// zooming the camera leaves instance data untouched.
+struct CameraPushConstants {
+    // World position at the middle of the screen.
+    glm::vec2 center;
+    // 1 shows world_bound game units from the bottom to the top of the screen, 2 half as many.
+    float zoom;
+    // Width over height of the viewport, so that game units stay square.
+    float aspect;
+};
+
+// Specialization constants of shader_2d.vert, in constant_id order.
+struct VertexSpecialization {
+    float position_scale;
+    float color_scale;
+    float world_bound;
+};
+
+// Specialization constants of shader_2d.frag, in constant_id order.
+struct FragmentSpecialization {
+    int32_t color_mode;
+};
+
+// Creates a variant of shader_2d for the given vertex and instance types. Constants are specialized when the pipeline is created,
+// so the driver folds them and removes the branches they decide instead of reading them at runtime.
+template<class VertexType, class InstanceType>
+VkPipeline create_pipeline_variant(VkDevice device, VkPipelineLayout pipeline_layout, VkRenderPass render_pass, VkShaderModule vertex_shader_module, 
+                                    VkShaderModule fragment_shader_module, VkExtent2D extent, PipelineCache* pipeline_cache, const PipelineVariant& variant) {
+    // Packed layouts store positions as fractions of a range and colors as 0 - 1, the full layout world units and 0 - 255.
+    VertexSpecialization vertex_constants = {1.0f, 1.0f / 255.0f, variant.world_bound};
+    if constexpr (std::is_same_v<VertexType, PackedVertex>) {
+        vertex_constants.position_scale = PACKED_POSITION_RANGE;
+        vertex_constants.color_scale = 1.0f;
+    }
+    VkSpecializationMapEntry vertex_entries[3] = {
+        {0, offsetof(VertexSpecialization, position_scale), sizeof(float)},
+        {1, offsetof(VertexSpecialization, color_scale), sizeof(float)},
+        {2, offsetof(VertexSpecialization, world_bound), sizeof(float)}
+    };
+    VkSpecializationInfo vertex_specialization_info{};
+    vertex_specialization_info.mapEntryCount = 3;
+    vertex_specialization_info.pMapEntries = vertex_entries;
+    vertex_specialization_info.dataSize = sizeof(vertex_constants);
+    vertex_specialization_info.pData = &vertex_constants;
+
+    FragmentSpecialization fragment_constants = {variant.color_mode};
+    VkSpecializationMapEntry fragment_entries[1] = {{0, offsetof(FragmentSpecialization, color_mode), sizeof(int32_t)}};
+    VkSpecializationInfo fragment_specialization_info{};
+    fragment_specialization_info.mapEntryCount = 1;
+    fragment_specialization_info.pMapEntries = fragment_entries;
+    fragment_specialization_info.dataSize = sizeof(fragment_constants);
+    fragment_specialization_info.pData = &fragment_constants;
+
+    return create_vk_graphics_pipeline<VertexType, InstanceType>(device, pipeline_layout, render_pass, vertex_shader_module, fragment_shader_module, extent, 
+                                                                 pipeline_cache, &vertex_specialization_info, &fragment_specialization_info, variant.alpha_blend);
+}
+
+// The pipelines of shader_2d. Every variant shares the shader modules, render pass and pipeline layout, and is created the first
+// time it is asked for. Variants that are known up front should be asked for at load time, since creating one mid-game stalls the
+// frame that needs it (less so when the pipeline cache already has it).
+struct PipelineRegistry {
+    VkDevice device;
+    VkExtent2D extent;
+    PipelineCache* pipeline_cache;
+
+    VkShaderModule vertex_shader_module;
+    VkShaderModule fragment_shader_module;
+    VkRenderPass render_pass;
+    VkPipelineLayout pipeline_layout;
+
+    // Indexed by pipeline id.
+    std::vector<PipelineVariant> variants;
+    std::vector<VkPipeline> pipelines;
+
+    void vk_destroy() {
+        for (VkPipeline pipeline : pipelines) {
+            vkDestroyPipeline(device, pipeline, nullptr);
+        }
+        pipelines.clear();
+        variants.clear();
+
+        if (pipeline_layout != VK_NULL_HANDLE) {
+            vkDestroyPipelineLayout(device, pipeline_layout, nullptr);
+        }
+
+        if (render_pass != VK_NULL_HANDLE) {
+            vkDestroyRenderPass(device, render_pass, nullptr);
+        }
+
+        if (vertex_shader_module != VK_NULL_HANDLE) {
+            vkDestroyShaderModule(device, vertex_shader_module, nullptr);
+        }
+        
+        if (fragment_shader_module != VK_NULL_HANDLE) {
+            vkDestroyShaderModule(device, fragment_shader_module, nullptr);
+        }
+    }
+
+    PipelineRegistry(const PipelineRegistry&) = delete;
+
+    PipelineRegistry() : device(VK_NULL_HANDLE), pipeline_cache(nullptr), vertex_shader_module(VK_NULL_HANDLE), fragment_shader_module(VK_NULL_HANDLE), 
+                            render_pass(VK_NULL_HANDLE), pipeline_layout(VK_NULL_HANDLE) {
+
+    }
+
+    // Creates the default variants, alpha blended and textured, so that pipeline ids FullVertexLayout and PackedVertexLayout
+    // read the layout of the same name.
+    PipelineRegistry(VkDevice device, std::string vertex_shader_loc, std::string fragment_shader_loc, VkExtent2D extent, VkFormat swapchain_format, 
+                        VkImageLayout final_layout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, PipelineCache* pipeline_cache = nullptr, 
+                        const std::vector<VkDescriptorSetLayout>& set_layouts = {}, AssetArchive* archive = nullptr) : 
+        device(device), extent(extent), pipeline_cache(pipeline_cache), vertex_shader_module(load_shader_module(device, archive, vertex_shader_loc)), 
+        fragment_shader_module(load_shader_module(device, archive, fragment_shader_loc)) {
+        TRACE_ZONE("create_pipelines");
+        render_pass = create_vk_render_pass(device, swapchain_format, final_layout);
+        pipeline_layout = create_vk_pipeline_layout(device, set_layouts, {{VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(CameraPushConstants)}});
+
+        get_variant(PipelineVariant(FullVertexLayout));
+        get_variant(PipelineVariant(PackedVertexLayout));
+    }
+
+    // Returns the pipeline id of the variant, creating its pipeline if this is the first time it is asked for.
+    int get_variant(const PipelineVariant& variant) {
+        for (int i = 0; i < variants.size(); ++i) {
+            if (variants[i] == variant) {
+                return i;
+            }
+        }
+
+        if (variant.layout == PackedVertexLayout) {
+            pipelines.push_back(create_pipeline_variant<PackedVertex, PackedObjectData>(device, pipeline_layout, render_pass, vertex_shader_module, 
+                                                                                      fragment_shader_module, extent, pipeline_cache, variant));
+        } else {
+            pipelines.push_back(create_pipeline_variant<Vertex, ObjectData>(device, pipeline_layout, render_pass, vertex_shader_module, fragment_shader_module, 
+                                                                            extent, pipeline_cache, variant));
+        }
+        variants.push_back(variant);
+        return variants.size() - 1;
+    }
+
+    const PipelineVariant& get_variant_info(int pipeline_id) {
+        if (pipeline_id < 0 || pipeline_id >= variants.size()) {
+            throw std::runtime_error("Unknown pipeline id: " + std::to_string(pipeline_id));
+        }
+        return variants[pipeline_id];
+    }
+
+    VkPipeline get_pipeline(int pipeline_id) {
+        get_variant_info(pipeline_id);
+        return pipelines[pipeline_id];
+    }
+};
+
+// Texture atlases. Sprites are packed into large RGBA pages, so that any number of sprites on the same page can share one
+// descriptor set and be drawn in one call.
+
+// Where a sprite ended up. uv_min and uv_max are the texture coordinates of its corners on the page.
+struct AtlasRegion {
+    int page;
+    glm::vec2 uv_min;
+    glm::vec2 uv_max;
+};
+
+struct AtlasPage {
+    VkImage image;
+    GpuAllocation memory;
+    VkImageView image_view;
+    VkDescriptorSet descriptor_set;
+    // The page is assembled on the CPU and uploaded as a whole, after which it is immutable and the pixels are dropped.
+    std::vector<uint8_t> pixels;
+    bool uploaded;
+    UploadHandle upload;
+    // Shelf packing: sprites are placed left to right on the current shelf, and a new shelf starts above the tallest one.
+    uint32_t shelf_x;
+    uint32_t shelf_y;
+    uint32_t shelf_height;
+};
+
+struct TextureAtlas {
+    VkDevice device;
+    GpuAllocator* allocator;
+    uint32_t page_size;
+    int max_pages;
+
+    VkDescriptorSetLayout descriptor_set_layout;
+    VkDescriptorPool descriptor_pool;
+    VkSampler sampler;
+    std::vector<AtlasPage> pages;
+
+    // Texels left empty around every sprite, so that filtering never picks up a neighbour.
+    static const uint32_t padding = 1;
+
+    TextureAtlas() : device(VK_NULL_HANDLE), allocator(nullptr), page_size(0), max_pages(0), descriptor_set_layout(VK_NULL_HANDLE), 
+        descriptor_pool(VK_NULL_HANDLE), sampler(VK_NULL_HANDLE) {
+
+    }
+
+    TextureAtlas(VkDevice _device, GpuAllocator* _allocator, uint32_t _page_size = 1024, int _max_pages = 16) : 
+        device(_device), allocator(_allocator), page_size(_page_size), max_pages(_max_pages) {
+        VkDescriptorSetLayoutBinding binding{};
+        binding.binding = 0;
+        binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        binding.descriptorCount = 1;
+        binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+        VkDescriptorSetLayoutCreateInfo layout_info{};
+        layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layout_info.bindingCount = 1;
+        layout_info.pBindings = &binding;
+
+        if (VkResult result = vkCreateDescriptorSetLayout(device, &layout_info, nullptr, &descriptor_set_layout); result != VK_SUCCESS) {
+            throw std::runtime_error("Could not create atlas descriptor set layout: " + std::string(string_VkResult(result)));
+        }
+
+        VkDescriptorPoolSize pool_size{};
+        pool_size.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        pool_size.descriptorCount = max_pages;
+
+        VkDescriptorPoolCreateInfo pool_info{};
+        pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        pool_info.maxSets = max_pages;
+        pool_info.poolSizeCount = 1;
+        pool_info.pPoolSizes = &pool_size;
+
+        if (VkResult result = vkCreateDescriptorPool(device, &pool_info, nullptr, &descriptor_pool); result != VK_SUCCESS) {
+            throw std::runtime_error("Could not create atlas descriptor pool: " + std::string(string_VkResult(result)));
+        }
+
+        // Nearest filtering keeps pixel art sharp.
+        VkSamplerCreateInfo sampler_info{};
+        sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+        sampler_info.magFilter = VK_FILTER_NEAREST;
+        sampler_info.minFilter = VK_FILTER_NEAREST;
+        sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+        sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        sampler_info.anisotropyEnable = VK_FALSE;
+        sampler_info.maxAnisotropy = 1.0f;
+        sampler_info.unnormalizedCoordinates = VK_FALSE;
+        sampler_info.compareEnable = VK_FALSE;
+        sampler_info.minLod = 0.0f;
+        sampler_info.maxLod = 0.0f;
+
+        if (VkResult result = vkCreateSampler(device, &sampler_info, nullptr, &sampler); result != VK_SUCCESS) {
+            throw std::runtime_error("Could not create atlas sampler: " + std::string(string_VkResult(result)));
+        }
+
+        add_page();
+    }
+
+    // Copies an RGBA8 sprite into the first page with room for it that has not been uploaded yet, starting a new page if
+    // there is none.
+    AtlasRegion add_sprite(uint32_t width, uint32_t height, const uint8_t* rgba) {
+        // The white texel takes up the top shelf of a new page, padding included, and a sprite may have to go below it.
+        if (width + padding > page_size || height + 1 + padding > page_size) {
+            throw std::runtime_error("Sprite of " + std::to_string(width) + "x" + std::to_string(height) + " does not fit on an atlas page of " 
+                                     + std::to_string(page_size));
+        }
+
+        for (int page_id = 0; page_id < pages.size(); ++page_id) {
+            uint32_t x, y;
+            if (!pages[page_id].uploaded && allocate(pages[page_id], width, height, &x, &y)) {
+                return place_sprite(page_id, x, y, width, height, rgba);
+            }
+        }
+
+        int page_id = add_page();
+        uint32_t x, y;
+        if (!allocate(pages[page_id], width, height, &x, &y)) {
+            throw std::runtime_error("Sprite of " + std::to_string(width) + "x" + std::to_string(height) + " does not fit on a new atlas page.");
+        }
+        return place_sprite(page_id, x, y, width, height, rgba);
+    }
+
+    // Queues the upload of every page that has not been uploaded yet. Pages are immutable afterwards, so this is called right
+    // before a frame that may sample them is recorded.
+    void upload_pages(UploadManager& upload_manager) {
+        for (AtlasPage& page : pages) {
+            if (!page.uploaded) {
+                page.upload = upload_manager.upload_image(page.image, page.pixels.data(), {page_size, page_size}, 4);
+                page.uploaded = true;
+                page.pixels = {};
+            }
+        }
+    }
+
+    int get_page_count() {
+        return pages.size();
+    }
+
+    VkDescriptorSet get_descriptor_set(int page_id) {
+        return pages[page_id].descriptor_set;
+    }
+
+    void vk_destroy() {
+        for (AtlasPage& page : pages) {
+            vkDestroyImageView(device, page.image_view, nullptr);
+            vkDestroyImage(device, page.image, nullptr);
+            allocator->free(page.memory);
+        }
+        pages.clear();
+        if (sampler != VK_NULL_HANDLE) {
+            vkDestroySampler(device, sampler, nullptr);
+            vkDestroyDescriptorPool(device, descriptor_pool, nullptr);
+            vkDestroyDescriptorSetLayout(device, descriptor_set_layout, nullptr);
+        }
+    }
+
+    private:
+
+    int add_page() {
+        if (pages.size() >= max_pages) {
+            throw std::runtime_error("Texture atlas is full at " + std::to_string(max_pages) + " pages");
+        }
+
+        AtlasPage page;
+        page.pixels = std::vector<uint8_t>(page_size * page_size * 4, 0);
+        page.uploaded = false;
+        page.upload = 0;
+        page.shelf_x = 0;
+        page.shelf_y = 0;
+        page.shelf_height = 0;
+
+        VkImageCreateInfo image_info{};
+        image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        image_info.imageType = VK_IMAGE_TYPE_2D;
+        image_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+        image_info.extent = {page_size, page_size, 1};
+        image_info.mipLevels = 1;
+        image_info.arrayLayers = 1;
+        image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+        image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+        image_info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+        image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+        if (VkResult result = vkCreateImage(device, &image_info, nullptr, &page.image); result != VK_SUCCESS) {
+            throw std::runtime_error("Could not create atlas page: " + std::string(string_VkResult(result)));
+        }
+
+        VkMemoryRequirements memory_requirements;
+        vkGetImageMemoryRequirements(device, page.image, &memory_requirements);
+        page.memory = allocator->allocate(memory_requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, FreeListStrategy, true);
+        vkBindImageMemory(device, page.image, page.memory.memory, page.memory.offset);
+
+        VkImageViewCreateInfo view_info{};
+        view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        view_info.image = page.image;
+        view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        view_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+        view_info.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+        view_info.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+        view_info.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+        view_info.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+        view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        view_info.subresourceRange.baseMipLevel = 0;
+        view_info.subresourceRange.levelCount = 1;
+        view_info.subresourceRange.baseArrayLayer = 0;
+        view_info.subresourceRange.layerCount = 1;
+
+        if (VkResult result = vkCreateImageView(device, &view_info, nullptr, &page.image_view); result != VK_SUCCESS) {
+            throw std::runtime_error("Could not create atlas page view: " + std::string(string_VkResult(result)));
+        }
+
+        VkDescriptorSetAllocateInfo allocate_info{};
+        allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocate_info.descriptorPool = descriptor_pool;
+        allocate_info.descriptorSetCount = 1;
+        allocate_info.pSetLayouts = &descriptor_set_layout;
+
+        if (VkResult result = vkAllocateDescriptorSets(device, &allocate_info, &page.descriptor_set); result != VK_SUCCESS) {
+            throw std::runtime_error("Could not allocate atlas descriptor set: " + std::string(string_VkResult(result)));
+        }
+
+        VkDescriptorImageInfo image_descriptor{};
+        image_descriptor.sampler = sampler;
+        image_descriptor.imageView = page.image_view;
+        image_descriptor.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+        VkWriteDescriptorSet write{};
+        write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write.dstSet = page.descriptor_set;
+        write.dstBinding = 0;
+        write.descriptorCount = 1;
+        write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        write.pImageInfo = &image_descriptor;
+        vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+
+        pages.push_back(page);
+        int page_id = pages.size() - 1;
+
+        // Texel (0, 0) is white on every page, for untextured vertices.
+        const uint8_t white[4] = {255, 255, 255, 255};
+        uint32_t x, y;
+        allocate(pages[page_id], 1, 1, &x, &y);
+        place_sprite(page_id, x, y, 1, 1, white);
+
+        return page_id;
+    }
+
+    bool allocate(AtlasPage& page, uint32_t width, uint32_t height, uint32_t* x, uint32_t* y) {
+        if (page.shelf_x + width > page_size) {
+            page.shelf_x = 0;
+            page.shelf_y += page.shelf_height;
+            page.shelf_height = 0;
+        }
+        if (page.shelf_y + height > page_size) {
+            return false;
+        }
+
+        *x = page.shelf_x;
+        *y = page.shelf_y;
+        page.shelf_x += width + padding;
+        page.shelf_height = std::max(page.shelf_height, height + padding);
+        return true;
+    }
+
+    AtlasRegion place_sprite(int page_id, uint32_t x, uint32_t y, uint32_t width, uint32_t height, const uint8_t* rgba) {
+        AtlasPage& page = pages[page_id];
+        for (uint32_t row = 0; row < height; ++row) {
+            memcpy(page.pixels.data() + ((y + row) * page_size + x) * 4, rgba + row * width * 4, width * 4);
+        }
+
+        return {page_id, glm::vec2(x, y) / (float) page_size, glm::vec2(x + width, y + height) / (float) page_size};
+    }
+};
+
+// A quad of the given size with its texture coordinates spanning a sprite.
+std::vector<Vertex> get_sprite_vertices(glm::vec2 size, const AtlasRegion& region, glm::vec3 color = glm::vec3(255, 255, 255)) {
+    Vertex top_left(glm::vec2(0, 0), color, region.uv_min);
+    Vertex top_right(glm::vec2(size.x, 0), color, glm::vec2(region.uv_max.x, region.uv_min.y));
+    Vertex bottom_left(glm::vec2(0, size.y), color, glm::vec2(region.uv_min.x, region.uv_max.y));
+    Vertex bottom_right(size, color, region.uv_max);
+    return {top_left, bottom_right, bottom_left, top_left, top_right, bottom_right};
+}
+
+// GPU culling. A compute pass tests every instance of a draw against the view, compacts the visible ones into a separate
+// instance buffer and writes their count into an indirect draw command, so only visible instances reach the vertex stage.
+
+// Push constants of shaders/src/cull.comp.
+struct CullPushConstants {
+    glm::vec4 mesh_bounds;
+    glm::vec4 view;
+    uint32_t input_offset;
+    uint32_t instance_count;
+    uint32_t output_offset;
+    uint32_t command_offset;
+};
+
+struct CullingPipeline {
+    VkShaderModule shader_module;
+    VkDescriptorSetLayout descriptor_set_layout;
+    VkPipelineLayout pipeline_layout;
+    VkPipeline pipeline;
+
+    CullingPipeline() : shader_module(VK_NULL_HANDLE), descriptor_set_layout(VK_NULL_HANDLE), pipeline_layout(VK_NULL_HANDLE), pipeline(VK_NULL_HANDLE) {
+
+    }
+
+    CullingPipeline(VkDevice device, std::string shader_loc, PipelineCache* pipeline_cache, AssetArchive* archive = nullptr) : 
+        shader_module(load_shader_module(device, archive, shader_loc)) {
+        TRACE_ZONE("create_culling_pipeline");
+        // Instances, visible instances and indirect commands.
+        std::vector<VkDescriptorSetLayoutBinding> bindings = {};
+        for (uint32_t binding = 0; binding < 3; ++binding) {
+            VkDescriptorSetLayoutBinding layout_binding{};
+            layout_binding.binding = binding;
+            layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            layout_binding.descriptorCount = 1;
+            layout_binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+            bindings.push_back(layout_binding);
+        }
+
+        VkDescriptorSetLayoutCreateInfo layout_info{};
+        layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layout_info.bindingCount = bindings.size();
+        layout_info.pBindings = bindings.data();
+
+        if (VkResult result = vkCreateDescriptorSetLayout(device, &layout_info, nullptr, &descriptor_set_layout); result != VK_SUCCESS) {
+            throw std::runtime_error("Could not create culling descriptor set layout: " + std::string(string_VkResult(result)));
+        }
+
+        VkPushConstantRange push_constant_range{};
+        push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        push_constant_range.offset = 0;
+        push_constant_range.size = sizeof(CullPushConstants);
+
+        VkPipelineLayoutCreateInfo pipeline_layout_info{};
+        pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipeline_layout_info.setLayoutCount = 1;
+        pipeline_layout_info.pSetLayouts = &descriptor_set_layout;
+        pipeline_layout_info.pushConstantRangeCount = 1;
+        pipeline_layout_info.pPushConstantRanges = &push_constant_range;
+
+        if (VkResult result = vkCreatePipelineLayout(device, &pipeline_layout_info, nullptr, &pipeline_layout); result != VK_SUCCESS) {
+            throw std::runtime_error("Could not create culling pipeline layout: " + std::string(string_VkResult(result)));
+        }
+
+        VkComputePipelineCreateInfo pipeline_info{};
+        pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        pipeline_info.stage.module = shader_module;
+        pipeline_info.stage.pName = "main";
+        pipeline_info.layout = pipeline_layout;
+
+        pipeline = pipeline_cache->create_compute_pipeline(pipeline_info);
+    }
+
+    void vk_destroy(VkDevice device) {
+        if (pipeline != VK_NULL_HANDLE) {
+            vkDestroyPipeline(device, pipeline, nullptr);
+            vkDestroyPipelineLayout(device, pipeline_layout, nullptr);
+            vkDestroyDescriptorSetLayout(device, descriptor_set_layout, nullptr);
+            vkDestroyShaderModule(device, shader_module, nullptr);
+        }
+    }
+};
+
+// The GPU side of a culled draw of a (full layout) vertex buffer and object buffer. Each frame in flight has its own region of
+// the visible instance buffer and its own indirect command, so a frame can be culled while the previous one is still drawn.
+struct CulledDraw {
+    int vbuffer_id;
+    int obuffer_id;
+    int capacity;
+    bool indexed;
+
+    VkBuffer visible_buffer;
+    GpuAllocation visible_memory;
+    VkBuffer command_buffer;
+    GpuAllocation command_memory;
+
+    VkDescriptorPool descriptor_pool;
+    VkDescriptorSet descriptor_set;
+
+    // Large enough for either VkDrawIndirectCommand or VkDrawIndexedIndirectCommand.
+    static const VkDeviceSize command_stride = 32;
+
+    CulledDraw(GpuAllocator& allocator, VkDevice device, const CullingPipeline& culling_pipeline, int queue_index, int _vbuffer_id, int _obuffer_id, 
+                VkBuffer object_buffer, int _capacity, bool _indexed, int frame_count) : 
+        vbuffer_id(_vbuffer_id), obuffer_id(_obuffer_id), capacity(_capacity), indexed(_indexed) {
+        auto [visible, visible_mem] = get_vk_buffer(allocator, device, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_SHARING_MODE_EXCLUSIVE, 
+                                                    sizeof(ObjectData) * std::max(capacity, 1) * frame_count, queue_index, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        visible_buffer = visible;
+        visible_memory = visible_mem;
+
+        auto [commands, commands_mem] = get_vk_buffer(allocator, device, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, 
+                                                        VK_SHARING_MODE_EXCLUSIVE, command_stride * frame_count, queue_index, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        command_buffer = commands;
+        command_memory = commands_mem;
+
+        VkDescriptorPoolSize pool_size{};
+        pool_size.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        pool_size.descriptorCount = 3;
+
+        VkDescriptorPoolCreateInfo pool_info{};
+        pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        pool_info.maxSets = 1;
+        pool_info.poolSizeCount = 1;
+        pool_info.pPoolSizes = &pool_size;
+
+        if (VkResult result = vkCreateDescriptorPool(device, &pool_info, nullptr, &descriptor_pool); result != VK_SUCCESS) {
+            throw std::runtime_error("Could not create culling descriptor pool: " + std::string(string_VkResult(result)));
+        }
+
+        VkDescriptorSetAllocateInfo allocate_info{};
+        allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocate_info.descriptorPool = descriptor_pool;
+        allocate_info.descriptorSetCount = 1;
+        allocate_info.pSetLayouts = &culling_pipeline.descriptor_set_layout;
+
+        if (VkResult result = vkAllocateDescriptorSets(device, &allocate_info, &descriptor_set); result != VK_SUCCESS) {
+            throw std::runtime_error("Could not allocate culling descriptor set: " + std::string(string_VkResult(result)));
+        }
+
+        // Whole buffers are bound and the frame's regions are selected with push constants, which avoids the storage buffer
+        // offset alignment that per-frame descriptor ranges would need.
+        VkDescriptorBufferInfo buffer_infos[3] = {{object_buffer, 0, VK_WHOLE_SIZE}, {visible_buffer, 0, VK_WHOLE_SIZE}, {command_buffer, 0, VK_WHOLE_SIZE}};
+        std::vector<VkWriteDescriptorSet> writes = {};
+        for (uint32_t binding = 0; binding < 3; ++binding) {
+            VkWriteDescriptorSet write{};
+            write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            write.dstSet = descriptor_set;
+            write.dstBinding = binding;
+            write.descriptorCount = 1;
+            write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            write.pBufferInfo = &buffer_infos[binding];
+            writes.push_back(write);
+        }
+        vkUpdateDescriptorSets(device, writes.size(), writes.data(), 0, nullptr);
+    }
+
+    VkDeviceSize visible_offset(int frame) {
+        return sizeof(ObjectData) * capacity * frame;
+    }
+
+    VkDeviceSize command_offset(int frame) {
+        return command_stride * frame;
+    }
+
+    void destroy(VkDevice device, GpuAllocator& allocator) {
+        vkDestroyDescriptorPool(device, descriptor_pool, nullptr);
+        vkDestroyBuffer(device, visible_buffer, nullptr);
+        allocator.free(visible_memory);
+        vkDestroyBuffer(device, command_buffer, nullptr);
+        allocator.free(command_memory);
+    }
+};
+
+// Frames themselves are tracked by the FrameScheduler. These are the binary semaphores acquisition and presentation need.
+void create_synchronization_objects(VkDevice logical_device, std::vector<VkSemaphore>* image_available_semaphores, std::vector<VkSemaphore>* image_done_rendering_semaphores, int MAX_FRAMES_IN_FLIGHT) {
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        VkSemaphore image_available_semaphore;
+        VkSemaphore image_done_rendering_semaphore;
         VkSemaphoreCreateInfo semaphore_creation_info {};
         semaphore_creation_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
         vkCreateSemaphore(logical_device, &semaphore_creation_info, nullptr, &image_available_semaphore);
         vkCreateSemaphore(logical_device, &semaphore_creation_info, nullptr, &image_done_rendering_semaphore);
 
-        command_buffer_fences->push_back(command_buffer_fence);
         image_available_semaphores->push_back(image_available_semaphore);
         image_done_rendering_semaphores->push_back(image_done_rendering_semaphore);
     }
 }
 
+// A resource that frames already submitted may still use. It is destroyed once all of them have retired.
+struct DeferredDeletion {
+    // The last frame that may use the resource.
+    uint64_t frame;
+    std::function<void()> destroy;
+};
+
 struct VkContext {
+    // When headless, there is no window, surface or swapchain. Frames are rendered into images owned by the context instead.
+    bool headless;
+
     SDL_Window* window;
     VkInstance instance;
     VkSurfaceKHR surface;
     VkPhysicalDevice physical_device;
     VkDevice logical_device;
     std::unordered_map<std::string, VkQueueWrapper> queue_map;
+    GpuAllocator allocator;
+    UploadManager upload_manager;
     VkSwapchainKHR swapchain;
     std::vector<VkImage> images;
     std::vector<VkImageView> image_views;
+    std::vector<GpuAllocation> offscreen_images_memory;
     std::vector<VkFramebuffer> swapchain_framebuffers;
     VkFormat swapchain_format;
     VkExtent2D swapchain_extent;
-    GraphicsPipeline graphics_pipeline;
+    // How the swapchain presents, and how many images it has beyond the minimum. present_mode is what the surface allowed.
+    PresentPolicy present_policy;
+    int additional_swapchain_images;
+    VkPresentModeKHR present_mode;
+    PipelineCache pipeline_cache;
+    PipelineRegistry pipelines;
+    CullingPipeline culling_pipeline;
+    TextureAtlas texture_atlas;
+    // Shaders and other assets, mapped once. Null when there is no archive.
+    std::unique_ptr<AssetArchive> asset_archive;
     
-    const int MAX_FRAMES_IN_FLIGHT = 2;
+    // Frames that may be in flight at once, chosen when the context is created. Per-frame resources have this many slots.
+    const int MAX_FRAMES_IN_FLIGHT;
 
     VkCommandPool command_pool;
     VkCommandPool transient_command_pool;
 
     std::vector<VkCommandBuffer> command_buffers;
-    std::vector<VkFence> command_buffer_fences;
+    std::unique_ptr<RecordingScheduler> recording_scheduler;
+
+    // When set, draw_frame keeps one recorded command buffer per (image, frame in flight) pair and resubmits it as long as
+    // nothing it depends on has changed, instead of recording every frame. Dynamic buffer contents may still change freely.
+    bool cache_command_buffers;
+    // Indexed [image * MAX_FRAMES_IN_FLIGHT + frame]. Each is valid while its recorded version equals scene_version.
+    std::vector<VkCommandBuffer> cached_command_buffers;
+    std::vector<uint64_t> cached_command_buffer_versions;
+    std::vector<DrawCommand> cached_draws;
+    uint64_t scene_version;
+
+    // Draws submitted for the next frame. draw_frame batches and then clears them.
+    std::vector<DrawCommand> draw_list;
+
+    // Numbers, submits and retires frames. Resources released while frames were in flight wait in the deletion queue.
+    FrameScheduler frame_scheduler;
+    std::deque<DeferredDeletion> deletion_queue;
+
+    // Times the uploads, culling and render pass of every frame on the GPU. See gpu_profiler.h.
+    GpuProfiler gpu_profiler;
+
+    // Delays the start of frames so that input is sampled as late as possible, and measures input to render complete latency.
+    // Disabled by default; the latency is measured either way.
+    FramePacer frame_pacer;
+
     std::vector<VkSemaphore> image_available_semaphores;
     std::vector<VkSemaphore> image_done_rendering_semaphores;
 
     std::vector<VertexBufferBacked<Vertex>> vertex_buffers;
     std::vector<VertexBufferBacked<ObjectData>> object_position_buffers;
+    std::vector<int> free_object_buffer_ids;
+    // Index buffers of indexed meshes, keyed by the id of their vertex buffer.
+    std::unordered_map<int, IndexBufferBacked> index_buffers;
+
+    // Buffers for the packed pipeline. Their ids are separate from those of the full layout buffers above.
+    std::vector<VertexBufferBacked<PackedVertex>> packed_vertex_buffers;
+    std::vector<VertexBufferBacked<PackedObjectData>> packed_object_position_buffers;
+    std::unordered_map<int, IndexBufferBacked> packed_index_buffers;
+
+    // Bounds of every full layout vertex buffer around its origin, as min x, min y, max x, max y. Used for culling.
+    std::vector<glm::vec4> vertex_buffer_bounds;
+    std::vector<CulledDraw> culled_draws;
+    // The area culled draws are tested against, as min x, min y, max x, max y in world units. Follows the camera until it is
+    // pinned by set_cull_view.
+    glm::vec4 cull_view;
+    bool cull_view_pinned;
+
+    // See CameraPushConstants.
+    glm::vec2 camera_center;
+    float camera_zoom;
 
     VkContext(const VkContext&) = delete;
 
-    VkContext() {
+    VkContext(bool _headless = false, VkExtent2D offscreen_extent = {1000, 1000}, PresentPolicy _present_policy = MailboxPresentPolicy, 
+                int _additional_swapchain_images = 1, int _frames_in_flight = 2) : headless(_headless), window(nullptr), surface(VK_NULL_HANDLE), swapchain(VK_NULL_HANDLE), 
+        present_policy(_present_policy), additional_swapchain_images(_additional_swapchain_images), present_mode(VK_PRESENT_MODE_FIFO_KHR), 
+        MAX_FRAMES_IN_FLIGHT(_frames_in_flight), cache_command_buffers(false), scene_version(1), cull_view(0, 0, GAME_UNIT_BOUND, GAME_UNIT_BOUND), 
+        cull_view_pinned(false), camera_center(GAME_UNIT_BOUND / 2, GAME_UNIT_BOUND / 2), camera_zoom(1.0f) {
+        TRACE_ZONE("create_context");
         // Load Vulkan and SDL
         load_vulkan();
-        sdl_init();
 
-        // Create a window.
-        window = get_sdl_window();
+        if (!headless) {
+            sdl_init();
+
+            // Create a window.
+            window = get_sdl_window();
+        }
 
         // Create an instance of vulkan.
         instance = get_vk_instance(window);
 
-        // Create the window surface.
-        surface = get_vk_surface(window, instance);
+        if (!headless) {
+            // Create the window surface.
+            surface = get_vk_surface(window, instance);
+
+            // Create a physical device, a logical device and get a graphics queue and presentation queue from it.
+            get_vk_devices_and_queues(instance, surface, physical_device, logical_device, queue_map, default_queue_requirements, optional_queue_requirements, 
+                                        present_policy);
+
+            // Create the device memory allocator.
+            allocator = GpuAllocator(physical_device, logical_device);
+
+            // Create the swapchain.
+            get_vk_swapchain_and_images(window, surface, physical_device, logical_device, queue_map["graphics_queue"], queue_map["presentation_queue"], swapchain, images, image_views, swapchain_format, swapchain_extent, 
+                                        present_mode, present_policy, additional_swapchain_images);
+        } else {
+            // Create a physical device, a logical device and get a graphics queue from it.
+            get_vk_devices_and_queues(instance, surface, physical_device, logical_device, queue_map, headless_queue_requirements);
 
-        // Create a physical device, a logical device and get a graphics queue and presentation queue from it.
-        get_vk_devices_and_queues(instance, surface, physical_device, logical_device, queue_map);
+            // Create the device memory allocator.
+            allocator = GpuAllocator(physical_device, logical_device);
 
-        // Create the swapchain.
-        get_vk_swapchain_and_images(window, surface, physical_device, logical_device, queue_map["graphics_queue"], queue_map["presentation_queue"], swapchain, images, image_views, swapchain_format, swapchain_extent);
+            // Create one offscreen image per frame in flight so that consecutive frames never write to the same image.
+            swapchain_format = VK_FORMAT_B8G8R8A8_SRGB;
+            swapchain_extent = offscreen_extent;
+            get_vk_offscreen_images(physical_device, allocator, logical_device, swapchain_format, swapchain_extent, MAX_FRAMES_IN_FLIGHT, images, offscreen_images_memory, image_views);
+        }
     
-        // Create the graphics pipeline.
-        graphics_pipeline = GraphicsPipeline(logical_device, "shaders/bin/shader_2d_vert.spv", "shaders/bin/shader_2d_frag.spv", swapchain_extent, swapchain_format);
+        // Load the pipeline cache from the previous run.
+        pipeline_cache = PipelineCache(physical_device, logical_device, "pipeline_cache.bin");
+
+        // Open the asset archive built by pack_assets. Without one, assets are read from their files.
+        if (std::ifstream("assets.pak").good()) {
+            asset_archive = std::make_unique<AssetArchive>("assets.pak");
+        } else {
+            std::cout << "No assets.pak, loading assets from their files" << std::endl;
+        }
+
+        // Create the texture atlas, whose pages the graphics pipelines sample through descriptor set 0.
+        texture_atlas = TextureAtlas(logical_device, &allocator);
+
+        // Create the graphics pipelines. Offscreen images are left ready to be copied from instead of presented.
+        pipelines = PipelineRegistry(logical_device, "shaders/bin/shader_2d_vert.spv", "shaders/bin/shader_2d_frag.spv", swapchain_extent, swapchain_format, 
+                                        headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, &pipeline_cache, 
+                                        {texture_atlas.descriptor_set_layout}, asset_archive.get());
+        culling_pipeline = CullingPipeline(logical_device, "shaders/bin/cull_comp.spv", &pipeline_cache, asset_archive.get());
 
         // Create swapchain framebuffers.
-        swapchain_framebuffers = get_vk_swapchain_framebuffers(logical_device, image_views, graphics_pipeline.render_pass, swapchain_extent);
+        swapchain_framebuffers = get_vk_swapchain_framebuffers(logical_device, image_views, pipelines.render_pass, swapchain_extent);
+        cull_view = get_camera_view();
 
         // Create command pool.
         command_pool = get_vk_command_pool(logical_device, get_graphics_queue_index(), VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
@@ -1161,25 +2809,450 @@ struct VkContext {
         // Create command buffer.
         command_buffers = get_vk_command_buffers(logical_device, command_pool, MAX_FRAMES_IN_FLIGHT);
 
-        // Create synchronization objects.
-        create_synchronization_objects(logical_device, &command_buffer_fences, &image_available_semaphores, &image_done_rendering_semaphores, MAX_FRAMES_IN_FLIGHT);
+        // Start the worker threads that record secondary command buffers.
+        recording_scheduler = std::make_unique<RecordingScheduler>(logical_device, get_graphics_queue_index(), MAX_FRAMES_IN_FLIGHT);
+
+        // Create synchronization objects. Timeline semaphores were enabled on the device if it supports them.
+        frame_scheduler = FrameScheduler(logical_device, supports_timeline_semaphores(physical_device), MAX_FRAMES_IN_FLIGHT);
+        create_synchronization_objects(logical_device, &image_available_semaphores, &image_done_rendering_semaphores, MAX_FRAMES_IN_FLIGHT);
+
+        // Create the upload manager. Copies run on the transfer queue, which is the graphics queue if there is no dedicated family.
+        upload_manager = UploadManager(logical_device, &allocator, &frame_scheduler, queue_map["transfer_queue"], queue_map["graphics_queue"]);
+
+        // Create the timestamp query pools.
+        gpu_profiler = GpuProfiler(physical_device, logical_device, MAX_FRAMES_IN_FLIGHT);
     }
 
     int create_vertex_buffer(std::vector<Vertex> vertex_data) {
-        vertex_buffers.push_back(VertexBufferBacked<Vertex>(physical_device, logical_device, queue_map["graphics_queue"], transient_command_pool, vertex_data));
+        glm::vec2 lower = vertex_data.empty() ? glm::vec2(0, 0) : vertex_data[0].pos;
+        glm::vec2 upper = lower;
+        for (const Vertex& vertex : vertex_data) {
+            lower = glm::min(lower, vertex.pos);
+            upper = glm::max(upper, vertex.pos);
+        }
+        vertex_buffer_bounds.push_back(glm::vec4(lower.x, lower.y, upper.x, upper.y));
+
+        vertex_buffers.push_back(VertexBufferBacked<Vertex>(allocator, logical_device, upload_manager, vertex_data));
+        invalidate_command_buffers();
         return vertex_buffers.size() - 1;
     }
 
+    // Imports an unindexed triangle list as an indexed mesh: duplicate vertices are merged and triangles are reordered for the
+    // vertex cache. Returns a vertex buffer id that is drawn with vkCmdDrawIndexed.
+    int create_indexed_mesh(std::vector<Vertex> triangle_list) {
+        if (triangle_list.size() % 3 != 0) {
+            throw std::runtime_error("Indexed meshes must be made of whole triangles.");
+        }
+
+        std::vector<Vertex> vertex_data = {};
+        std::vector<uint32_t> indices = {};
+        build_indexed_mesh(triangle_list, vertex_data, indices);
+
+        int vbuffer_id = create_vertex_buffer(vertex_data);
+        index_buffers.emplace(vbuffer_id, IndexBufferBacked(allocator, logical_device, upload_manager, indices, vertex_data.size()));
+        return vbuffer_id;
+    }
+
+    // Ids of destroyed object buffers are reused.
     int create_object_position_buffer(std::vector<ObjectData> object_position_data) {
-        object_position_buffers.push_back(VertexBufferBacked<ObjectData>(physical_device, logical_device, queue_map["graphics_queue"], transient_command_pool, object_position_data));
+        VertexBufferBacked<ObjectData> object_buffer(allocator, logical_device, upload_manager, object_position_data, 
+                                                        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+        invalidate_command_buffers();
+        if (!free_object_buffer_ids.empty()) {
+            int obuffer_id = free_object_buffer_ids.back();
+            free_object_buffer_ids.pop_back();
+            object_position_buffers[obuffer_id] = object_buffer;
+            return obuffer_id;
+        }
+        object_position_buffers.push_back(object_buffer);
         return object_position_buffers.size() - 1;
     }
 
-    void rebuild_swapchain() {
+    // The buffer is released right away but only destroyed once the frames in flight are done with it. Draws of it must not be
+    // submitted afterwards.
+    void destroy_object_position_buffer(int obuffer_id) {
+        if (obuffer_id < 0 || obuffer_id >= object_position_buffers.size() || object_position_buffers[obuffer_id].buffer == VK_NULL_HANDLE) {
+            throw std::runtime_error("Destroying unknown object buffer " + std::to_string(obuffer_id));
+        }
+        // Culled draws bind the buffer into their descriptor sets, and a reused id would leave them culling a stale one.
+        for (int culled_draw_id = 0; culled_draw_id < culled_draws.size(); ++culled_draw_id) {
+            if (culled_draws[culled_draw_id].visible_buffer != VK_NULL_HANDLE && culled_draws[culled_draw_id].obuffer_id == obuffer_id) {
+                throw std::runtime_error("Destroying object buffer " + std::to_string(obuffer_id) + ", which culled draw " + std::to_string(culled_draw_id) 
+                                            + " still uses.");
+            }
+        }
+
+        VertexBufferBacked<ObjectData> object_buffer = object_position_buffers[obuffer_id];
+        defer_deletion([this, object_buffer]() mutable {
+            upload_manager.forget_buffer(object_buffer.buffer);
+            object_buffer.destroy(logical_device, allocator);
+        });
+        object_position_buffers[obuffer_id].buffer = VK_NULL_HANDLE;
+        free_object_buffer_ids.push_back(obuffer_id);
+        invalidate_command_buffers();
+    }
+
+    // Waits for the next frame as well, since uploads into the resource that are still queued go out with it.
+    void defer_deletion(std::function<void()> destroy) {
+        deletion_queue.push_back({frame_scheduler.get_next_frame(), destroy});
+    }
+
+    // Destroys the resources whose frames have retired. Never blocks.
+    void process_deferred_deletions() {
+        while (!deletion_queue.empty() && frame_scheduler.is_frame_retired(deletion_queue.front().frame)) {
+            deletion_queue.front().destroy();
+            deletion_queue.pop_front();
+        }
+    }
+
+    // Creates an object buffer that game code writes into every frame through frame_data(current_frame), after wait_for_frame.
+    int create_dynamic_object_position_buffer(int capacity) {
+        object_position_buffers.push_back(VertexBufferBacked<ObjectData>(allocator, logical_device, queue_map["graphics_queue"], capacity, MAX_FRAMES_IN_FLIGHT, 
+                                                                            VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT));
+        invalidate_command_buffers();
+        return object_position_buffers.size() - 1;
+    }
+
+    // Packed versions of the above. The ids they return are drawn with the PackedVertexLayout pipeline.
+    int create_packed_indexed_mesh(std::vector<Vertex> triangle_list) {
+        if (triangle_list.size() % 3 != 0) {
+            throw std::runtime_error("Indexed meshes must be made of whole triangles.");
+        }
+
+        // Packing first lets vertices that only differ below the packed precision be merged as well.
+        std::vector<PackedVertex> packed_triangle_list (triangle_list.begin(), triangle_list.end());
+        std::vector<PackedVertex> vertex_data = {};
+        std::vector<uint32_t> indices = {};
+        build_indexed_mesh(packed_triangle_list, vertex_data, indices);
+
+        packed_vertex_buffers.push_back(VertexBufferBacked<PackedVertex>(allocator, logical_device, upload_manager, vertex_data));
+        int vbuffer_id = packed_vertex_buffers.size() - 1;
+        packed_index_buffers.emplace(vbuffer_id, IndexBufferBacked(allocator, logical_device, upload_manager, indices, vertex_data.size()));
+        invalidate_command_buffers();
+        return vbuffer_id;
+    }
+
+    int create_packed_object_position_buffer(std::vector<ObjectData> object_position_data) {
+        std::vector<PackedObjectData> packed_data (object_position_data.begin(), object_position_data.end());
+        packed_object_position_buffers.push_back(VertexBufferBacked<PackedObjectData>(allocator, logical_device, upload_manager, packed_data));
+        invalidate_command_buffers();
+        return packed_object_position_buffers.size() - 1;
+    }
+
+    // Like destroy_object_position_buffer, for packed object buffers. Their ids are not reused.
+    void destroy_packed_object_position_buffer(int obuffer_id) {
+        if (obuffer_id < 0 || obuffer_id >= packed_object_position_buffers.size() || packed_object_position_buffers[obuffer_id].buffer == VK_NULL_HANDLE) {
+            throw std::runtime_error("Destroying unknown packed object buffer " + std::to_string(obuffer_id));
+        }
+
+        VertexBufferBacked<PackedObjectData> object_buffer = packed_object_position_buffers[obuffer_id];
+        defer_deletion([this, object_buffer]() mutable {
+            upload_manager.forget_buffer(object_buffer.buffer);
+            object_buffer.destroy(logical_device, allocator);
+        });
+        packed_object_position_buffers[obuffer_id].buffer = VK_NULL_HANDLE;
+        invalidate_command_buffers();
+    }
+
+    int create_dynamic_packed_object_position_buffer(int capacity) {
+        packed_object_position_buffers.push_back(VertexBufferBacked<PackedObjectData>(allocator, logical_device, queue_map["graphics_queue"], capacity, MAX_FRAMES_IN_FLIGHT));
+        invalidate_command_buffers();
+        return packed_object_position_buffers.size() - 1;
+    }
+
+    // Sets up GPU culling for drawing a vertex buffer with an object buffer, both of the full layout. Returns an id for submit_culled_draw.
+    int create_culled_draw(int vbuffer_id, int obuffer_id) {
+        if (vbuffer_id < 0 || vbuffer_id >= vertex_buffers.size() || obuffer_id < 0 || obuffer_id >= object_position_buffers.size()) {
+            throw std::runtime_error("Culled draw created with unknown buffer id.");
+        }
+        if (object_position_buffers[obuffer_id].buffer == VK_NULL_HANDLE) {
+            throw std::runtime_error("Culled draw created with destroyed object buffer " + std::to_string(obuffer_id));
+        }
+
+        culled_draws.push_back(CulledDraw(allocator, logical_device, culling_pipeline, get_graphics_queue_index(), vbuffer_id, obuffer_id, 
+                                            object_position_buffers[obuffer_id].buffer, object_position_buffers[obuffer_id].capacity, 
+                                            index_buffers.find(vbuffer_id) != index_buffers.end(), MAX_FRAMES_IN_FLIGHT));
+        return culled_draws.size() - 1;
+    }
+
+    // Like destroy_object_position_buffer, for culled draws. Their ids are not reused. A culled draw has to be destroyed before
+    // its object buffer.
+    void destroy_culled_draw(int culled_draw_id) {
+        if (culled_draw_id < 0 || culled_draw_id >= culled_draws.size() || culled_draws[culled_draw_id].visible_buffer == VK_NULL_HANDLE) {
+            throw std::runtime_error("Destroying unknown culled draw " + std::to_string(culled_draw_id));
+        }
+
+        CulledDraw culled_draw = culled_draws[culled_draw_id];
+        defer_deletion([this, culled_draw]() mutable {
+            culled_draw.destroy(logical_device, allocator);
+        });
+        culled_draws[culled_draw_id].visible_buffer = VK_NULL_HANDLE;
+        invalidate_command_buffers();
+    }
+
+    // Queues all current instances of a culled draw for the next frame. Visible instances are drawn in no particular order.
+    // A culled draw has one visible region and one indirect command per frame, so it can only be submitted once per frame.
+    void submit_culled_draw(int culled_draw_id, int layer = 0, int texture_id = 0) {
+        const CulledDraw& culled_draw = culled_draws.at(culled_draw_id);
+        if (culled_draw.visible_buffer == VK_NULL_HANDLE) {
+            throw std::runtime_error("Submitted destroyed culled draw " + std::to_string(culled_draw_id));
+        }
+        if (object_position_buffers[culled_draw.obuffer_id].buffer == VK_NULL_HANDLE) {
+            throw std::runtime_error("Culled draw submitted with destroyed object buffer " + std::to_string(culled_draw.obuffer_id));
+        }
+        if (texture_id < 0 || texture_id >= texture_atlas.get_page_count()) {
+            throw std::runtime_error("Draw submitted with unknown texture id.");
+        }
+        for (const DrawCommand& draw : draw_list) {
+            if (draw.culled_draw_id == culled_draw_id) {
+                throw std::runtime_error("Culled draw " + std::to_string(culled_draw_id) + " submitted twice in one frame.");
+            }
+        }
+        draw_list.push_back({layer, FullVertexLayout, culled_draw.vbuffer_id, culled_draw.obuffer_id, 0, object_position_buffers[culled_draw.obuffer_id].length, 
+                                culled_draw_id, texture_id});
+    }
+
+    // Pins the cull view, so that moving the camera no longer changes it.
+    void set_cull_view(glm::vec4 view) {
+        cull_view_pinned = true;
+        update_cull_view(view);
+    }
+
+    // Command buffers are recorded with the cull view, so they are only invalidated when it changes.
+    void update_cull_view(glm::vec4 view) {
+        if (view != cull_view) {
+            cull_view = view;
+            invalidate_command_buffers();
+        }
+    }
+
+    // Moves the camera and, unless it is pinned, sets the cull view to what it sees. Costs one push constant per command buffer,
+    // but command buffers that are kept and resubmitted have to be recorded again.
+    void set_camera(glm::vec2 center, float zoom = 1.0f) {
+        if (zoom <= 0) {
+            throw std::runtime_error("Camera zoom must be positive.");
+        }
+        if (center != camera_center || zoom != camera_zoom) {
+            camera_center = center;
+            camera_zoom = zoom;
+            invalidate_command_buffers();
+        }
+        if (!cull_view_pinned) {
+            update_cull_view(get_camera_view());
+        }
+    }
+
+    CameraPushConstants get_camera_push_constants() {
+        return {camera_center, camera_zoom, (float) swapchain_extent.width / swapchain_extent.height};
+    }
+
+    // The area the camera shows with the default world bound, as min x, min y, max x, max y in game units.
+    glm::vec4 get_camera_view() {
+        CameraPushConstants camera = get_camera_push_constants();
+        glm::vec2 half_extent = glm::vec2(camera.aspect, 1.0f) * (GAME_UNIT_BOUND / 2 / camera_zoom);
+        glm::vec2 lower = camera_center - half_extent;
+        glm::vec2 upper = camera_center + half_extent;
+        return glm::vec4(lower.x, lower.y, upper.x, upper.y);
+    }
+
+    // Queues instances [first_instance, first_instance + instance_count) of an object buffer to be drawn with a vertex buffer in the
+    // next frame. An instance_count of -1 draws every instance from first_instance on.
+    // The buffer ids belong to the vertex layout of the pipeline.
+    void submit_draw(int vbuffer_id, int obuffer_id, int first_instance = 0, int instance_count = -1, int layer = 0, int pipeline_id = FullVertexLayout, 
+                        int texture_id = 0) {
+        VertexLayout layout = get_pipeline_layout(pipeline_id);
+        if (vbuffer_id < 0 || vbuffer_id >= get_vertex_buffer_count(layout) || obuffer_id < 0 || obuffer_id >= get_object_buffer_count(layout)) {
+            throw std::runtime_error("Draw submitted with unknown buffer id.");
+        }
+        if (get_object_buffer(layout, obuffer_id) == VK_NULL_HANDLE) {
+            throw std::runtime_error("Draw submitted with destroyed object buffer " + std::to_string(obuffer_id));
+        }
+        if (texture_id < 0 || texture_id >= texture_atlas.get_page_count()) {
+            throw std::runtime_error("Draw submitted with unknown texture id.");
+        }
+
+        int length = get_instance_count(layout, obuffer_id);
+        if (instance_count == -1) {
+            instance_count = std::max(length - first_instance, 0);
+        }
+        if (first_instance < 0 || instance_count < 0 || first_instance + instance_count > length) {
+            throw std::runtime_error("Draw submitted with instances outside of the object buffer.");
+        }
+
+        draw_list.push_back({layer, pipeline_id, vbuffer_id, obuffer_id, first_instance, instance_count, -1, texture_id});
+    }
+
+    // Pipeline ids come from get_pipeline_variant. FullVertexLayout and PackedVertexLayout are the ids of the default variants.
+    int get_pipeline_variant(const PipelineVariant& variant) {
+        return pipelines.get_variant(variant);
+    }
+
+    VkPipeline get_pipeline(int pipeline_id) {
+        return pipelines.get_pipeline(pipeline_id);
+    }
+
+    VkPipelineLayout get_vk_pipeline_layout(int pipeline_id) {
+        pipelines.get_variant_info(pipeline_id);
+        return pipelines.pipeline_layout;
+    }
+
+    VertexLayout get_pipeline_layout(int pipeline_id) {
+        return pipelines.get_variant_info(pipeline_id).layout;
+    }
+
+    // Layout independent access to the buffers, for recording.
+
+    int get_vertex_buffer_count(VertexLayout layout) {
+        return layout == PackedVertexLayout ? packed_vertex_buffers.size() : vertex_buffers.size();
+    }
+
+    int get_object_buffer_count(VertexLayout layout) {
+        return layout == PackedVertexLayout ? packed_object_position_buffers.size() : object_position_buffers.size();
+    }
+
+    VkBuffer get_vertex_buffer(VertexLayout layout, int vbuffer_id) {
+        return layout == PackedVertexLayout ? packed_vertex_buffers[vbuffer_id].buffer : vertex_buffers[vbuffer_id].buffer;
+    }
+
+    int get_vertex_count(VertexLayout layout, int vbuffer_id) {
+        return layout == PackedVertexLayout ? packed_vertex_buffers[vbuffer_id].length : vertex_buffers[vbuffer_id].length;
+    }
+
+    VkBuffer get_object_buffer(VertexLayout layout, int obuffer_id) {
+        return layout == PackedVertexLayout ? packed_object_position_buffers[obuffer_id].buffer : object_position_buffers[obuffer_id].buffer;
+    }
+
+    VkDeviceSize get_object_buffer_offset(VertexLayout layout, int obuffer_id, int frame) {
+        return layout == PackedVertexLayout ? packed_object_position_buffers[obuffer_id].frame_offset(frame) : object_position_buffers[obuffer_id].frame_offset(frame);
+    }
+
+    int get_instance_count(VertexLayout layout, int obuffer_id) {
+        return layout == PackedVertexLayout ? packed_object_position_buffers[obuffer_id].length : object_position_buffers[obuffer_id].length;
+    }
+
+    // nullptr for meshes that are not indexed.
+    const IndexBufferBacked* get_index_buffer(VertexLayout layout, int vbuffer_id) {
+        std::unordered_map<int, IndexBufferBacked>& buffers = layout == PackedVertexLayout ? packed_index_buffers : index_buffers;
+        auto index_buffer = buffers.find(vbuffer_id);
+        return index_buffer != buffers.end() ? &index_buffer->second : nullptr;
+    }
+
+    // Marks every cached command buffer as stale. They are re-recorded the next time their image and frame come up.
+    void invalidate_command_buffers() {
+        scene_version += 1;
+    }
+
+    // Gets the cached command buffer for image_index and frame. needs_recording is set if it is stale, in which case the caller
+    // must record it before submitting; it is considered up to date from then on.
+    VkCommandBuffer get_cached_command_buffer(int image_index, int frame, bool* needs_recording) {
+        if (cached_command_buffers.size() != images.size() * MAX_FRAMES_IN_FLIGHT) {
+            cached_command_buffers = get_vk_command_buffers(logical_device, command_pool, images.size() * MAX_FRAMES_IN_FLIGHT);
+            cached_command_buffer_versions = std::vector<uint64_t>(cached_command_buffers.size(), 0);
+        }
+
+        int index = image_index * MAX_FRAMES_IN_FLIGHT + frame;
+        *needs_recording = cached_command_buffer_versions[index] != scene_version;
+        cached_command_buffer_versions[index] = scene_version;
+        return cached_command_buffers[index];
+    }
+
+    // Gets the image to render the frame into. Offscreen images are used round-robin, one per frame in flight.
+    VkResult acquire_next_image(int frame, uint32_t* image_index) {
+        TRACE_ZONE("acquire_next_image");
+        if (headless) {
+            *image_index = frame;
+            return VK_SUCCESS;
+        }
+        return vkAcquireNextImageKHR(logical_device, swapchain, UINT64_MAX, image_available_semaphores[frame], VK_NULL_HANDLE, image_index);
+    }
+
+    VkResult present_image(int frame, uint32_t image_index) {
+        TRACE_ZONE("queue_present");
+        if (headless) {
+            return VK_SUCCESS;
+        }
+
+        VkPresentInfoKHR presentInfo {};
+        presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+        presentInfo.pImageIndices = &image_index;
+        presentInfo.pSwapchains = &swapchain;
+        presentInfo.swapchainCount = 1;
+        presentInfo.waitSemaphoreCount = 1;
+        presentInfo.pWaitSemaphores = &image_done_rendering_semaphores[frame];
+        return vkQueuePresentKHR(get_presentation_queue(), &presentInfo);
+    }
+
+    // Reads back the pixels of an offscreen image as tightly packed B8G8R8A8 texels. Waits for the device to go idle first.
+    std::vector<uint8_t> read_back_image(uint32_t image_index) {
+        if (!headless) {
+            throw std::runtime_error("Only offscreen images can be read back.");
+        }
+
         vkDeviceWaitIdle(logical_device);
-        vk_destroy_swapchain();
-        get_vk_swapchain_and_images(window, surface, physical_device, logical_device, queue_map["graphics_queue"], queue_map["presentation_queue"], swapchain, images, image_views, swapchain_format, swapchain_extent);
-        swapchain_framebuffers = get_vk_swapchain_framebuffers(logical_device, image_views, graphics_pipeline.render_pass, swapchain_extent);
+
+        VkDeviceSize size = 4 * static_cast<VkDeviceSize>(swapchain_extent.width) * swapchain_extent.height;
+        auto [readback_buffer, readback_buffer_memory] = get_vk_buffer(allocator, logical_device, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_SHARING_MODE_EXCLUSIVE, 
+                                                            size, get_graphics_queue_index(), VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 
+                                                            LinearStrategy);
+
+        vk_cpy_image_to_buffer(get_graphics_queue(), transient_command_pool, logical_device, images[image_index], swapchain_extent, readback_buffer);
+
+        std::vector<uint8_t> pixels (size);
+        memcpy(pixels.data(), readback_buffer_memory.mapped, (size_t) size);
+
+        vkDestroyBuffer(logical_device, readback_buffer, nullptr);
+        allocator.free(readback_buffer_memory);
+
+        return pixels;
+    }
+
+    // Recreates the swapchain with another present policy or image count. Does nothing when headless.
+    void set_present_policy(PresentPolicy policy, int additional_images = 1) {
+        present_policy = policy;
+        additional_swapchain_images = additional_images;
+        rebuild_swapchain();
+    }
+
+    // Replaces the swapchain without waiting for the device. The old swapchain is handed to the new one, so the presentation
+    // engine can reuse its resources and keep showing it until the first new image is presented. The old swapchain, its image
+    // views and framebuffers, and command buffers recorded against them are destroyed once the frames in flight are done.
+    void rebuild_swapchain() {
+        TRACE_ZONE("rebuild_swapchain");
+        // Offscreen images have a fixed size and never go out of date.
+        if (headless) {
+            return;
+        }
+
+        // Cached command buffers reference the old framebuffers, and the new swapchain may have a different image count.
+        if (!cached_command_buffers.empty()) {
+            std::vector<VkCommandBuffer> retired_command_buffers = cached_command_buffers;
+            defer_deletion([this, retired_command_buffers]() {
+                vkFreeCommandBuffers(logical_device, command_pool, retired_command_buffers.size(), retired_command_buffers.data());
+            });
+            cached_command_buffers.clear();
+        }
+        invalidate_command_buffers();
+
+        VkSwapchainKHR old_swapchain = swapchain;
+        std::vector<VkImageView> old_image_views = image_views;
+        std::vector<VkFramebuffer> old_framebuffers = swapchain_framebuffers;
+
+        get_vk_swapchain_and_images(window, surface, physical_device, logical_device, queue_map["graphics_queue"], queue_map["presentation_queue"], swapchain, images, image_views, swapchain_format, swapchain_extent, 
+                                        present_mode, present_policy, additional_swapchain_images, old_swapchain);
+        swapchain_framebuffers = get_vk_swapchain_framebuffers(logical_device, image_views, pipelines.render_pass, swapchain_extent);
+
+        defer_deletion([this, old_swapchain, old_image_views, old_framebuffers]() {
+            for (VkFramebuffer framebuffer : old_framebuffers) {
+                vkDestroyFramebuffer(logical_device, framebuffer, nullptr);
+            }
+            for (VkImageView image_view : old_image_views) {
+                vkDestroyImageView(logical_device, image_view, nullptr);
+            }
+            vkDestroySwapchainKHR(logical_device, old_swapchain, nullptr);
+        });
+
+        // The aspect ratio may have changed, and with it what the camera sees.
+        set_camera(camera_center, camera_zoom);
     }
 
     void vk_destroy_swapchain() {  
@@ -1189,30 +3262,73 @@ struct VkContext {
         for (VkImageView image_view : image_views) {
             vkDestroyImageView(logical_device, image_view, nullptr);
         }
-        vkDestroySwapchainKHR(logical_device, swapchain, nullptr);
+        if (headless) {
+            for (int i = 0; i < images.size(); ++i) {
+                vkDestroyImage(logical_device, images[i], nullptr);
+                allocator.free(offscreen_images_memory[i]);
+            }
+        } else {
+            vkDestroySwapchainKHR(logical_device, swapchain, nullptr);
+        }
     }
 
     void vk_destroy() {
         vkDeviceWaitIdle(logical_device);
+        for (DeferredDeletion& deletion : deletion_queue) {
+            deletion.destroy();
+        }
+        deletion_queue.clear();
         for (VertexBufferBacked vertex_buffer : vertex_buffers) {
-            vertex_buffer.destroy(logical_device);
+            vertex_buffer.destroy(logical_device, allocator);
         }
         for (VertexBufferBacked object_position_buffer : object_position_buffers) {
-            object_position_buffer.destroy(logical_device);
+            if (object_position_buffer.buffer != VK_NULL_HANDLE) {
+                object_position_buffer.destroy(logical_device, allocator);
+            }
+        }
+        for (auto [vbuffer_id, index_buffer] : index_buffers) {
+            index_buffer.destroy(logical_device, allocator);
+        }
+        for (VertexBufferBacked vertex_buffer : packed_vertex_buffers) {
+            vertex_buffer.destroy(logical_device, allocator);
+        }
+        for (VertexBufferBacked object_position_buffer : packed_object_position_buffers) {
+            if (object_position_buffer.buffer != VK_NULL_HANDLE) {
+                object_position_buffer.destroy(logical_device, allocator);
+            }
+        }
+        for (auto [vbuffer_id, index_buffer] : packed_index_buffers) {
+            index_buffer.destroy(logical_device, allocator);
         }
+        for (CulledDraw& culled_draw : culled_draws) {
+            if (culled_draw.visible_buffer != VK_NULL_HANDLE) {
+                culled_draw.destroy(logical_device, allocator);
+            }
+        }
+        upload_manager.vk_destroy();
+        recording_scheduler->vk_destroy();
         vkDestroyCommandPool(logical_device, command_pool, nullptr);
         vkDestroyCommandPool(logical_device, transient_command_pool, nullptr);
-        graphics_pipeline.vk_destroy(logical_device);
+        pipelines.vk_destroy();
+        culling_pipeline.vk_destroy(logical_device);
+        texture_atlas.vk_destroy();
+        pipeline_cache.vk_destroy();
         vk_destroy_swapchain();
+        frame_scheduler.vk_destroy();
+        gpu_profiler.vk_destroy();
         for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-            vkDestroyFence(logical_device, command_buffer_fences[i], nullptr);
             vkDestroySemaphore(logical_device, image_available_semaphores[i], nullptr);
             vkDestroySemaphore(logical_device, image_done_rendering_semaphores[i], nullptr);
         }
+        allocator.vk_destroy();
         vkDestroyDevice(logical_device, nullptr);
-        vkDestroySurfaceKHR(instance, surface, nullptr);
+        if (!headless) {
+            vkDestroySurfaceKHR(instance, surface, nullptr);
+        }
         vkDestroyInstance(instance, nullptr);
-        SDL_Quit();
+        if (!headless) {
+            SDL_Quit();
+        }
     }
 
     ~VkContext() {
@@ -1234,4 +3350,20 @@ struct VkContext {
     int get_presentation_queue_index() {
         return queue_map["presentation_queue"].queue_index;
     }
+
+    VkQueue get_transfer_queue() {
+        return queue_map["transfer_queue"].queue;
+    }
+
+    int get_transfer_queue_index() {
+        return queue_map["transfer_queue"].queue_index;
+    }
+
+    VkQueue get_compute_queue() {
+        return queue_map["compute_queue"].queue;
+    }
+
+    int get_compute_queue_index() {
+        return queue_map["compute_queue"].queue_index;
+    }
 };
\ No newline at end of file
@@ -0,0 +1,203 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+
+// Mesh import: turns a plain triangle list into unique vertices plus indices, ordered for the GPU's vertex caches.
+
+// Hashes and compares vertices by their bytes, so any tightly packed vertex struct can be deduplicated.
+template<class Vertex>
+struct VertexBytesHash {
+    size_t operator()(const Vertex& vertex) const {
+        // FNV-1a.
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&vertex);
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < sizeof(Vertex); ++i) {
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+        return (size_t) hash;
+    }
+};
+
+template<class Vertex>
+struct VertexBytesEqual {
+    bool operator()(const Vertex& lhs, const Vertex& rhs) const {
+        return memcmp(&lhs, &rhs, sizeof(Vertex)) == 0;
+    }
+};
+
+// Replaces every repeated vertex with an index to its first occurrence.
+template<class Vertex>
+void deduplicate_vertices(const std::vector<Vertex>& vertices, std::vector<Vertex>& unique_vertices, std::vector<uint32_t>& indices) {
+    std::unordered_map<Vertex, uint32_t, VertexBytesHash<Vertex>, VertexBytesEqual<Vertex>> vertex_indices = {};
+    unique_vertices.clear();
+    indices.clear();
+
+    for (const Vertex& vertex : vertices) {
+        auto [it, inserted] = vertex_indices.emplace(vertex, (uint32_t) unique_vertices.size());
+        if (inserted) {
+            unique_vertices.push_back(vertex);
+        }
+        indices.push_back(it->second);
+    }
+}
+
+// Reorders triangles so that vertices are reused while they are still in the post-transform cache. This is Tom Forsyth's
+// linear-speed vertex cache optimisation: vertices are scored by their position in a simulated LRU cache and by how many
+// triangles still use them, and the triangle with the highest total score is emitted next.
+std::vector<uint32_t> optimize_vertex_cache(const std::vector<uint32_t>& indices, uint32_t vertex_count) {
+    const int cache_size = 32;
+    size_t triangle_count = indices.size() / 3;
+
+    std::vector<std::vector<uint32_t>> vertex_triangles(vertex_count);
+    for (size_t triangle = 0; triangle < triangle_count; ++triangle) {
+        for (int corner = 0; corner < 3; ++corner) {
+            vertex_triangles[indices[triangle * 3 + corner]].push_back(triangle);
+        }
+    }
+
+    std::vector<int> cache_positions(vertex_count, -1);
+    std::vector<float> vertex_scores(vertex_count, 0.0f);
+    std::vector<float> triangle_scores(triangle_count, 0.0f);
+    std::vector<bool> emitted(triangle_count, false);
+
+    auto score_vertex = [&](uint32_t vertex) {
+        int remaining = vertex_triangles[vertex].size();
+        if (remaining == 0) {
+            return -1.0f;
+        }
+
+        float score = 0.0f;
+        int position = cache_positions[vertex];
+        if (position >= 0) {
+            // The last triangle's vertices get a fixed score, so that strips are not favoured over fans.
+            score = position < 3 ? 0.75f : std::pow(1.0f - (position - 3) / (float) (cache_size - 3), 1.5f);
+        }
+        // Vertices with few triangles left are finished off first, so they can leave the cache for good.
+        return score + 2.0f * std::pow((float) remaining, -0.5f);
+    };
+
+    auto score_triangle = [&](uint32_t triangle) {
+        return vertex_scores[indices[triangle * 3]] + vertex_scores[indices[triangle * 3 + 1]] + vertex_scores[indices[triangle * 3 + 2]];
+    };
+
+    for (uint32_t vertex = 0; vertex < vertex_count; ++vertex) {
+        vertex_scores[vertex] = score_vertex(vertex);
+    }
+    for (size_t triangle = 0; triangle < triangle_count; ++triangle) {
+        triangle_scores[triangle] = score_triangle(triangle);
+    }
+
+    std::vector<uint32_t> cache = {};
+    std::vector<uint32_t> optimized = {};
+    optimized.reserve(indices.size());
+
+    size_t next_unemitted = 0;
+    long best_triangle = -1;
+
+    for (size_t emitted_count = 0; emitted_count < triangle_count; ++emitted_count) {
+        // Nothing in the cache has triangles left, so continue with the next triangle in the original order.
+        if (best_triangle < 0) {
+            while (emitted[next_unemitted]) {
+                ++next_unemitted;
+            }
+            best_triangle = next_unemitted;
+        }
+
+        emitted[best_triangle] = true;
+        for (int corner = 0; corner < 3; ++corner) {
+            uint32_t vertex = indices[best_triangle * 3 + corner];
+            optimized.push_back(vertex);
+
+            std::vector<uint32_t>& triangles = vertex_triangles[vertex];
+            triangles.erase(std::find(triangles.begin(), triangles.end(), (uint32_t) best_triangle));
+
+            auto cached = std::find(cache.begin(), cache.end(), vertex);
+            if (cached != cache.end()) {
+                cache.erase(cached);
+            }
+            cache.insert(cache.begin(), vertex);
+        }
+
+        // Vertices pushed out of the cache lose their cache score.
+        std::vector<uint32_t> touched = cache;
+        while (cache.size() > cache_size) {
+            cache_positions[cache.back()] = -1;
+            cache.pop_back();
+        }
+        for (size_t position = 0; position < cache.size(); ++position) {
+            cache_positions[cache[position]] = position;
+        }
+
+        for (uint32_t vertex : touched) {
+            vertex_scores[vertex] = score_vertex(vertex);
+        }
+
+        // The next triangle is the best one that uses a vertex which was in the cache.
+        best_triangle = -1;
+        float best_score = -1.0f;
+        for (uint32_t vertex : touched) {
+            for (uint32_t triangle : vertex_triangles[vertex]) {
+                triangle_scores[triangle] = score_triangle(triangle);
+                if (triangle_scores[triangle] > best_score) {
+                    best_score = triangle_scores[triangle];
+                    best_triangle = triangle;
+                }
+            }
+        }
+    }
+
+    return optimized;
+}
+
+// Renumbers vertices in the order the indices first use them, so that vertex fetches walk through memory linearly.
+template<class Vertex>
+void optimize_vertex_fetch(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) {
+    std::vector<uint32_t> remap(vertices.size(), UINT32_MAX);
+    std::vector<Vertex> reordered = {};
+    reordered.reserve(vertices.size());
+
+    for (uint32_t& index : indices) {
+        if (remap[index] == UINT32_MAX) {
+            remap[index] = reordered.size();
+            reordered.push_back(vertices[index]);
+        }
+        index = remap[index];
+    }
+
+    vertices = reordered;
+}
+
+// Average cache miss ratio: vertex shader invocations per triangle when indices go through a FIFO post-transform cache of
+// cache_size entries. 3 means no reuse at all, 0.5 is the limit for large regular grids.
+double get_acmr(const std::vector<uint32_t>& indices, int cache_size = 16) {
+    if (indices.size() < 3) {
+        return 0;
+    }
+
+    std::vector<uint32_t> cache = {};
+    size_t misses = 0;
+    for (uint32_t index : indices) {
+        if (std::find(cache.begin(), cache.end(), index) != cache.end()) {
+            continue;
+        }
+        misses += 1;
+        cache.push_back(index);
+        if (cache.size() > (size_t) cache_size) {
+            cache.erase(cache.begin());
+        }
+    }
+    return (double) misses / (indices.size() / 3);
+}
+
+// Full import of an unindexed triangle list.
+template<class Vertex>
+void build_indexed_mesh(const std::vector<Vertex>& triangle_list, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) {
+    deduplicate_vertices(triangle_list, vertices, indices);
+    indices = optimize_vertex_cache(indices, vertices.size());
+    optimize_vertex_fetch(vertices, indices);
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <bench_stats.h>
+#include <trace.h>
+
+// Frame pacing. When the CPU runs ahead of the GPU or the display, every frame it queues adds a frame of latency between
+// sampling input and showing the result. The pacer delays the start of each frame, before input is sampled, by as much as
+// the CPU would otherwise have spent blocked on fences and image acquisition later in the frame.
+//
+// The delay is a simple two-step controller: it grows a little while the CPU is still ahead at submission, and shrinks
+// faster once it is not, since a starved GPU costs throughput while a queued frame only costs latency.
+//
+// Latency is measured from sampling input until the frame is seen to have retired, i.e. finished rendering. That stands in
+// for input to present: when the image reaches the display is not observable without VK_KHR_present_wait, which is not used,
+// and headless frames are never presented at all.
+
+// A submitted frame whose latency is still to be measured.
+struct LatencySample {
+    uint64_t frame;
+    std::chrono::steady_clock::time_point input_time;
+};
+
+struct FramePacer {
+    bool enabled;
+    double max_delay_ms;
+    double grow_ms;
+    double shrink_ms;
+    // Blocking shorter than this does not count as being ahead.
+    double margin_ms;
+
+    double delay_ms;
+    double blocked_ms;
+
+    // When input was sampled for the frame being prepared, if it was.
+    std::chrono::steady_clock::time_point input_time;
+    bool input_sampled;
+    // Submitted frames waiting to retire, oldest first.
+    std::deque<LatencySample> pending_samples;
+    // Most recent input to render complete latencies, oldest first.
+    std::deque<double> latencies_ms;
+    size_t max_latency_samples;
+
+    FramePacer(bool enabled = false) : enabled(enabled), max_delay_ms(33.0), grow_ms(0.25), shrink_ms(1.0), margin_ms(0.5),
+        delay_ms(0), blocked_ms(0), input_sampled(false), max_latency_samples(1000) {
+
+    }
+
+    // Sleeps for the current delay and marks the input of the frame being prepared as sampled. Call right before polling input.
+    void pace() {
+        TRACE_ZONE("pace");
+        if (enabled && delay_ms > 0) {
+            // Sleeping may overshoot by a scheduler tick, so the last millisecond is spun.
+            auto wake_time = std::chrono::steady_clock::now() + std::chrono::duration<double, std::milli>(delay_ms);
+            if (delay_ms > 1.0) {
+                std::this_thread::sleep_until(wake_time - std::chrono::milliseconds(1));
+            }
+            while (std::chrono::steady_clock::now() < wake_time) {
+                std::this_thread::yield();
+            }
+        }
+
+        input_time = std::chrono::steady_clock::now();
+        input_sampled = true;
+    }
+
+    // Adds time the CPU spent blocked on the GPU or the display during the current frame.
+    void add_blocked_time(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+        blocked_ms += elapsed_ms(start, end);
+    }
+
+    // Adjusts the delay when frame is submitted, and starts measuring its latency if its input was sampled. previous_frame_busy
+    // is whether the GPU was still working on the frame before.
+    void on_submit(bool previous_frame_busy, uint64_t frame) {
+        bool ahead = previous_frame_busy || blocked_ms > margin_ms;
+        delay_ms = std::clamp(delay_ms + (ahead ? grow_ms : -shrink_ms), 0.0, max_delay_ms);
+        blocked_ms = 0;
+
+        if (input_sampled) {
+            pending_samples.push_back({frame, input_time});
+            input_sampled = false;
+        }
+    }
+
+    // Records the latency of every pending frame up to completed_frame, the last frame known to have retired. This is an upper
+    // bound, since a frame may have retired a little before it was seen to.
+    void on_frames_retired(uint64_t completed_frame) {
+        auto now = std::chrono::steady_clock::now();
+        while (!pending_samples.empty() && pending_samples.front().frame <= completed_frame) {
+            latencies_ms.push_back(elapsed_ms(pending_samples.front().input_time, now));
+            pending_samples.pop_front();
+            if (latencies_ms.size() > max_latency_samples) {
+                latencies_ms.pop_front();
+            }
+        }
+    }
+
+    bool has_latency_samples() {
+        return !latencies_ms.empty();
+    }
+
+    BenchSummary get_latency_summary() {
+        return summarize(std::vector<double>(latencies_ms.begin(), latencies_ms.end()));
+    }
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "volk/volk.h"
+#include <vulkan/vk_enum_string_helper.h>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include <trace.h>
+
+// Persists a VkPipelineCache between runs so that pipelines compiled once are not compiled again on the next launch.
+
+// The header every implementation puts in front of its cache data (VK_PIPELINE_CACHE_HEADER_VERSION_ONE).
+struct PipelineCacheHeader {
+    uint32_t header_size;
+    uint32_t header_version;
+    uint32_t vendor_id;
+    uint32_t device_id;
+    uint8_t pipeline_cache_uuid[VK_UUID_SIZE];
+};
+
+struct PipelineCacheStats {
+    int hits;
+    int misses;
+    double hit_ms;
+    double miss_ms;
+
+    PipelineCacheStats() : hits(0), misses(0), hit_ms(0), miss_ms(0) {
+
+    }
+};
+
+// Checks that data was written by this driver for this device. Anything else is discarded rather than handed to the driver.
+bool is_pipeline_cache_valid(const std::vector<char>& data, const VkPhysicalDeviceProperties& properties) {
+    if (data.size() < sizeof(PipelineCacheHeader)) {
+        return false;
+    }
+
+    PipelineCacheHeader header;
+    memcpy(&header, data.data(), sizeof(PipelineCacheHeader));
+
+    return header.header_size >= sizeof(PipelineCacheHeader) && header.header_size <= data.size()
+        && header.header_version == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+        && header.vendor_id == properties.vendorID
+        && header.device_id == properties.deviceID
+        && memcmp(header.pipeline_cache_uuid, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+struct PipelineCache {
+    VkDevice device;
+    VkPipelineCache cache;
+    std::string path;
+    PipelineCacheStats stats;
+
+    PipelineCache() : device(VK_NULL_HANDLE), cache(VK_NULL_HANDLE) {
+
+    }
+
+    // Loads the cache from path if it exists and matches the device, otherwise starts empty.
+    PipelineCache(VkPhysicalDevice physical_device, VkDevice _device, std::string _path) : device(_device), path(_path) {
+        TRACE_ZONE("load_pipeline_cache");
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physical_device, &properties);
+
+        std::vector<char> data = {};
+        std::ifstream file(path, std::ios::ate | std::ios::binary);
+        if (file.is_open()) {
+            data.resize((size_t) file.tellg());
+            file.seekg(0);
+            file.read(data.data(), data.size());
+            file.close();
+
+            if (!is_pipeline_cache_valid(data, properties)) {
+                std::cout << "Discarding stale or corrupt pipeline cache " << path << "." << std::endl;
+                data.clear();
+            }
+        }
+
+        VkPipelineCacheCreateInfo create_info{};
+        create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+        create_info.initialDataSize = data.size();
+        create_info.pInitialData = data.empty() ? nullptr : data.data();
+
+        if (VkResult result = vkCreatePipelineCache(device, &create_info, nullptr, &cache); result != VK_SUCCESS) {
+            throw std::runtime_error("Could not create pipeline cache: " + std::string(string_VkResult(result)));
+        }
+    }
+
+    // Creates a pipeline through the cache and times it. Vulkan 1.0 has no per-pipeline hit flag, so creation counts as a hit
+    // when it did not add anything to the cache.
+    VkPipeline create_graphics_pipeline(const VkGraphicsPipelineCreateInfo& pipeline_info) {
+        return create_timed("graphics", [&](VkPipeline* pipeline) {
+            return vkCreateGraphicsPipelines(device, cache, 1, &pipeline_info, nullptr, pipeline);
+        });
+    }
+
+    VkPipeline create_compute_pipeline(const VkComputePipelineCreateInfo& pipeline_info) {
+        return create_timed("compute", [&](VkPipeline* pipeline) {
+            return vkCreateComputePipelines(device, cache, 1, &pipeline_info, nullptr, pipeline);
+        });
+    }
+
+    template<class CreateFunction>
+    VkPipeline create_timed(std::string kind, CreateFunction create) {
+        size_t size_before = get_data_size();
+
+        auto start = std::chrono::steady_clock::now();
+        VkPipeline pipeline;
+        if (VkResult result = create(&pipeline); result != VK_SUCCESS) {
+            throw std::runtime_error("Could not create " + kind + " pipeline: " + std::string(string_VkResult(result)));
+        }
+        double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        bool hit = get_data_size() == size_before;
+        if (hit) {
+            stats.hits += 1;
+            stats.hit_ms += elapsed_ms;
+        } else {
+            stats.misses += 1;
+            stats.miss_ms += elapsed_ms;
+        }
+        std::cout << "Created " << kind << " pipeline in " << elapsed_ms << " ms (pipeline cache " << (hit ? "hit" : "miss") << ")." << std::endl;
+
+        return pipeline;
+    }
+
+    size_t get_data_size() {
+        size_t size = 0;
+        vkGetPipelineCacheData(device, cache, &size, nullptr);
+        return size;
+    }
+
+    // Writes to a temporary file first, so that a crash while saving cannot leave a truncated cache behind.
+    void save() {
+        size_t size = get_data_size();
+        std::vector<char> data(size);
+        if (VkResult result = vkGetPipelineCacheData(device, cache, &size, data.data()); result != VK_SUCCESS) {
+            std::cout << "Could not read pipeline cache data: " << string_VkResult(result) << std::endl;
+            return;
+        }
+
+        std::string temporary_path = path + ".tmp";
+        std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            std::cout << "Could not write pipeline cache " << temporary_path << "." << std::endl;
+            return;
+        }
+        file.write(data.data(), size);
+        file.close();
+
+        std::rename(temporary_path.c_str(), path.c_str());
+    }
+
+    void vk_destroy() {
+        save();
+        std::cout << "Pipeline cache: " << stats.hits << " hits (" << stats.hit_ms << " ms), "
+                  << stats.misses << " misses (" << stats.miss_ms << " ms)." << std::endl;
+        vkDestroyPipelineCache(device, cache, nullptr);
+    }
+};
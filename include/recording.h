@@ -0,0 +1,214 @@
+#pragma once
+
+#include "volk/volk.h"
+#include <vulkan/vk_enum_string_helper.h>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <stdexcept>
+#include <trace.h>
+
+// Spreads command recording over worker threads. Every thread records into secondary command buffers from its own command pool,
+// one pool per frame in flight, so that no pool is ever touched by two threads or reset while the GPU still reads from it.
+struct RecordingScheduler {
+    VkDevice device;
+    int thread_count;
+    // Below this many draws per thread, handing work to the workers costs more than recording it inline.
+    int min_draws_per_thread;
+
+    // Indexed [thread][frame].
+    std::vector<std::vector<VkCommandPool>> command_pools;
+    std::vector<std::vector<VkCommandBuffer>> secondary_buffers;
+
+    RecordingScheduler(const RecordingScheduler&) = delete;
+
+    RecordingScheduler(VkDevice _device, int queue_index, int frame_count, int _thread_count = default_thread_count(), int _min_draws_per_thread = 64) :
+        device(_device), thread_count(std::max(_thread_count, 1)), min_draws_per_thread(_min_draws_per_thread),
+        active_count(0), generation(0), pending(0), stopping(false) {
+        for (int thread = 0; thread < thread_count; ++thread) {
+            command_pools.push_back({});
+            secondary_buffers.push_back({});
+            for (int frame = 0; frame < frame_count; ++frame) {
+                VkCommandPoolCreateInfo pool_info{};
+                pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+                pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+                pool_info.queueFamilyIndex = queue_index;
+
+                VkCommandPool pool;
+                if (VkResult result = vkCreateCommandPool(device, &pool_info, nullptr, &pool); result != VK_SUCCESS) {
+                    throw std::runtime_error("Could not create recording command pool: " + std::string(string_VkResult(result)));
+                }
+
+                VkCommandBufferAllocateInfo allocate_info{};
+                allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+                allocate_info.commandPool = pool;
+                allocate_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+                allocate_info.commandBufferCount = 1;
+
+                VkCommandBuffer command_buffer;
+                if (VkResult result = vkAllocateCommandBuffers(device, &allocate_info, &command_buffer); result != VK_SUCCESS) {
+                    throw std::runtime_error("Could not allocate secondary command buffer: " + std::string(string_VkResult(result)));
+                }
+
+                command_pools[thread].push_back(pool);
+                secondary_buffers[thread].push_back(command_buffer);
+            }
+        }
+
+        // The calling thread records chunk 0 itself, so only thread_count - 1 workers are started.
+        for (int thread = 1; thread < thread_count; ++thread) {
+            workers.push_back(std::thread(&RecordingScheduler::worker_loop, this, thread));
+        }
+    }
+
+    static int default_thread_count() {
+        return std::clamp((int) std::thread::hardware_concurrency(), 1, 8);
+    }
+
+    // How many chunks to split draw_count draws into. 1 means recording inline into the primary command buffer is cheaper.
+    int get_chunk_count(int draw_count) {
+        return std::clamp(draw_count / std::max(min_draws_per_thread, 1), 1, thread_count);
+    }
+
+    // Must only be called once the frame's fence has signaled.
+    void reset(int frame) {
+        for (int thread = 0; thread < thread_count; ++thread) {
+            vkResetCommandPool(device, command_pools[thread][frame], 0);
+        }
+    }
+
+    // Begins the secondary command buffer of chunk for use inside subpass 0 of render_pass.
+    VkCommandBuffer begin_secondary(int chunk, int frame, VkRenderPass render_pass, VkFramebuffer framebuffer) {
+        VkCommandBufferInheritanceInfo inheritance_info{};
+        inheritance_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+        inheritance_info.renderPass = render_pass;
+        inheritance_info.subpass = 0;
+        inheritance_info.framebuffer = framebuffer;
+
+        VkCommandBufferBeginInfo begin_info{};
+        begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        begin_info.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        begin_info.pInheritanceInfo = &inheritance_info;
+
+        VkCommandBuffer command_buffer = secondary_buffers[chunk][frame];
+        if (VkResult result = vkBeginCommandBuffer(command_buffer, &begin_info); result != VK_SUCCESS) {
+            throw std::runtime_error("Could not begin secondary command buffer: " + std::string(string_VkResult(result)));
+        }
+        return command_buffer;
+    }
+
+    // The secondary command buffers of the first chunk_count chunks, in chunk order.
+    std::vector<VkCommandBuffer> get_secondary_buffers(int chunk_count, int frame) {
+        std::vector<VkCommandBuffer> command_buffers = {};
+        for (int chunk = 0; chunk < chunk_count; ++chunk) {
+            command_buffers.push_back(secondary_buffers[chunk][frame]);
+        }
+        return command_buffers;
+    }
+
+    // Runs job(chunk) for every chunk in [0, chunk_count), chunk i on thread i, and returns once all of them have finished.
+    // The first exception thrown by a job is rethrown here.
+    void run(int chunk_count, std::function<void(int)> job) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            current_job = job;
+            active_count = std::min(chunk_count, thread_count);
+            pending = active_count - 1;
+            error = nullptr;
+            generation += 1;
+        }
+        work_ready.notify_all();
+
+        std::exception_ptr main_error = nullptr;
+        try {
+            job(0);
+        } catch (...) {
+            main_error = std::current_exception();
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        work_done.wait(lock, [this]() { return pending == 0; });
+        current_job = nullptr;
+
+        if (main_error != nullptr) {
+            std::rethrow_exception(main_error);
+        }
+        if (error != nullptr) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    void vk_destroy() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+
+        for (std::vector<VkCommandPool>& pools : command_pools) {
+            for (VkCommandPool pool : pools) {
+                vkDestroyCommandPool(device, pool, nullptr);
+            }
+        }
+        command_pools.clear();
+        secondary_buffers.clear();
+    }
+
+    private:
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    std::function<void(int)> current_job;
+    int active_count;
+    uint64_t generation;
+    int pending;
+    bool stopping;
+    std::exception_ptr error;
+
+    void worker_loop(int thread) {
+        TRACE_THREAD_NAME("recording worker " + std::to_string(thread));
+        uint64_t seen_generation = 0;
+        while (true) {
+            std::function<void(int)> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_ready.wait(lock, [this, seen_generation]() { return stopping || generation != seen_generation; });
+                if (stopping) {
+                    return;
+                }
+                seen_generation = generation;
+                if (thread >= active_count) {
+                    continue;
+                }
+                job = current_job;
+            }
+
+            std::exception_ptr job_error = nullptr;
+            try {
+                job(thread);
+            } catch (...) {
+                job_error = std::current_exception();
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (job_error != nullptr && error == nullptr) {
+                    error = job_error;
+                }
+                pending -= 1;
+            }
+            work_done.notify_all();
+        }
+    }
+};
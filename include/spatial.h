@@ -0,0 +1,195 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+// Spatial index for objects in game units. The world is split into square cells, and every cell keeps a small contiguous
+// array of the objects whose position is inside it, so queries only look at the cells they overlap.
+
+typedef uint32_t SpatialHandle;
+
+struct SpatialGrid {
+    // An object as stored in its cell. The position is kept next to the handle so that queries never leave the cell's array.
+    struct Entry {
+        glm::vec2 pos;
+        SpatialHandle handle;
+    };
+
+    // Where an object lives. cell is -1 for free handles.
+    struct Location {
+        int cell;
+        uint32_t slot;
+    };
+
+    glm::vec2 origin;
+    float cell_size;
+    int columns;
+    int rows;
+
+    std::vector<std::vector<Entry>> cells;
+    std::vector<Location> locations;
+    std::vector<SpatialHandle> free_handles;
+    int object_count;
+
+    // Covers [origin, origin + world_size) on both axes. Objects outside of it are kept in the nearest border cell.
+    SpatialGrid(float world_size, float _cell_size, glm::vec2 _origin = glm::vec2(0, 0)) : origin(_origin), cell_size(_cell_size), object_count(0) {
+        if (world_size <= 0 || cell_size <= 0) {
+            throw std::runtime_error("Spatial grid needs a positive world and cell size.");
+        }
+
+        columns = std::max((int) std::ceil(world_size / cell_size), 1);
+        rows = columns;
+        cells.resize(columns * rows);
+    }
+
+    SpatialHandle insert(glm::vec2 pos) {
+        SpatialHandle handle;
+        if (!free_handles.empty()) {
+            handle = free_handles.back();
+            free_handles.pop_back();
+        } else {
+            handle = locations.size();
+            locations.push_back({-1, 0});
+        }
+
+        add_to_cell(handle, pos, get_cell(pos));
+        object_count += 1;
+        return handle;
+    }
+
+    // Objects that stay inside their cell are updated in place, which is the common case for small per-frame movement.
+    void move(SpatialHandle handle, glm::vec2 pos) {
+        Location& location = get_location(handle);
+        int cell = get_cell(pos);
+        if (cell == location.cell) {
+            cells[cell][location.slot].pos = pos;
+            return;
+        }
+
+        remove_from_cell(handle);
+        add_to_cell(handle, pos, cell);
+    }
+
+    void remove(SpatialHandle handle) {
+        get_location(handle);
+        remove_from_cell(handle);
+        locations[handle].cell = -1;
+        free_handles.push_back(handle);
+        object_count -= 1;
+    }
+
+    glm::vec2 get_position(SpatialHandle handle) {
+        Location& location = get_location(handle);
+        return cells[location.cell][location.slot].pos;
+    }
+
+    int size() {
+        return object_count;
+    }
+
+    // Calls visit(entry) for every object with lower <= pos <= upper.
+    template<class Visitor>
+    void for_each_in_rect(glm::vec2 lower, glm::vec2 upper, Visitor visit) {
+        int first_column, first_row, last_column, last_row;
+        get_cell_range(lower, upper, first_column, first_row, last_column, last_row);
+
+        for (int row = first_row; row <= last_row; ++row) {
+            for (int column = first_column; column <= last_column; ++column) {
+                const std::vector<Entry>& entries = cells[row * columns + column];
+                // Cells fully inside the rectangle need no per-object test.
+                bool inside = column > first_column && column < last_column && row > first_row && row < last_row;
+                for (const Entry& entry : entries) {
+                    if (inside || (entry.pos.x >= lower.x && entry.pos.x <= upper.x && entry.pos.y >= lower.y && entry.pos.y <= upper.y)) {
+                        visit(entry);
+                    }
+                }
+            }
+        }
+    }
+
+    // Calls visit(entry) for every object within radius of center.
+    template<class Visitor>
+    void for_each_in_radius(glm::vec2 center, float radius, Visitor visit) {
+        float radius_squared = radius * radius;
+        for_each_in_rect(center - glm::vec2(radius), center + glm::vec2(radius), [&](const Entry& entry) {
+            glm::vec2 offset = entry.pos - center;
+            if (glm::dot(offset, offset) <= radius_squared) {
+                visit(entry);
+            }
+        });
+    }
+
+    void query_rect(glm::vec2 lower, glm::vec2 upper, std::vector<SpatialHandle>& handles) {
+        handles.clear();
+        for_each_in_rect(lower, upper, [&](const Entry& entry) {
+            handles.push_back(entry.handle);
+        });
+    }
+
+    void query_radius(glm::vec2 center, float radius, std::vector<SpatialHandle>& handles) {
+        handles.clear();
+        for_each_in_radius(center, radius, [&](const Entry& entry) {
+            handles.push_back(entry.handle);
+        });
+    }
+
+    // Writes the positions of the objects inside the rectangle to instances as a compacted instance list, e.g. straight into
+    // the frame region of a dynamic object buffer. Stops at capacity and returns the number of instances written.
+    template<class Instance>
+    int gather_instances(glm::vec2 lower, glm::vec2 upper, Instance* instances, int capacity) {
+        int count = 0;
+        for_each_in_rect(lower, upper, [&](const Entry& entry) {
+            if (count < capacity) {
+                instances[count++] = Instance(entry.pos.x, entry.pos.y);
+            }
+        });
+        return count;
+    }
+
+    private:
+
+    Location& get_location(SpatialHandle handle) {
+        if (handle >= locations.size() || locations[handle].cell == -1) {
+            throw std::runtime_error("Unknown spatial handle " + std::to_string(handle));
+        }
+        return locations[handle];
+    }
+
+    int get_column(float x) {
+        return std::clamp((int) std::floor((x - origin.x) / cell_size), 0, columns - 1);
+    }
+
+    int get_row(float y) {
+        return std::clamp((int) std::floor((y - origin.y) / cell_size), 0, rows - 1);
+    }
+
+    int get_cell(glm::vec2 pos) {
+        return get_row(pos.y) * columns + get_column(pos.x);
+    }
+
+    void get_cell_range(glm::vec2 lower, glm::vec2 upper, int& first_column, int& first_row, int& last_column, int& last_row) {
+        first_column = get_column(lower.x);
+        first_row = get_row(lower.y);
+        last_column = get_column(upper.x);
+        last_row = get_row(upper.y);
+    }
+
+    void add_to_cell(SpatialHandle handle, glm::vec2 pos, int cell) {
+        locations[handle] = {cell, (uint32_t) cells[cell].size()};
+        cells[cell].push_back({pos, handle});
+    }
+
+    // Swaps the last entry of the cell into the freed slot.
+    void remove_from_cell(SpatialHandle handle) {
+        Location location = locations[handle];
+        std::vector<Entry>& entries = cells[location.cell];
+        entries[location.slot] = entries.back();
+        locations[entries[location.slot].handle].slot = location.slot;
+        entries.pop_back();
+    }
+};
@@ -0,0 +1,341 @@
+#pragma once
+
+#include <init.h>
+#include <future>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Tilemaps. The world is split into square chunks of tiles that are streamed in around the camera, each drawn from its own
+// static instance buffer with one instanced draw per kind of tile.
+//
+// Map files are a TileMapHeader followed by the tiles of every chunk, chunk after chunk in row-major chunk order and row-major
+// within a chunk, as uint16_t tile kinds. Kind 0 is empty. Keeping each chunk contiguous lets a chunk be read straight out of
+// the memory-mapped file without touching the pages of any other chunk.
+
+const char TILEMAP_MAGIC[4] = {'T', 'M', 'A', 'P'};
+const uint32_t TILEMAP_VERSION = 1;
+
+struct TileMapHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t width_in_chunks;
+    uint32_t height_in_chunks;
+    // Tiles along each side of a chunk.
+    uint32_t chunk_size;
+    // Game units along each side of a tile.
+    float tile_size;
+};
+
+// Writes tiles, given row-major over the whole map, as a map file. Both sides must be multiples of chunk_size.
+void write_tilemap_file(std::string path, const std::vector<uint16_t>& tiles, uint32_t width, uint32_t height, uint32_t chunk_size, float tile_size) {
+    if (chunk_size == 0 || width % chunk_size != 0 || height % chunk_size != 0 || tiles.size() != width * height) {
+        throw std::runtime_error("Tilemap of " + std::to_string(width) + "x" + std::to_string(height) + " tiles does not divide into chunks of "
+                                 + std::to_string(chunk_size));
+    }
+
+    TileMapHeader header{};
+    memcpy(header.magic, TILEMAP_MAGIC, sizeof(TILEMAP_MAGIC));
+    header.version = TILEMAP_VERSION;
+    header.width_in_chunks = width / chunk_size;
+    header.height_in_chunks = height / chunk_size;
+    header.chunk_size = chunk_size;
+    header.tile_size = tile_size;
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not write tilemap " + path);
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    std::vector<uint16_t> chunk_tiles(chunk_size * chunk_size);
+    for (uint32_t chunk_y = 0; chunk_y < header.height_in_chunks; ++chunk_y) {
+        for (uint32_t chunk_x = 0; chunk_x < header.width_in_chunks; ++chunk_x) {
+            for (uint32_t y = 0; y < chunk_size; ++y) {
+                for (uint32_t x = 0; x < chunk_size; ++x) {
+                    chunk_tiles[y * chunk_size + x] = tiles[(chunk_y * chunk_size + y) * width + chunk_x * chunk_size + x];
+                }
+            }
+            file.write(reinterpret_cast<const char*>(chunk_tiles.data()), sizeof(uint16_t) * chunk_tiles.size());
+        }
+    }
+}
+
+// A map file opened for reading.
+struct TileMap {
+    std::unique_ptr<MappedFile> file;
+    TileMapHeader header;
+
+    TileMap(std::string path) : file(std::make_unique<MappedFile>(path)) {
+        if (file->size < sizeof(TileMapHeader)) {
+            throw std::runtime_error("Tilemap " + path + " is too small for its header");
+        }
+        memcpy(&header, file->data, sizeof(TileMapHeader));
+
+        if (memcmp(header.magic, TILEMAP_MAGIC, sizeof(TILEMAP_MAGIC)) != 0 || header.version != TILEMAP_VERSION) {
+            throw std::runtime_error(path + " is not a version " + std::to_string(TILEMAP_VERSION) + " tilemap");
+        }
+        if (header.chunk_size == 0 || header.tile_size <= 0) {
+            throw std::runtime_error("Tilemap " + path + " has an invalid chunk or tile size");
+        }
+        if (file->size < sizeof(TileMapHeader) + get_chunk_bytes() * header.width_in_chunks * header.height_in_chunks) {
+            throw std::runtime_error("Tilemap " + path + " is truncated");
+        }
+    }
+
+    size_t get_chunk_bytes() {
+        return sizeof(uint16_t) * header.chunk_size * header.chunk_size;
+    }
+
+    float get_chunk_extent() {
+        return header.chunk_size * header.tile_size;
+    }
+
+    // Tiles of a chunk, row-major. Points into the mapping, so the first read of a chunk may fault its pages in from disk.
+    const uint16_t* get_chunk_tiles(int chunk_x, int chunk_y) {
+        size_t chunk_index = chunk_y * header.width_in_chunks + chunk_x;
+        return reinterpret_cast<const uint16_t*>(file->data + sizeof(TileMapHeader) + chunk_index * get_chunk_bytes());
+    }
+};
+
+// Instances of one kind of tile within a chunk's instance buffer.
+struct TileRange {
+    uint16_t kind;
+    int first_instance;
+    int instance_count;
+};
+
+// A chunk's tiles turned into instances, grouped by kind.
+struct ChunkInstances {
+    std::vector<ObjectData> instances;
+    std::vector<TileRange> ranges;
+};
+
+ChunkInstances build_chunk_instances(TileMap& map, int chunk_x, int chunk_y) {
+    TRACE_ZONE("build_chunk_instances");
+    uint32_t chunk_size = map.header.chunk_size;
+    const uint16_t* tiles = map.get_chunk_tiles(chunk_x, chunk_y);
+    glm::vec2 chunk_origin = glm::vec2(chunk_x, chunk_y) * map.get_chunk_extent();
+
+    // Counting sort by kind, so that each kind is one contiguous range of instances.
+    std::map<uint16_t, int> kind_counts = {};
+    for (uint32_t i = 0; i < chunk_size * chunk_size; ++i) {
+        if (tiles[i] != 0) {
+            kind_counts[tiles[i]] += 1;
+        }
+    }
+
+    ChunkInstances chunk;
+    std::map<uint16_t, int> next_instance = {};
+    int first_instance = 0;
+    for (auto [kind, count] : kind_counts) {
+        chunk.ranges.push_back({kind, first_instance, count});
+        next_instance[kind] = first_instance;
+        first_instance += count;
+    }
+
+    chunk.instances.resize(first_instance);
+    for (uint32_t y = 0; y < chunk_size; ++y) {
+        for (uint32_t x = 0; x < chunk_size; ++x) {
+            uint16_t kind = tiles[y * chunk_size + x];
+            if (kind != 0) {
+                chunk.instances[next_instance[kind]++] = ObjectData(chunk_origin + glm::vec2(x, y) * map.header.tile_size);
+            }
+        }
+    }
+    return chunk;
+}
+
+struct TileChunk {
+    int obuffer_id;
+    std::vector<TileRange> ranges;
+    size_t bytes;
+};
+
+// Keeps the chunks around the camera resident. Chunks are decoded on worker threads and uploaded from the thread calling update.
+// When the resident chunks exceed the memory budget, the ones farthest from the camera are evicted first.
+//
+// There is one worker per load that may be pending, started with the streamer, so streaming never spawns threads (each of which
+// would also get a trace buffer of its own when tracing).
+struct TileMapStreamer {
+    TileMap map;
+    // Vertex buffer to draw each kind of tile with, indexed by kind. Kinds without a mesh are not drawn.
+    std::vector<int> tile_meshes;
+    // Chunks within this many chunks of the camera's chunk are loaded.
+    int load_radius;
+    size_t memory_budget;
+    int max_pending_loads;
+
+    std::map<std::pair<int, int>, TileChunk> resident_chunks;
+    std::map<std::pair<int, int>, std::future<ChunkInstances>> pending_loads;
+    size_t resident_bytes;
+
+    // Loads in flight read map through this pointer.
+    TileMapStreamer(const TileMapStreamer&) = delete;
+
+    TileMapStreamer(std::string path, std::vector<int> _tile_meshes, int _load_radius = 2, size_t _memory_budget = 16 * 1024 * 1024, int _max_pending_loads = 4) :
+        map(path), tile_meshes(_tile_meshes), load_radius(_load_radius), memory_budget(_memory_budget), max_pending_loads(std::max(_max_pending_loads, 1)), 
+        resident_bytes(0), stopping(false) {
+        for (int thread = 0; thread < max_pending_loads; ++thread) {
+            workers.push_back(std::thread(&TileMapStreamer::worker_loop, this, thread));
+        }
+    }
+
+    std::pair<int, int> get_chunk(glm::vec2 pos) {
+        float extent = map.get_chunk_extent();
+        return {(int) std::floor(pos.x / extent), (int) std::floor(pos.y / extent)};
+    }
+
+    // Chebyshev distance in chunks.
+    int get_chunk_distance(std::pair<int, int> chunk, std::pair<int, int> center) {
+        return std::max(std::abs(chunk.first - center.first), std::abs(chunk.second - center.second));
+    }
+
+    void update(std::shared_ptr<VkContext> context, glm::vec2 camera) {
+        // Only the calling thread sets stopping, so it can be read without the lock here.
+        if (stopping) {
+            throw std::runtime_error("Tilemap streamer updated after it was shut down.");
+        }
+        std::pair<int, int> center = get_chunk(camera);
+
+        // Upload the chunks that finished decoding.
+        for (auto it = pending_loads.begin(); it != pending_loads.end();) {
+            if (it->second.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                ++it;
+                continue;
+            }
+
+            ChunkInstances chunk = it->second.get();
+            size_t bytes = sizeof(ObjectData) * chunk.instances.size();
+            int obuffer_id = chunk.instances.empty() ? -1 : context->create_object_position_buffer(chunk.instances);
+            resident_chunks[it->first] = {obuffer_id, chunk.ranges, bytes};
+            resident_bytes += bytes;
+            it = pending_loads.erase(it);
+        }
+
+        evict_over_budget(context, center);
+
+        // Start loading the missing chunks nearest to the camera first.
+        std::vector<std::pair<int, int>> missing = {};
+        for (int chunk_y = center.second - load_radius; chunk_y <= center.second + load_radius; ++chunk_y) {
+            for (int chunk_x = center.first - load_radius; chunk_x <= center.first + load_radius; ++chunk_x) {
+                std::pair<int, int> chunk = {chunk_x, chunk_y};
+                if (chunk_x >= 0 && chunk_y >= 0 && chunk_x < map.header.width_in_chunks && chunk_y < map.header.height_in_chunks
+                        && resident_chunks.count(chunk) == 0 && pending_loads.count(chunk) == 0) {
+                    missing.push_back(chunk);
+                }
+            }
+        }
+        std::sort(missing.begin(), missing.end(), [&](std::pair<int, int> lhs, std::pair<int, int> rhs) {
+            return get_chunk_distance(lhs, center) < get_chunk_distance(rhs, center);
+        });
+
+        for (std::pair<int, int> chunk : missing) {
+            if (pending_loads.size() >= max_pending_loads || resident_bytes >= memory_budget) {
+                break;
+            }
+            std::packaged_task<ChunkInstances()> load([this, chunk]() {
+                return build_chunk_instances(map, chunk.first, chunk.second);
+            });
+            pending_loads[chunk] = load.get_future();
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queued_loads.push_back(std::move(load));
+            }
+            load_ready.notify_one();
+        }
+    }
+
+    // Chunks inside the load radius are kept even over budget, so the area around the camera never flickers.
+    void evict_over_budget(std::shared_ptr<VkContext> context, std::pair<int, int> center) {
+        while (resident_bytes > memory_budget) {
+            auto farthest = resident_chunks.end();
+            for (auto it = resident_chunks.begin(); it != resident_chunks.end(); ++it) {
+                if (farthest == resident_chunks.end() || get_chunk_distance(it->first, center) > get_chunk_distance(farthest->first, center)) {
+                    farthest = it;
+                }
+            }
+            if (farthest == resident_chunks.end() || get_chunk_distance(farthest->first, center) <= load_radius) {
+                return;
+            }
+            evict(context, farthest);
+        }
+    }
+
+    void evict(std::shared_ptr<VkContext> context, std::map<std::pair<int, int>, TileChunk>::iterator chunk) {
+        if (chunk->second.obuffer_id != -1) {
+            context->destroy_object_position_buffer(chunk->second.obuffer_id);
+        }
+        resident_bytes -= chunk->second.bytes;
+        resident_chunks.erase(chunk);
+    }
+
+    // Submits the resident chunks that overlap the view, given as min x, min y, max x, max y in game units.
+    void submit_draws(std::shared_ptr<VkContext> context, glm::vec4 view, int layer = 0, int pipeline_id = FullVertexLayout) {
+        float extent = map.get_chunk_extent();
+        for (auto& [position, chunk] : resident_chunks) {
+            glm::vec2 lower = glm::vec2(position.first, position.second) * extent;
+            glm::vec2 upper = lower + glm::vec2(extent, extent);
+            if (chunk.obuffer_id == -1 || upper.x < view.x || upper.y < view.y || lower.x > view.z || lower.y > view.w) {
+                continue;
+            }
+
+            for (const TileRange& range : chunk.ranges) {
+                if (range.kind < tile_meshes.size() && tile_meshes[range.kind] != -1) {
+                    context->submit_draw(tile_meshes[range.kind], chunk.obuffer_id, range.first_instance, range.instance_count, layer, pipeline_id);
+                }
+            }
+        }
+    }
+
+    // Waits for the loads still running and stops the workers. Their results are dropped, and the streamer cannot be updated
+    // afterwards.
+    void shutdown() {
+        for (auto& [position, load] : pending_loads) {
+            load.wait();
+        }
+        pending_loads.clear();
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        load_ready.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+    }
+
+    ~TileMapStreamer() {
+        shutdown();
+    }
+
+    private:
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable load_ready;
+    std::deque<std::packaged_task<ChunkInstances()>> queued_loads;
+    bool stopping;
+
+    // Exceptions thrown by a load end up in its future.
+    void worker_loop(int thread) {
+        TRACE_THREAD_NAME("chunk loader " + std::to_string(thread));
+        while (true) {
+            std::packaged_task<ChunkInstances()> load;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                load_ready.wait(lock, [this]() { return stopping || !queued_loads.empty(); });
+                if (queued_loads.empty()) {
+                    return;
+                }
+                load = std::move(queued_loads.front());
+                queued_loads.pop_front();
+            }
+            load();
+        }
+    }
+};
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <cstdio>
+#include <stdexcept>
+
+// CPU tracing. Zones are timed scopes, recorded into a buffer owned by the thread they run on, so recording takes no locks. The
+// trace is written in the Chrome trace event format, which Perfetto (ui.perfetto.dev) and chrome://tracing load directly.
+//
+// Tracing is compiled out unless ENABLE_TRACING is defined (see the trace target of the makefile). Without it, the TRACE_ macros
+// expand to nothing and their arguments are not evaluated.
+
+#ifndef TRACE_EVENTS_PER_THREAD
+#define TRACE_EVENTS_PER_THREAD (1 << 18)
+#endif
+
+const size_t TRACE_BLOCK_EVENTS = 4096;
+const size_t TRACE_MAX_BLOCKS = (TRACE_EVENTS_PER_THREAD + TRACE_BLOCK_EVENTS - 1) / TRACE_BLOCK_EVENTS;
+
+enum TraceEventType {
+    ZoneTraceEvent,
+    CounterTraceEvent
+};
+
+struct TraceEvent {
+    // Must outlive the trace, e.g. a string literal.
+    const char* name;
+    TraceEventType type;
+    int64_t start_ns;
+    // Duration in nanoseconds for zones, the value for counters.
+    double value;
+};
+
+// The events of one thread. Only the owning thread appends, publishing each event by bumping count, so the trace can be written
+// while the thread keeps recording. Memory is allocated in blocks as the buffer fills, and events past the capacity are dropped.
+struct TraceBuffer {
+    int thread_id;
+    std::string thread_name;
+    std::atomic<TraceEvent*> blocks[TRACE_MAX_BLOCKS];
+    std::atomic<size_t> count;
+    std::atomic<size_t> dropped;
+
+    TraceBuffer(int thread_id) : thread_id(thread_id), count(0), dropped(0) {
+        for (std::atomic<TraceEvent*>& block : blocks) {
+            block.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    void push(const TraceEvent& event) {
+        size_t index = count.load(std::memory_order_relaxed);
+        if (index >= TRACE_MAX_BLOCKS * TRACE_BLOCK_EVENTS) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        TraceEvent* block = blocks[index / TRACE_BLOCK_EVENTS].load(std::memory_order_relaxed);
+        if (block == nullptr) {
+            block = new TraceEvent[TRACE_BLOCK_EVENTS];
+            blocks[index / TRACE_BLOCK_EVENTS].store(block, std::memory_order_release);
+        }
+        block[index % TRACE_BLOCK_EVENTS] = event;
+        count.store(index + 1, std::memory_order_release);
+    }
+
+    // Events published so far. Safe to call from any thread.
+    std::vector<TraceEvent> get_events() {
+        size_t published = count.load(std::memory_order_acquire);
+        std::vector<TraceEvent> events(published);
+        for (size_t i = 0; i < published; ++i) {
+            events[i] = blocks[i / TRACE_BLOCK_EVENTS].load(std::memory_order_acquire)[i % TRACE_BLOCK_EVENTS];
+        }
+        return events;
+    }
+
+    ~TraceBuffer() {
+        for (std::atomic<TraceEvent*>& block : blocks) {
+            delete[] block.load();
+        }
+    }
+};
+
+struct Tracer {
+    std::chrono::steady_clock::time_point start_time;
+    // Guards the list of buffers and the thread names, never the events themselves.
+    std::mutex mutex;
+    // Buffers outlive their threads, so the events of finished threads are still written.
+    std::vector<std::unique_ptr<TraceBuffer>> buffers;
+
+    Tracer() : start_time(std::chrono::steady_clock::now()) {
+
+    }
+
+    static Tracer& get() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    TraceBuffer& get_thread_buffer() {
+        thread_local TraceBuffer* buffer = nullptr;
+        if (buffer == nullptr) {
+            std::unique_lock<std::mutex> lock(mutex);
+            buffers.push_back(std::make_unique<TraceBuffer>(buffers.size() + 1));
+            buffer = buffers.back().get();
+        }
+        return *buffer;
+    }
+
+    int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_time).count();
+    }
+
+    void record_zone(const char* name, int64_t start_ns, int64_t end_ns) {
+        get_thread_buffer().push({name, ZoneTraceEvent, start_ns, (double) (end_ns - start_ns)});
+    }
+
+    void record_counter(const char* name, double value) {
+        get_thread_buffer().push({name, CounterTraceEvent, now_ns(), value});
+    }
+
+    void set_thread_name(const std::string& name) {
+        TraceBuffer& buffer = get_thread_buffer();
+        std::unique_lock<std::mutex> lock(mutex);
+        buffer.thread_name = name;
+    }
+
+    static std::string escape_json(const std::string& text) {
+        std::string escaped = "";
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+            }
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    // Writes every event recorded so far. Timestamps are in microseconds since the tracer started.
+    void write_chrome_trace(std::string path) {
+        std::ofstream file(path, std::ios::trunc);
+        if (!file.is_open()) {
+            throw std::runtime_error("Could not write trace " + path);
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        auto separate = [&]() {
+            if (!first) {
+                file << ",\n";
+            }
+            first = false;
+        };
+
+        char buffer[256];
+        for (std::unique_ptr<TraceBuffer>& thread_buffer : buffers) {
+            if (thread_buffer->thread_name != "") {
+                separate();
+                file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread_buffer->thread_id
+                     << ",\"args\":{\"name\":\"" << escape_json(thread_buffer->thread_name) << "\"}}";
+            }
+
+            for (const TraceEvent& event : thread_buffer->get_events()) {
+                separate();
+                if (event.type == ZoneTraceEvent) {
+                    snprintf(buffer, sizeof(buffer), "\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                             thread_buffer->thread_id, event.start_ns / 1000.0, event.value / 1000.0);
+                } else {
+                    snprintf(buffer, sizeof(buffer), "\",\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"value\":%.6f}}",
+                             thread_buffer->thread_id, event.start_ns / 1000.0, event.value);
+                }
+                file << "{\"name\":\"" << escape_json(event.name) << buffer;
+            }
+
+            if (size_t dropped = thread_buffer->dropped.load(); dropped > 0) {
+                std::cerr << "Trace buffer of thread " << thread_buffer->thread_id << " was full, dropped " << dropped << " events" << std::endl;
+            }
+        }
+        file << "]}" << std::endl;
+    }
+};
+
+// Records the time from its construction to its destruction as a zone.
+struct TraceZone {
+    const char* name;
+    int64_t start_ns;
+
+    TraceZone(const char* name) : name(name), start_ns(Tracer::get().now_ns()) {
+
+    }
+
+    ~TraceZone() {
+        Tracer& tracer = Tracer::get();
+        tracer.record_zone(name, start_ns, tracer.now_ns());
+    }
+};
+
+#ifdef ENABLE_TRACING
+const bool tracing_enabled = true;
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+// Times the rest of the enclosing scope. name must outlive the trace.
+#define TRACE_ZONE(name) TraceZone TRACE_CONCAT(trace_zone_, __LINE__)(name)
+// Adds a sample to the counter track called name, which must outlive the trace.
+#define TRACE_COUNTER(name, value) Tracer::get().record_counter(name, value)
+#define TRACE_THREAD_NAME(name) Tracer::get().set_thread_name(name)
+#else
+const bool tracing_enabled = false;
+#define TRACE_ZONE(name) ((void) 0)
+#define TRACE_COUNTER(name, value) ((void) 0)
+#define TRACE_THREAD_NAME(name) ((void) 0)
+#endif
@@ -1,9 +1,20 @@
 #version 450
 
 layout(location = 0) in vec3 colorIn;
+layout(location = 1) in vec2 uvIn;
 
 layout(location = 0) out vec4 outColor;
 
+// The atlas page the draw was submitted with.
+layout(set = 0, binding = 0) uniform sampler2D atlas;
+
+// Set per pipeline variant. 0 multiplies the vertex color by the atlas, 1 uses the vertex color alone.
+layout(constant_id = 0) const int COLOR_MODE = 0;
+
 void main() {
-    outColor = vec4(colorIn / 255, 1.0);
+    if (COLOR_MODE == 1) {
+        outColor = vec4(colorIn, 1.0);
+    } else {
+        outColor = vec4(colorIn, 1.0) * texture(atlas, uvIn);
+    }
 }
\ No newline at end of file
@@ -3,17 +3,31 @@
 layout(location = 0) in vec2 vertex;
 layout(location = 1) in vec3 colorIn;
 layout(location = 2) in vec2 pos;
+layout(location = 3) in vec2 uvIn;
 
 layout(location = 0) out vec3 colorOut;
+layout(location = 1) out vec2 uvOut;
 
-const int GAME_UNIT_BOUND = 1000;
+// Set per vertex layout by the pipeline. Packed layouts store positions as fractions of a range and colors as 0 - 1.
+layout(constant_id = 0) const float POSITION_SCALE = 1.0;
+layout(constant_id = 1) const float COLOR_SCALE = 1.0 / 255.0;
+// Game units from the bottom to the top of the screen at zoom 1.
+layout(constant_id = 2) const float WORLD_BOUND = 1000.0;
+
+// CameraPushConstants.
+layout(push_constant) uniform Camera {
+    vec2 center;
+    float zoom;
+    float aspect;
+} camera;
 
 vec2 change_coordinate_bounds(vec2 pos) {
-    vec2 new_pos = (2 * pos / GAME_UNIT_BOUND - 1);
-    return vec2(new_pos.x, -new_pos.y);
+    vec2 new_pos = 2 * camera.zoom * (pos - camera.center) / WORLD_BOUND;
+    return vec2(new_pos.x / camera.aspect, -new_pos.y);
 }
 
 void main() {
-    gl_Position = vec4(change_coordinate_bounds(vertex + pos), 0.0, 1.0);
-    colorOut = colorIn;
+    gl_Position = vec4(change_coordinate_bounds((vertex + pos) * POSITION_SCALE), 0.0, 1.0);
+    colorOut = colorIn * COLOR_SCALE;
+    uvOut = uvIn;
 }
\ No newline at end of file
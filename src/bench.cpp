@@ -0,0 +1,224 @@
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <map>
+#include <init.h>
+#include <frame.h>
+#include <bench_stats.h>
+
+// Frame-time benchmark harness. Renders deterministic synthetic scenes offscreen and prints one JSON object per scene to stdout.
+//
+// Context setup logs to stdout as well, so use --out to get a file containing only the results.
+//
+// Usage: bench [--frames N] [--warmup N] [--max-instances N] [--cached 0|1] [--packed 0|1] [--culled 0|1] [--out results.jsonl]
+//
+// --cached 1 resubmits pre-recorded command buffers instead of recording every frame.
+// --packed 1 draws with PackedVertex and PackedObjectData instead of Vertex and ObjectData.
+// --culled 1 draws every scene as one GPU culled draw against a view covering a quarter of the scene. Not combinable with --packed.
+//
+// gpu_ms is the wall time from submission until a frame retires. gpu_scopes_ms has the GPU timestamps of each profiler scope,
+// e.g. render_pass, uploads and culling, for the frames that had it. input_to_render_complete_ms is the frame pacer's latency
+// over the pipelined pass, from the start of each frame, where the game would sample input, until it is seen to have retired.
+// It stands in for input to present latency, since offscreen frames are never presented (see pacing.h).
+
+struct BenchScene {
+    std::string name;
+    int instance_count;
+    // Instances per submit_draw call. The submissions are made in shuffled order, so the draw list has to sort and merge them.
+    int instances_per_submission;
+};
+
+// Scatter the instances over the world with a fixed seed so that every run renders exactly the same scene.
+std::vector<ObjectData> generate_instances(int count, unsigned int seed) {
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<float> distribution(0.0f, 990.0f);
+
+    std::vector<ObjectData> object_data (count);
+    for (ObjectData& object : object_data) {
+        float x = distribution(generator);
+        float y = distribution(generator);
+        object = ObjectData(x, y);
+    }
+    return object_data;
+}
+
+std::string to_json(const GpuAllocatorStats& stats) {
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "{\"blocks\":%d,\"allocations\":%d,\"reserved_bytes\":%llu,\"used_bytes\":%llu,\"fragmentation\":%.4f}", 
+             stats.block_count, stats.allocation_count, (unsigned long long) stats.reserved_bytes, (unsigned long long) stats.used_bytes, stats.fragmentation);
+    return std::string(buffer);
+}
+
+int main(int argc, char** argv) {
+    int frame_count = 500;
+    int warmup_count = 50;
+    int max_instances = 1000000;
+    bool cached = false;
+    bool packed = false;
+    bool culled = false;
+    std::string output_path = "";
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "--frames") {
+            frame_count = std::stoi(argv[i + 1]);
+        } else if (arg == "--warmup") {
+            warmup_count = std::stoi(argv[i + 1]);
+        } else if (arg == "--max-instances") {
+            max_instances = std::stoi(argv[i + 1]);
+        } else if (arg == "--cached") {
+            cached = std::stoi(argv[i + 1]) != 0;
+        } else if (arg == "--packed") {
+            packed = std::stoi(argv[i + 1]) != 0;
+        } else if (arg == "--culled") {
+            culled = std::stoi(argv[i + 1]) != 0;
+        } else if (arg == "--out") {
+            output_path = argv[i + 1];
+        } else {
+            throw std::runtime_error("Unknown argument: " + arg);
+        }
+    }
+    if (packed && culled) {
+        throw std::runtime_error("--culled only supports the full vertex layout.");
+    }
+
+    std::vector<BenchScene> scenes = {};
+    for (int instance_count = 10; instance_count <= max_instances; instance_count *= 10) {
+        scenes.push_back({"instanced_quads", instance_count, instance_count});
+    }
+    for (int instance_count = 10; instance_count <= std::min(max_instances, 100000); instance_count *= 10) {
+        scenes.push_back({"sprite_submissions", instance_count, 1});
+    }
+
+    std::ofstream output_file;
+    if (output_path != "") {
+        output_file.open(output_path);
+        if (!output_file.is_open()) {
+            throw std::runtime_error("Could not open " + output_path);
+        }
+    }
+    std::ostream& output = output_path != "" ? output_file : std::cout;
+
+    std::shared_ptr<VkContext> context = std::make_shared<VkContext>(true);
+    context->cache_command_buffers = cached;
+    if (culled) {
+        context->set_cull_view(glm::vec4(0, 0, 500, 500));
+    }
+
+    // The same quad that main.cpp draws, imported as 4 unique vertices and 6 indices.
+    std::vector<Vertex> vertex_data = {
+        Vertex(0, 0, 0, 255, 0), Vertex(10, 10, 0, 255, 0), Vertex(0, 10, 0, 255, 0),
+        Vertex(0, 0, 0, 255, 0), Vertex(10, 0, 0, 255, 0), Vertex(10, 10, 0, 255, 0),
+    };
+    int pipeline_id = packed ? PackedVertexLayout : FullVertexLayout;
+    int vertex_buffer_id = packed ? context->create_packed_indexed_mesh(vertex_data) : context->create_indexed_mesh(vertex_data);
+
+    for (const BenchScene& scene : scenes) {
+        std::vector<ObjectData> instances = generate_instances(scene.instance_count, 1234);
+        int object_buffer_id = packed ? context->create_packed_object_position_buffer(instances) : context->create_object_position_buffer(instances);
+
+        std::vector<int> submission_starts = {};
+        for (int first = 0; first < scene.instance_count; first += scene.instances_per_submission) {
+            submission_starts.push_back(first);
+        }
+        std::shuffle(submission_starts.begin(), submission_starts.end(), std::mt19937(1234));
+        int culled_draw_id = culled ? context->create_culled_draw(vertex_buffer_id, object_buffer_id) : -1;
+
+        auto submit_scene = [&]() {
+            if (culled) {
+                context->submit_culled_draw(culled_draw_id);
+                return;
+            }
+            for (int first : submission_starts) {
+                context->submit_draw(vertex_buffer_id, object_buffer_id, first, std::min(scene.instances_per_submission, scene.instance_count - first), 0, pipeline_id);
+            }
+        };
+
+        auto draw_scene = [&]() {
+            submit_scene();
+            draw_frame(context);
+        };
+
+        // Make sure the draws that get recorded cover every instance of the scene exactly once, or the numbers below measure
+        // some other scene.
+        submit_scene();
+        int drawn_instance_count = 0;
+        for (const DrawCommand& draw : batch_draw_commands(context->draw_list)) {
+            drawn_instance_count += draw.instance_count;
+        }
+        if (drawn_instance_count != scene.instance_count) {
+            throw std::runtime_error("Scene " + scene.name + " of " + std::to_string(scene.instance_count) + " instances draws " 
+                                     + std::to_string(drawn_instance_count) + " instances");
+        }
+        draw_frame(context);
+
+        for (int i = 0; i < warmup_count; ++i) {
+            draw_scene();
+        }
+        vkDeviceWaitIdle(context->logical_device);
+
+        // Pipelined pass: frames overlap as they would in the game. Measures throughput.
+        std::vector<double> frame_times = {};
+        context->frame_pacer.latencies_ms.clear();
+        auto previous = std::chrono::steady_clock::now();
+        for (int i = 0; i < frame_count; ++i) {
+            pace_frame(context);
+            draw_scene();
+            auto now = std::chrono::steady_clock::now();
+            frame_times.push_back(elapsed_ms(previous, now));
+            previous = now;
+        }
+        vkDeviceWaitIdle(context->logical_device);
+        context->frame_pacer.on_frames_retired(context->frame_scheduler.get_completed_frame());
+        BenchSummary latency = context->frame_pacer.get_latency_summary();
+
+        // Serialized pass: each frame is submitted to an idle GPU and waited on before the next one starts.
+        // CPU time covers submitting the draws and recording and submission in draw_frame, GPU time runs from submission until the frame retires.
+        // The GPU's own timestamps of each profiler scope are read back once the frame has retired.
+        std::vector<double> cpu_times = {};
+        std::vector<double> gpu_times = {};
+        std::map<std::string, std::vector<double>> scope_times = {};
+        for (int i = 0; i < frame_count; ++i) {
+            auto cpu_start = std::chrono::steady_clock::now();
+            draw_scene();
+            auto cpu_end = std::chrono::steady_clock::now();
+            context->frame_scheduler.wait_for_frame(context->frame_scheduler.submitted_frame);
+            auto gpu_end = std::chrono::steady_clock::now();
+
+            context->gpu_profiler.collect(context->frame_scheduler.get_slot(context->frame_scheduler.submitted_frame));
+            for (const GpuScopeTiming& timing : context->gpu_profiler.results) {
+                scope_times[timing.name].push_back(timing.ms);
+            }
+
+            cpu_times.push_back(elapsed_ms(cpu_start, cpu_end));
+            gpu_times.push_back(elapsed_ms(cpu_end, gpu_end));
+        }
+
+        std::string scope_json = "{";
+        for (auto& [name, times] : scope_times) {
+            scope_json += (scope_json.size() > 1 ? ",\"" : "\"") + name + "\":" + to_json(summarize(times));
+        }
+        scope_json += "}";
+
+        output << "{\"scene\":\"" << scene.name << "\",\"instances\":" << scene.instance_count << ",\"frames\":" << frame_count << ",\"cached\":" << (cached ? "true" : "false") << ",\"packed\":" << (packed ? "true" : "false") << ",\"culled\":" << (culled ? "true" : "false")
+               << ",\"frame_ms\":" << to_json(summarize(frame_times))
+               << ",\"cpu_ms\":" << to_json(summarize(cpu_times))
+               << ",\"gpu_ms\":" << to_json(summarize(gpu_times))
+               << ",\"input_to_render_complete_ms\":" << to_json(latency)
+               << ",\"gpu_scopes_ms\":" << scope_json
+               << ",\"memory\":" << to_json(context->allocator.get_stats()) << "}" << std::endl;
+
+        // Release the scene's instances, so that the memory reported for the next scene is its own.
+        if (culled) {
+            context->destroy_culled_draw(culled_draw_id);
+        }
+        if (packed) {
+            context->destroy_packed_object_position_buffer(object_buffer_id);
+        } else {
+            context->destroy_object_position_buffer(object_buffer_id);
+        }
+    }
+
+    return 0;
+}
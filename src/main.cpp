@@ -1,154 +1,229 @@
 #include <iostream>
+#include <chrono>
 #include <init.h>
-
-void record_command_buffer(std::shared_ptr<VkContext> context, int image_index, int frame, int vbuffer_id, int obuffer_id) {
-    VkCommandBufferBeginInfo beginInfo{};
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.flags = 0; // Optional
-    beginInfo.pInheritanceInfo = nullptr; // Optional
-
-    if (vkBeginCommandBuffer(context->command_buffers[frame], &beginInfo) != VK_SUCCESS) {
-        throw std::runtime_error("failed to begin recording command buffer!");
+#include <frame.h>
+#include <entity.h>
+#include <tilemap.h>
+
+int main(int argc, char** argv) {
+    // Run with --headless [frame count] to render offscreen without a window, e.g. on a software driver.
+    // Run with --map path to stream a tilemap (see tilemap_tool) under the objects.
+    // Run with --present immediate|mailbox|relaxed|fifo and --images N to pick the present mode and the swapchain images beyond
+    // the minimum, and with --pace to start frames as late as the GPU allows. The input latency is printed on exit.
+    // Run with --frames-in-flight N to let the CPU run up to N frames ahead of the GPU.
+    // Run with --trace path to write a CPU trace on exit, for Perfetto or chrome://tracing. Needs a build with tracing (make trace).
+    bool headless = false;
+    int headless_frame_count = 1000;
+    std::string map_path = "";
+    PresentPolicy present_policy = MailboxPresentPolicy;
+    int additional_swapchain_images = 1;
+    bool pace = false;
+    int frames_in_flight = 2;
+    std::string trace_path = "";
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--headless") {
+            headless = true;
+            // The frame count is optional, so the next argument is only taken when it is a number.
+            if (i + 1 < argc && std::string(argv[i + 1]).find_first_not_of("0123456789") == std::string::npos && argv[i + 1][0] != '\0') {
+                headless_frame_count = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--map" && i + 1 < argc) {
+            map_path = argv[++i];
+        } else if (arg == "--present" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode == "immediate") {
+                present_policy = LowLatencyPresentPolicy;
+            } else if (mode == "mailbox") {
+                present_policy = MailboxPresentPolicy;
+            } else if (mode == "relaxed") {
+                present_policy = RelaxedVsyncPresentPolicy;
+            } else if (mode == "fifo") {
+                present_policy = VsyncPresentPolicy;
+            } else {
+                throw std::runtime_error("Unknown present mode: " + mode);
+            }
+        } else if (arg == "--images" && i + 1 < argc) {
+            additional_swapchain_images = std::stoi(argv[++i]);
+        } else if (arg == "--pace") {
+            pace = true;
+        } else if (arg == "--frames-in-flight" && i + 1 < argc) {
+            frames_in_flight = std::stoi(argv[++i]);
+        } else if (arg == "--trace" && i + 1 < argc) {
+            trace_path = argv[++i];
+        }
     }
 
-    VkRenderPassBeginInfo renderPassInfo{};
-    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    renderPassInfo.renderPass = context->graphics_pipeline.render_pass;
-    renderPassInfo.framebuffer = context->swapchain_framebuffers[image_index];
-
-    renderPassInfo.renderArea.offset = {0, 0};
-    renderPassInfo.renderArea.extent = context->swapchain_extent;
-
-    VkClearValue clearColor = {{{1.0f, 0.0f, 0.0f, 1.0f}}};
-    renderPassInfo.clearValueCount = 1;
-    renderPassInfo.pClearValues = &clearColor;
-
-    vkCmdBeginRenderPass(context->command_buffers[frame], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
-
-    vkCmdBindPipeline(context->command_buffers[frame], VK_PIPELINE_BIND_POINT_GRAPHICS, context->graphics_pipeline.graphics_pipeline);
-
-    VkViewport viewport{};
-    viewport.x = 0.0f;
-    viewport.y = 0.0f;
-    viewport.width = static_cast<float>(context->swapchain_extent.width);
-    viewport.height = static_cast<float>(context->swapchain_extent.height);
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 1.0f;
-    vkCmdSetViewport(context->command_buffers[frame], 0, 1, &viewport);
-
-    VkRect2D scissor{};
-    scissor.offset = {0, 0};
-    scissor.extent = context->swapchain_extent;
-    vkCmdSetScissor(context->command_buffers[frame], 0, 1, &scissor);
+    TRACE_THREAD_NAME("main");
+    if (trace_path != "" && !tracing_enabled) {
+        std::cout << "Tracing is compiled out, no trace will be written. Build with make trace." << std::endl;
+    }
 
-    VkBuffer vertexBuffers[] = {context->vertex_buffers[vbuffer_id].buffer, context->object_position_buffers[obuffer_id].buffer};
-    VkDeviceSize offsets[] = {0, 0};
-    vkCmdBindVertexBuffers(context->command_buffers[frame], 0, 2, vertexBuffers, offsets);
+    std::shared_ptr<VkContext> vk_context = std::make_shared<VkContext>(headless, VkExtent2D{1000, 1000}, present_policy, additional_swapchain_images, 
+                                                                            frames_in_flight);
+    vk_context->frame_pacer.enabled = pace;
 
-    vkCmdDraw(context->command_buffers[frame], context->vertex_buffers[vbuffer_id].length, context->object_position_buffers[vbuffer_id].length, 0, 0);
+    auto print_latency = [&]() {
+        if (vk_context->frame_pacer.has_latency_samples()) {
+            std::cout << "Input to render complete latency (ms, presentation not included): " << to_json(vk_context->frame_pacer.get_latency_summary()) << std::endl;
+        }
+    };
 
-    vkCmdEndRenderPass(context->command_buffers[frame]);
+    auto write_trace = [&]() {
+        if (trace_path != "" && tracing_enabled) {
+            Tracer::get().write_chrome_trace(trace_path);
+            std::cout << "Wrote trace to " << trace_path << std::endl;
+        }
+    };
 
-    if (VkResult result = vkEndCommandBuffer(context->command_buffers[frame]); result != VK_SUCCESS) {
-        throw std::runtime_error("Could not record command buffer: " + std::string(string_VkResult(result)));
+    // A green ball sprite on a transparent background, drawn as a 10x10 unit quad.
+    const uint32_t sprite_size = 16;
+    std::vector<uint8_t> sprite_pixels(sprite_size * sprite_size * 4, 0);
+    for (uint32_t y = 0; y < sprite_size; ++y) {
+        for (uint32_t x = 0; x < sprite_size; ++x) {
+            glm::vec2 offset = glm::vec2(x + 0.5f, y + 0.5f) - glm::vec2(sprite_size / 2.0f, sprite_size / 2.0f);
+            if (glm::dot(offset, offset) <= sprite_size * sprite_size / 4.0f) {
+                uint8_t* pixel = &sprite_pixels[(y * sprite_size + x) * 4];
+                pixel[1] = 255 - (uint8_t) (glm::length(offset) * 12);
+                pixel[3] = 255;
+            }
+        }
     }
-}
-
-bool framebuffer_resized_flag = false;
-int current_frame = 0;
-
-void draw_frame(std::shared_ptr<VkContext> context, int vbuffer_id, int obuffer_id) {
-    vkWaitForFences(context->logical_device, 1, &context->command_buffer_fences[current_frame], VK_TRUE, UINT64_MAX);
-
-    // Get the next image;
-    uint32_t image_index;
-    VkResult result = vkAcquireNextImageKHR(context->logical_device, context->swapchain, UINT64_MAX, context->image_available_semaphores[current_frame], VK_NULL_HANDLE, &image_index);
+    AtlasRegion sprite = vk_context->texture_atlas.add_sprite(sprite_size, sprite_size, sprite_pixels.data());
+    std::vector<Vertex> vertex_data = get_sprite_vertices(glm::vec2(10, 10), sprite);
 
-    if (result == VK_ERROR_OUT_OF_DATE_KHR) {
-        context->rebuild_swapchain();
-        return;
-    } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
-        throw std::runtime_error("Could not aquire swapchain image: " + std::string(string_VkResult(result)));
+    EntityStore entities;
+    for (int i = 0; i < 5; ++i) {
+        entities.create(glm::vec2(20 * i, 20 * i), glm::vec2(1, 1));
     }
 
-    // Only reset command_buffer fence if we are sure that it will be submitted on this frame.
-    vkResetFences(context->logical_device, 1, &context->command_buffer_fences[current_frame]);
-
-    // Record command buffer.
-    vkResetCommandBuffer(context->command_buffers[current_frame], 0);
-    record_command_buffer(context, image_index, current_frame, vbuffer_id, obuffer_id);
-
-    // Submit graphics queue.
-    VkSubmitInfo info {};
-    info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    info.commandBufferCount = 1;
-    info.pCommandBuffers = &context->command_buffers[current_frame];
-    info.waitSemaphoreCount = 1;
-    info.pWaitSemaphores = &context->image_available_semaphores[current_frame];
-    VkPipelineStageFlags stages_to_wait_on_semaphores = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-    info.pWaitDstStageMask = &stages_to_wait_on_semaphores;
-    info.signalSemaphoreCount = 1;
-    info.pSignalSemaphores = &context->image_done_rendering_semaphores[current_frame];
-    vkQueueSubmit(context->get_graphics_queue(), 1, &info, context->command_buffer_fences[current_frame]);
-
-    // Submit presentation queue.
-    VkPresentInfoKHR presentInfo {};
-    presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-    presentInfo.pImageIndices = &image_index;
-    presentInfo.pSwapchains = &context->swapchain;
-    presentInfo.swapchainCount = 1;
-    presentInfo.waitSemaphoreCount = 1;
-    presentInfo.pWaitSemaphores = &context->image_done_rendering_semaphores[current_frame];
-    result = vkQueuePresentKHR(context->get_presentation_queue(), &presentInfo);
-
-    if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || framebuffer_resized_flag) {
-        context->rebuild_swapchain();
-        framebuffer_resized_flag = false;
-    } else if (result != VK_SUCCESS) {
-        throw std::runtime_error("Could not present swapchain image: " + std::string(string_VkResult(result)));
+    int vertex_buffer_id = vk_context->create_indexed_mesh(vertex_data);
+    int object_buffer_id = vk_context->create_dynamic_object_position_buffer(entities.size());
+
+    // One colored quad per kind of tile: nothing, grass, water and road.
+    // Tiles are flat colored and cover everything below them, so they skip the texture fetch and blending.
+    std::unique_ptr<TileMapStreamer> tilemap = nullptr;
+    int tile_pipeline_id = vk_context->get_pipeline_variant(PipelineVariant(FullVertexLayout, VertexColorMode, false));
+    if (map_path != "") {
+        std::vector<glm::vec3> tile_colors = {glm::vec3(34, 139, 34), glm::vec3(30, 90, 200), glm::vec3(140, 110, 70)};
+        std::vector<int> tile_meshes = {-1};
+        for (const glm::vec3& color : tile_colors) {
+            tile_meshes.push_back(vk_context->create_indexed_mesh({
+                Vertex(0, 0, color.x, color.y, color.z), Vertex(10, 10, color.x, color.y, color.z), Vertex(0, 10, color.x, color.y, color.z),
+                Vertex(0, 0, color.x, color.y, color.z), Vertex(10, 0, color.x, color.y, color.z), Vertex(10, 10, color.x, color.y, color.z),
+            }));
+        }
+        tilemap = std::make_unique<TileMapStreamer>(map_path, tile_meshes);
     }
 
-    current_frame = (current_frame + 1) % context->MAX_FRAMES_IN_FLIGHT;
-}
+    // The tilemap is drawn below the objects, streamed around the camera.
+    auto submit_draws = [&]() {
+        if (tilemap != nullptr) {
+            tilemap->update(vk_context, vk_context->camera_center);
+            tilemap->submit_draws(vk_context, vk_context->get_camera_view(), 0, tile_pipeline_id);
+        }
+        vk_context->submit_draw(vertex_buffer_id, object_buffer_id, 0, -1, 1, FullVertexLayout, sprite.page);
+    };
 
-int main() {
-    std::shared_ptr<VkContext> vk_context = std::make_shared<VkContext>();
+    // Move the objects along the diagonal and write them straight into this frame's region of the object buffer. Must run after
+    // wait_for_frame.
+    auto update_objects = [&]() {
+        entities.integrate(1.0f);
+        entities.for_each([](glm::vec2& pos, glm::vec2& velocity, uint32_t& sprite_id) {
+            if (pos.x > 990 || pos.y > 990) {
+                pos = glm::vec2(0, 0);
+            }
+        });
 
-    std::vector<Vertex> vertex_data = {
-        Vertex(0, 0, 0, 255, 0), Vertex(10, 10, 0, 255, 0), Vertex(0, 10, 0, 255, 0),
-        Vertex(0, 0, 0, 255, 0), Vertex(10, 0, 0, 255, 0), Vertex(10, 10, 0, 255, 0),
+        entities.write_instances(vk_context->object_position_buffers[object_buffer_id], current_frame);
     };
 
-    std::vector<ObjectData> object_data = {
-        ObjectData(0, 0), ObjectData(20, 20),
-        ObjectData(40, 40), ObjectData(60, 60),
-        ObjectData(80, 80),
+    // Waiting for the frame again is free, unless an event watch rendered a frame while input was being polled.
+    auto render_frame = [&]() {
+        wait_for_frame(vk_context);
+        update_objects();
+        submit_draws();
+        draw_frame(vk_context);
     };
 
-    int vertex_buffer_id = vk_context->create_vertex_buffer(vertex_data);
-    int object_buffer_id = vk_context->create_object_position_buffer(object_data);
+    if (headless) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < headless_frame_count; ++i) {
+            wait_for_frame(vk_context);
+            pace_frame(vk_context);
+            render_frame();
+        }
+        vkDeviceWaitIdle(vk_context->logical_device);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "Rendered " << headless_frame_count << " offscreen frames in " << elapsed.count() << "s (" 
+                  << headless_frame_count / elapsed.count() << " fps)" << std::endl;
+        print_latency();
+        write_trace();
+        return 0;
+    }
+
+    // While the window is being resized, some platforms block in SDL_PollEvent until the user lets go. Event watches still run
+    // for every resize, so frames are rendered from there to keep the window live.
+    std::function<void()> render_resized_frame = [&]() {
+        framebuffer_resized_flag = true;
+        render_frame();
+    };
+    SDL_EventFilter resize_watch = [](void* userdata, SDL_Event* event) {
+        if (event->type == SDL_WINDOWEVENT && event->window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+            (*static_cast<std::function<void()>*>(userdata))();
+        }
+        return 0;
+    };
+    SDL_AddEventWatch(resize_watch, &render_resized_frame);
 
     bool running = true;
 
     while(running) {
+        // Input is sampled once the frame's resources are free and the pacer's delay has passed.
+        wait_for_frame(vk_context);
+        pace_frame(vk_context);
+
         SDL_UpdateWindowSurface(vk_context->window);
-        SDL_Event event;
-        while(SDL_PollEvent(&event)) {
-            switch(event.type) {
-                case SDL_WINDOWEVENT:
-                    switch(event.window.event) {
-                        case SDL_WINDOWEVENT_SIZE_CHANGED:
-                            framebuffer_resized_flag = true;
-                            break;
+        {
+            TRACE_ZONE("poll_events");
+            SDL_Event event;
+            while(SDL_PollEvent(&event)) {
+                switch(event.type) {
+                    // Arrow keys pan the camera and the mouse wheel zooms it.
+                    case SDL_KEYDOWN: {
+                        float step = 20.0f / vk_context->camera_zoom;
+                        glm::vec2 center = vk_context->camera_center;
+                        switch(event.key.keysym.sym) {
+                            case SDLK_LEFT:
+                                center.x -= step;
+                                break;
+                            case SDLK_RIGHT:
+                                center.x += step;
+                                break;
+                            case SDLK_UP:
+                                center.y -= step;
+                                break;
+                            case SDLK_DOWN:
+                                center.y += step;
+                                break;
+                        }
+                        vk_context->set_camera(center, vk_context->camera_zoom);
+                        break;
                     }
-                    break;
-                case SDL_QUIT:
-                    running = false;
-                    break;
+                    case SDL_MOUSEWHEEL:
+                        vk_context->set_camera(vk_context->camera_center, glm::clamp(vk_context->camera_zoom * (event.wheel.y > 0 ? 1.1f : 1 / 1.1f), 0.25f, 8.0f));
+                        break;
+                    case SDL_QUIT:
+                        running = false;
+                        break;
+                }
             }
         }
-        draw_frame(vk_context, vertex_buffer_id, object_buffer_id);
+        render_frame();
     }
-    
+
+    SDL_DelEventWatch(resize_watch, &render_resized_frame);
+    print_latency();
+    write_trace();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,79 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <mesh.h>
+#include <bench_stats.h>
+
+// Benchmark of mesh import. Builds grids of quads as plain triangle lists, imports them with build_indexed_mesh and prints one
+// JSON object per grid size to stdout, with the simulated ACMR of the deduplicated indices before and after cache ordering.
+//
+// Usage: mesh_bench [--max-size N] [--cache-size N] [--out results.jsonl]
+
+struct GridVertex {
+    float x;
+    float y;
+};
+
+// Two triangles per cell, cells in row-major order, the way a naive exporter writes them.
+std::vector<GridVertex> get_grid_triangles(int size) {
+    std::vector<GridVertex> triangles = {};
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            GridVertex a = {(float) x, (float) y};
+            GridVertex b = {(float) x + 1, (float) y};
+            GridVertex c = {(float) x + 1, (float) y + 1};
+            GridVertex d = {(float) x, (float) y + 1};
+            triangles.insert(triangles.end(), {a, c, d, a, b, c});
+        }
+    }
+    return triangles;
+}
+
+int main(int argc, char** argv) {
+    int max_size = 100;
+    int cache_size = 16;
+    std::string output_path = "";
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "--max-size") {
+            max_size = std::stoi(argv[i + 1]);
+        } else if (arg == "--cache-size") {
+            cache_size = std::stoi(argv[i + 1]);
+        } else if (arg == "--out") {
+            output_path = argv[i + 1];
+        } else {
+            throw std::runtime_error("Unknown argument: " + arg);
+        }
+    }
+
+    std::ofstream output_file;
+    if (output_path != "") {
+        output_file.open(output_path);
+        if (!output_file.is_open()) {
+            throw std::runtime_error("Could not open " + output_path);
+        }
+    }
+    std::ostream& output = output_path != "" ? output_file : std::cout;
+
+    for (int size = 10; size <= max_size; size *= 10) {
+        std::vector<GridVertex> triangles = get_grid_triangles(size);
+
+        std::vector<GridVertex> unique_vertices = {};
+        std::vector<uint32_t> unordered_indices = {};
+        deduplicate_vertices(triangles, unique_vertices, unordered_indices);
+
+        std::vector<GridVertex> vertices = {};
+        std::vector<uint32_t> indices = {};
+        auto start = std::chrono::steady_clock::now();
+        build_indexed_mesh(triangles, vertices, indices);
+        double import_ms = elapsed_ms(start, std::chrono::steady_clock::now());
+
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer), "{\"grid\":%d,\"triangles\":%zu,\"vertices\":%zu,\"cache_size\":%d,\"acmr_unordered\":%.4f,\"acmr_ordered\":%.4f,\"import_ms\":%.3f}",
+                 size, triangles.size() / 3, vertices.size(), cache_size, get_acmr(unordered_indices, cache_size), get_acmr(indices, cache_size), import_ms);
+        output << buffer << std::endl;
+    }
+
+    return 0;
+}
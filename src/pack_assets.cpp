@@ -0,0 +1,56 @@
+#include <iostream>
+#include <archive.h>
+
+// Packs files into an asset archive. Each file is stored under the path it was given by, which is also the path the game asks
+// for, so an archive built from the repo root stands in for the files themselves.
+//
+// Usage: pack_assets out.pak [--compress 0|1] files...
+
+std::vector<char> read_whole_file(const std::string& path) {
+    std::ifstream file(path, std::ios::ate | std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open " + path);
+    }
+
+    std::vector<char> contents((size_t) file.tellg());
+    file.seekg(0);
+    file.read(contents.data(), contents.size());
+    return contents;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: pack_assets out.pak [--compress 0|1] files..." << std::endl;
+        return 1;
+    }
+
+    std::string output_path = argv[1];
+    bool compress = false;
+    std::vector<std::pair<std::string, std::vector<char>>> assets = {};
+    size_t total_size = 0;
+
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--compress" && i + 1 < argc) {
+            compress = std::stoi(argv[++i]) != 0;
+        } else {
+            assets.push_back({arg, read_whole_file(arg)});
+            total_size += assets.back().second.size();
+        }
+    }
+
+    write_asset_archive(output_path, assets, compress);
+
+    // Read the archive back, so that a bad archive fails the build rather than the game.
+    AssetArchive archive(output_path);
+    for (const auto& [name, contents] : assets) {
+        AssetView view = archive.get(name);
+        if (view.size != contents.size() || memcmp(view.data, contents.data(), view.size) != 0) {
+            throw std::runtime_error("Asset " + name + " did not survive the round trip");
+        }
+    }
+
+    std::cout << "Packed " << assets.size() << " assets (" << total_size << " bytes) into " << output_path << " (" << archive.file->size 
+              << " bytes)" << std::endl;
+    return 0;
+}
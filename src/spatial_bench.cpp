@@ -0,0 +1,141 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <random>
+#include <spatial.h>
+#include <bench_stats.h>
+
+// Benchmark of the spatial grid with moving objects. Every frame all objects move, then a view sized rectangle is gathered into
+// an instance list and a batch of radius queries is made. A linear scan of the same rectangle is timed as the baseline.
+// Prints one JSON object per object count to stdout.
+//
+// Usage: spatial_bench [--frames N] [--max-objects N] [--cell-size N] [--out results.jsonl]
+
+const float WORLD_SIZE = 1000.0f;
+
+int main(int argc, char** argv) {
+    int frame_count = 200;
+    int max_objects = 250000;
+    float cell_size = 25.0f;
+    std::string output_path = "";
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "--frames") {
+            frame_count = std::stoi(argv[i + 1]);
+        } else if (arg == "--max-objects") {
+            max_objects = std::stoi(argv[i + 1]);
+        } else if (arg == "--cell-size") {
+            cell_size = std::stof(argv[i + 1]);
+        } else if (arg == "--out") {
+            output_path = argv[i + 1];
+        } else {
+            throw std::runtime_error("Unknown argument: " + arg);
+        }
+    }
+
+    std::ofstream output_file;
+    if (output_path != "") {
+        output_file.open(output_path);
+        if (!output_file.is_open()) {
+            throw std::runtime_error("Could not open " + output_path);
+        }
+    }
+    std::ostream& output = output_path != "" ? output_file : std::cout;
+
+    std::vector<int> object_counts = {};
+    for (int object_count = 10000; object_count <= max_objects; object_count *= 10) {
+        object_counts.push_back(object_count);
+    }
+    if (object_counts.empty() || object_counts.back() != max_objects) {
+        object_counts.push_back(max_objects);
+    }
+
+    // A quarter of the world is in view, and 100 radius queries of 20 units stand in for proximity checks around actors.
+    const glm::vec2 view_lower(250, 250);
+    const glm::vec2 view_upper(750, 750);
+    const int radius_query_count = 100;
+    const float radius = 20.0f;
+
+    for (int object_count : object_counts) {
+        std::mt19937 generator(1234);
+        std::uniform_real_distribution<float> position_distribution(0.0f, WORLD_SIZE);
+        std::uniform_real_distribution<float> velocity_distribution(-2.0f, 2.0f);
+
+        SpatialGrid grid(WORLD_SIZE, cell_size);
+        std::vector<glm::vec2> positions(object_count);
+        std::vector<glm::vec2> velocities(object_count);
+        std::vector<SpatialHandle> handles(object_count);
+        for (int i = 0; i < object_count; ++i) {
+            positions[i] = glm::vec2(position_distribution(generator), position_distribution(generator));
+            velocities[i] = glm::vec2(velocity_distribution(generator), velocity_distribution(generator));
+            handles[i] = grid.insert(positions[i]);
+        }
+
+        std::vector<glm::vec2> query_centers(radius_query_count);
+        for (glm::vec2& center : query_centers) {
+            center = glm::vec2(position_distribution(generator), position_distribution(generator));
+        }
+
+        std::vector<glm::vec2> instances(object_count);
+        std::vector<SpatialHandle> nearby = {};
+        std::vector<double> move_times = {};
+        std::vector<double> gather_times = {};
+        std::vector<double> scan_times = {};
+        std::vector<double> radius_times = {};
+        long long gathered = 0;
+        long long found = 0;
+
+        for (int frame = 0; frame < frame_count; ++frame) {
+            auto move_start = std::chrono::steady_clock::now();
+            for (int i = 0; i < object_count; ++i) {
+                glm::vec2 pos = positions[i] + velocities[i];
+                if (pos.x < 0 || pos.x >= WORLD_SIZE) {
+                    velocities[i].x = -velocities[i].x;
+                }
+                if (pos.y < 0 || pos.y >= WORLD_SIZE) {
+                    velocities[i].y = -velocities[i].y;
+                }
+                positions[i] = pos;
+                grid.move(handles[i], pos);
+            }
+            auto move_end = std::chrono::steady_clock::now();
+
+            int visible_count = grid.gather_instances(view_lower, view_upper, instances.data(), object_count);
+            auto gather_end = std::chrono::steady_clock::now();
+
+            int scan_count = 0;
+            for (const glm::vec2& pos : positions) {
+                if (pos.x >= view_lower.x && pos.x <= view_upper.x && pos.y >= view_lower.y && pos.y <= view_upper.y) {
+                    instances[scan_count++] = pos;
+                }
+            }
+            auto scan_end = std::chrono::steady_clock::now();
+
+            for (const glm::vec2& center : query_centers) {
+                grid.query_radius(center, radius, nearby);
+                found += nearby.size();
+            }
+            auto radius_end = std::chrono::steady_clock::now();
+
+            if (visible_count != scan_count) {
+                throw std::runtime_error("Grid gathered " + std::to_string(visible_count) + " objects, the scan found " + std::to_string(scan_count));
+            }
+            gathered += visible_count;
+
+            move_times.push_back(elapsed_ms(move_start, move_end));
+            gather_times.push_back(elapsed_ms(move_end, gather_end));
+            scan_times.push_back(elapsed_ms(gather_end, scan_end));
+            radius_times.push_back(elapsed_ms(scan_end, radius_end));
+        }
+
+        output << "{\"objects\":" << object_count << ",\"frames\":" << frame_count << ",\"cell_size\":" << cell_size
+               << ",\"visible_per_frame\":" << gathered / frame_count << ",\"nearby_per_query\":" << found / ((long long) frame_count * radius_query_count)
+               << ",\"move_ms\":" << to_json(summarize(move_times))
+               << ",\"gather_ms\":" << to_json(summarize(gather_times))
+               << ",\"scan_ms\":" << to_json(summarize(scan_times))
+               << ",\"radius_queries_ms\":" << to_json(summarize(radius_times)) << "}" << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,56 @@
+#include <iostream>
+#include <random>
+#include <tilemap.h>
+
+// Writes a generated test map, for trying out tilemap streaming until maps come from an editor.
+//
+// Usage: tilemap_tool out.tmap [width in chunks] [height in chunks]
+//
+// Tiles are 10 game units in chunks of 32x32 tiles. Kind 1 is grass, 2 is water and 3 is a road along every fourth chunk border.
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cout << "Usage: tilemap_tool out.tmap [width in chunks] [height in chunks]" << std::endl;
+        return 1;
+    }
+    std::string path = argv[1];
+    uint32_t width_in_chunks = argc > 2 ? std::stoi(argv[2]) : 64;
+    uint32_t height_in_chunks = argc > 3 ? std::stoi(argv[3]) : 64;
+
+    const uint32_t chunk_size = 32;
+    const float tile_size = 10.0f;
+    uint32_t width = width_in_chunks * chunk_size;
+    uint32_t height = height_in_chunks * chunk_size;
+
+    // Grass with random ponds, fixed seed so the same arguments always give the same map.
+    std::mt19937 generator(1234);
+    std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+    std::vector<glm::vec2> ponds(width * height / 2000);
+    for (glm::vec2& pond : ponds) {
+        pond = glm::vec2(distribution(generator) * width, distribution(generator) * height);
+    }
+
+    std::vector<uint16_t> tiles(width * height, 1);
+    for (const glm::vec2& pond : ponds) {
+        int radius = 2 + (int) (distribution(generator) * 6);
+        for (int y = std::max((int) pond.y - radius, 0); y < std::min((int) pond.y + radius, (int) height); ++y) {
+            for (int x = std::max((int) pond.x - radius, 0); x < std::min((int) pond.x + radius, (int) width); ++x) {
+                glm::vec2 offset = glm::vec2(x, y) - pond;
+                if (glm::dot(offset, offset) < radius * radius) {
+                    tiles[y * width + x] = 2;
+                }
+            }
+        }
+    }
+    for (uint32_t y = 0; y < height; ++y) {
+        for (uint32_t x = 0; x < width; ++x) {
+            if (x % (4 * chunk_size) == 0 || y % (4 * chunk_size) == 0) {
+                tiles[y * width + x] = 3;
+            }
+        }
+    }
+
+    write_tilemap_file(path, tiles, width, height, chunk_size, tile_size);
+    std::cout << "Wrote " << width << "x" << height << " tiles to " << path << std::endl;
+    return 0;
+}